@@ -2,6 +2,7 @@
 #include <stdlib.h>
 
 #include "../../utility/log.h"
+#include "../../utility/trace.h"
 #include "./jpeg.h"
 
 void DecodeHuffmanTable(HTable table)
@@ -50,64 +51,45 @@ void DecodeHuffmanTable(HTable table)
     }
 }
 
-void PrintCode(int length, int code)
+// The code as a string of length bits, msb first
+static void CodeString(int length, int code, char out[17])
 {
-
     for (int i = length - 1; i >= 0; --i)
-    {
-        if (code & (1 << i))
-            printf("1");
-        else
-            printf("0");
-    }
+        *out++ = code & (1 << i) ? '1' : '0';
+    *out = '\0';
 }
 
-void PrettyPrintHuffman(HTable htable)
+bool GenerateHuffmanCodes(HTable *htable)
 {
-    Log(Warning, "\n****************************** Pretty Printing Huffman ******************************");
-    int      start = 0;
-
-    uint16_t code_length[16];
-    uint16_t offset[16] = {0};
-
-    for (int i = 1; i < 16; ++i)
+    // Codes of one length are consecutive, going one bit longer doubles the next code (Annex C)
+    uint32_t code  = 0;
+    int      index = 0;
+    for (int length = 1; length <= 16; ++length)
     {
-        offset[i] = htable.code_length[i - 1] + offset[i - 1];
-        offset[i] = offset[i] << 1;
+        for (int i = 0; i < htable->code_length[length - 1] && index < htable->total_codes; ++i)
+            htable->huffman_code[index++] = code++;
+        if (code > (1u << length))
+            return false;
+        code = code << 1;
     }
-    memcpy(code_length, htable.code_length, sizeof(code_length));
+    return true;
+}
 
-    for (int i = 0; i < htable.total_codes; ++i)
-    {
-        if (htable.code_length[start] == 0)
-            for (int k = start; k < 16; ++k)
-                if (htable.code_length[k] != 0)
-                {
-                    start = k;
-                    break;
-                }
-
-       htable.huffman_code[i] = offset[start]++;
-       htable.code_length[start]--;
-    }
+void PrettyPrintHuffman(HTable htable)
+{
+    TRACE(TRACE_TABLES, "DHT %s %d : %d codes", htable.type == AC ? "AC" : "DC", htable.id, htable.total_codes);
+    GenerateHuffmanCodes(&htable);
 
-    start = 0;
-    for (uint8_t i = 0; i < htable.total_codes; ++i)
+    int index = 0;
+    for (int length = 1; length <= 16; ++length)
     {
-        if (code_length[start] == 0)
-            for (int k = start; k < 16; ++k)
-                if (code_length[k] != 0)
-                {
-                    start = k;
-                    break;
-                }
-        printf("Index : %d -> ", i);
-        PrintCode(start + 1, htable.huffman_code[i]);
-        code_length[start]--;
-
-        putchar('\n');
+        for (int i = 0; i < htable.code_length[length - 1] && index < htable.total_codes; ++i, ++index)
+        {
+            char code[17];
+            CodeString(length, htable.huffman_code[index], code);
+            TRACE(TRACE_TABLES, "  index %3d : %16s -> %02X", index, code, htable.huffman_val[index]);
+        }
     }
-    printf("\n8th Huffman val is %02X.\n",htable.huffman_val[7]);
 }
 
 bool HuffmanSegment(JPEG *jpeg)
@@ -123,76 +105,72 @@ bool HuffmanSegment(JPEG *jpeg)
         uint8_t DC_AC = (jpeg->buffer[jpeg->pos + count] & 0x10) >> 4;
         uint8_t id    = jpeg->buffer[jpeg->pos + count] & 0x0F;
 
+        // A table redefined with the same class and id (common between progressive scans) replaces the old one
+        uint8_t slot  = huffman_tables->count;
+        for (uint8_t k = 0; k < huffman_tables->count; ++k)
+            if (huffman_tables->tables[k].id == id && huffman_tables->tables[k].type == (DC_AC ? AC : DC))
+                slot = k;
+        const bool replacing = slot < huffman_tables->count;
+
+        if (slot >= 6 || count + 17 > length)
+        {
+            Log(Error, "Too many huffman tables or truncated huffman segment.");
+            return SetJPEGError(jpeg, JPEG_ERR_BAD_HUFFMAN);
+        }
+
         count         = count + 1;
         Log(Info, "Length : %u, DC_AC : %02X, id : %02X", length, DC_AC, id);
 
         if (DC_AC == 0)
-            huffman_tables->tables[huffman_tables->count].type = DC;
+            huffman_tables->tables[slot].type = DC;
         else
-            huffman_tables->tables[huffman_tables->count].type = AC;
+            huffman_tables->tables[slot].type = AC;
 
-        huffman_tables->tables[huffman_tables->count].id = id;
+        huffman_tables->tables[slot].id = id;
 
         for (int i = 0; i < 16; ++i)
-            huffman_tables->tables[huffman_tables->count].code_length[i] = jpeg->buffer[jpeg->pos + count++];
+            huffman_tables->tables[slot].code_length[i] = jpeg->buffer[jpeg->pos + count++];
 
-#ifdef _JPEG_DEBUG
-        Log(Info, "Found huffman encoding for DC/AC Values");
-        for (int i = 0; i < 16; ++i)
-            printf("\nCodewords of length %d : %d.", i + 1, code_length[i]);
-#endif
         int total_codes = 0;
         for (int i = 0; i < 16; ++i)
-            total_codes += huffman_tables->tables[huffman_tables->count].code_length[i];
+            total_codes += huffman_tables->tables[slot].code_length[i];
+
+        if (total_codes > 256 || count + total_codes > length)
+        {
+            Log(Error, "Huffman table with %d codes doesn't fit in its segment.", total_codes);
+            return SetJPEGError(jpeg, JPEG_ERR_BAD_HUFFMAN);
+        }
 
         // We now need an dynamic array of length total codes which will contain the equivalent symbol for given
         // code length for DC components only
 
-        huffman_tables->tables[huffman_tables->count].total_codes = total_codes;
+        huffman_tables->tables[slot].total_codes = total_codes;
         // TODO :: Glare here
-        huffman_tables->tables[huffman_tables->count].huffman_val =
+        if (replacing)
+        {
+            free(huffman_tables->tables[slot].huffman_val);
+            free(huffman_tables->tables[slot].huffman_code);
+        }
+        huffman_tables->tables[slot].huffman_val =
             malloc(sizeof(*huffman_tables->tables[0].huffman_val) * total_codes);
-        huffman_tables->tables[huffman_tables->count].huffman_code =
+        huffman_tables->tables[slot].huffman_code =
             malloc(sizeof(*huffman_tables->tables[0].huffman_code) * total_codes);
-
-        for (int i = 0; i < total_codes; ++i)
-            huffman_tables->tables[huffman_tables->count].huffman_val[i] = jpeg->buffer[jpeg->pos + count++];
-
-#ifdef _JPEG_DEBUG
-        uint16_t offset[16] = {0};
-        for (int i = 1; i < 16; ++i)
+        if (!huffman_tables->tables[slot].huffman_val ||
+            !huffman_tables->tables[slot].huffman_code)
         {
-            offset[i] = offset[i - 1] + huffman_tables->tables[huffman_tables->count].code_length[i - 1];
-            offset[i] <<= 1;
+            // Count it anyway so that the cleanup frees whichever one was allocated
+            huffman_tables->count = replacing ? huffman_tables->count : huffman_tables->count + 1;
+            return SetJPEGError(jpeg, JPEG_ERR_OUT_OF_MEMORY);
         }
-        // Read each code using huffman table
-        // Now write the actual huffman codes to it or we could have just used offset array
-        /* int start = 0; */
-
-        /* for (int i = 0; i < total_codes; ++i) */
-        /* { */
-        /*     if (huffman_tables->tables[huffman_tables->count].code_length[start] == 0) */
-        /*         for (int k = start; k < 16; ++k) */
-        /*             if (huffman_tables->tables[huffman_tables->count].code_length[k] != 0) */
-        /*             { */
-        /*                 start = k; */
-        /*                 break; */
-        /*             } */
-
-        /*     // This should have been trivial task, but my little stupid mind won't work. */
-        /*     huffman_tables->tables[huffman_tables->count]..huffman_code[i] = offset[start]++; */
-        /*     code_length[start]--; */
-        /* } */
 
         for (int i = 0; i < total_codes; ++i)
-        {
-            printf("Length using huffman encoding are : %d.\n",
-                   huffman_tables->tables[huffman_tables->count].huffman_code[i]);
-        }
-        PrettyPrintHuffman(huffman_tables->tables[huffman_tables->count]);
-#endif
+            huffman_tables->tables[slot].huffman_val[i] = jpeg->buffer[jpeg->pos + count++];
 
-        huffman_tables->count++;
+        if (TraceEnabled(TRACE_TABLES))
+            PrettyPrintHuffman(huffman_tables->tables[slot]);
+
+        if (!replacing)
+            huffman_tables->count++;
     }
 
     Log(Warning, "Length : %d and count : %d", length, count);
@@ -214,8 +192,21 @@ bool QuantizationSegment(JPEG *jpeg)
         uint8_t id                                           = jpeg->buffer[jpeg->pos + count] & 0x0F;
         uint8_t precision                                    = jpeg->buffer[jpeg->pos + count] & 0xF0;
 
-        quant_tables->qtables[quant_tables->count].precision = precision;
-        quant_tables->qtables[quant_tables->count].id        = id;
+        // Redefining an id replaces the old table
+        uint8_t slot = quant_tables->count;
+        for (uint8_t k = 0; k < quant_tables->count; ++k)
+            if (quant_tables->qtables[k].id == id)
+                slot = k;
+
+        // Only 8 bit tables are handled
+        if (slot >= 6 || precision || count + 65 > length)
+        {
+            Log(Error, "Unsupported or truncated quantization table.");
+            return SetJPEGError(jpeg, JPEG_ERR_BAD_QUANTIZATION);
+        }
+
+        quant_tables->qtables[slot].precision = precision;
+        quant_tables->qtables[slot].id        = id;
 
         Log(Info, "Precision of Quantization Segment is : %d and %d.", precision, id);
         count++;
@@ -224,23 +215,111 @@ bool QuantizationSegment(JPEG *jpeg)
         {
             for (int j = 0; j < 8; ++j)
             {
-                quant_tables->qtables[quant_tables->count].data[jpeg->zigzag.order[index++]] = jpeg->buffer[jpeg->pos + count++];
+                quant_tables->qtables[slot].data[jpeg->zigzag.order[index++]] = jpeg->buffer[jpeg->pos + count++];
             }
         }
 
-        Log(Warning, "------------------------------ Quantization Table extracted is : ------------------------------");
-        index = 0;
-        for (int i = 0; i < 8; ++i)
+        for (int i = 0; TraceEnabled(TRACE_TABLES) && i < 8; ++i)
         {
-            for (int j = 0; j < 8; ++j)
-            {
-                printf("%10u", quant_tables->qtables[quant_tables->count].data[index++]);
-            }
-            putchar('\n');
+            const uint16_t *row = quant_tables->qtables[slot].data + i * 8;
+            TRACE(TRACE_TABLES, "DQT %d : %4u %4u %4u %4u %4u %4u %4u %4u", id, row[0], row[1], row[2], row[3], row[4],
+                  row[5], row[6], row[7]);
         }
-        quant_tables->count++;
+        if (slot == quant_tables->count)
+            quant_tables->count++;
     }
     jpeg->pos += length;
     Log(Warning, "Count : %d and Length %d.", count, length);
     return true;
 }
+
+// Typical huffman tables of Annex K.3 as a DHT segment (length first, then DC/AC luminance with id 0 and DC/AC
+// chrominance with id 1). Motion JPEG frames usually leave their DHT out and rely on these
+static uint8_t default_huffman_segment[] = {
+    0x01, 0xA2,
+    // DC luminance
+    0x00, 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+    // AC luminance
+    0x10, 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7D,
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08, 0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1, 0xF0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0A, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7,
+    0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5,
+    0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1, 0xE2,
+    0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+    0xF9, 0xFA,
+    // DC chrominance
+    0x01, 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+    // AC chrominance
+    0x11, 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77,
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33, 0x52, 0xF0,
+    0x15, 0x62, 0x72, 0xD1, 0x0A, 0x16, 0x24, 0x34, 0xE1, 0x25, 0xF1, 0x17, 0x18, 0x19, 0x1A, 0x26,
+    0x27, 0x28, 0x29, 0x2A, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5,
+    0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3,
+    0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
+    0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+    0xF9, 0xFA};
+
+bool DefaultHuffmanTables(JPEG *jpeg)
+{
+    // Goes through the regular DHT parser with the buffer pointed at the built in segment for a moment
+    uint8_t *buffer = jpeg->buffer;
+    uint64_t pos    = jpeg->pos;
+    uint64_t size   = jpeg->size;
+
+    jpeg->buffer    = default_huffman_segment;
+    jpeg->pos       = 0;
+    jpeg->size      = sizeof(default_huffman_segment);
+    bool loaded     = HuffmanSegment(jpeg);
+
+    jpeg->buffer    = buffer;
+    jpeg->pos       = pos;
+    jpeg->size      = size;
+    return loaded;
+}
+
+void ScaledQuantizationTable(QTable *table, uint8_t id, uint32_t quality)
+{
+    // Annex K.1 and K.2, in natural order like the tables QuantizationSegment loads
+    static const uint8_t luma[64] = {
+        16, 11, 10, 16, 24,  40,  51,  61,  12, 12, 14, 19, 26,  58,  60,  55,  14, 13, 16, 24, 40,  57,  69,  56,
+        14, 17, 22, 29, 51,  87,  80,  62,  18, 22, 37, 56, 68,  109, 103, 77,  24, 35, 55, 64, 81,  104, 113, 92,
+        49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99};
+    static const uint8_t chroma[64] = {
+        17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99, 24, 26, 56, 99, 99, 99,
+        99, 99, 47, 66, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99};
+
+    // IJG scaling, 50 gives the tables as they are
+    quality        = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+    uint32_t scale = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+
+    table->precision = 0;
+    table->id        = id;
+    for (int i = 0; i < 64; ++i)
+    {
+        uint32_t value = ((id ? chroma[i] : luma[i]) * scale + 50) / 100;
+        table->data[i] = value < 1 ? 1 : value > 255 ? 255 : value;
+    }
+}
+
+void ClearJPEGTables(JPEG *jpeg)
+{
+    for (int i = 0; i < jpeg->huffman_tables.count; ++i)
+    {
+        free(jpeg->huffman_tables.tables[i].huffman_val);
+        free(jpeg->huffman_tables.tables[i].huffman_code);
+    }
+    jpeg->huffman_tables.count      = 0;
+    jpeg->quantization_tables.count = 0;
+}
@@ -0,0 +1,398 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "./entropystats.h"
+#include "./jpeg.h"
+#include "./perfcounters.h"
+#include "./sinks.h"
+
+// jpeg_bench [--runs n] [--json results.json] [--out file] [--gray] [--counters] [--entropy-stats stats.json]
+//            <files or directories>...
+// Decodes every input n times, after one warm up run that isn't counted, and reports the median and p99 wall time of
+// every decoder stage. Directories are searched (not recursively) for .jpg and .jpeg files. --counters also reads the
+// perf_event_open counters around every stage and reports their mean per megapixel. --entropy-stats sums up the
+// entropy decoder statistics of every input (see entropystats.h), taken from the warm up run only
+
+#define STAGE_TOTAL JPEG_STAGE_COUNT // per run wall time of the whole DecodeJPEG call
+
+typedef struct BenchResult
+{
+    char     *path;
+    uint64_t  file_size;
+    uint32_t  width;
+    uint32_t  height;
+    bool      progressive;
+    JPEGError error;
+    uint32_t  runs;
+    uint64_t *ns[JPEG_STAGE_COUNT + 1]; // ns[stage][run]
+    uint64_t  events[JPEG_STAGE_COUNT + 1][JPEG_COUNTER_COUNT]; // summed over the runs
+} BenchResult;
+
+typedef struct BenchStats
+{
+    double median_ms;
+    double p99_ms;
+} BenchStats;
+
+static uint64_t Now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static int CompareU64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest rank p99, which is the slowest run below 100 runs
+static BenchStats Stats(const uint64_t *ns, uint32_t runs)
+{
+    BenchStats stats = {0};
+    uint64_t  *sorted = malloc(sizeof(*sorted) * runs);
+    if (!sorted || !runs)
+    {
+        free(sorted);
+        return stats;
+    }
+    memcpy(sorted, ns, sizeof(*sorted) * runs);
+    qsort(sorted, runs, sizeof(*sorted), CompareU64);
+
+    stats.median_ms = (runs % 2 ? sorted[runs / 2] : (sorted[runs / 2 - 1] + sorted[runs / 2]) / 2.0) / 1e6;
+    stats.p99_ms    = sorted[(99 * runs + 99) / 100 - 1] / 1e6;
+    free(sorted);
+    return stats;
+}
+
+static const char *StageLabel(int stage)
+{
+    return stage == STAGE_TOTAL ? "total" : JPEGStageName(stage);
+}
+
+static int JPEGEntry(const struct dirent *entry)
+{
+    return IsJPEGPath(entry->d_name);
+}
+
+// Appends path, or the JPEGs inside it, to the input list
+static bool CollectInputs(const char *path, char ***inputs, uint32_t *count)
+{
+    struct stat info;
+    if (stat(path, &info))
+    {
+        fprintf(stderr, "Can't read %s\n", path);
+        return false;
+    }
+
+    struct dirent **entries = NULL;
+    int             found   = 1;
+    if (S_ISDIR(info.st_mode) && (found = scandir(path, &entries, JPEGEntry, alphasort)) < 0)
+        return false;
+
+    char **grown = realloc(*inputs, sizeof(*grown) * (*count + found));
+    if (!grown)
+        return false;
+    *inputs = grown;
+
+    for (int i = 0; i < found; ++i)
+    {
+        if (!entries)
+            grown[(*count)++] = strdup(path);
+        else
+        {
+            size_t size = strlen(path) + strlen(entries[i]->d_name) + 2;
+            grown[*count] = malloc(size);
+            if (grown[*count])
+                snprintf(grown[(*count)++], size, "%s/%s", path, entries[i]->d_name);
+            free(entries[i]);
+        }
+    }
+    free(entries);
+    return true;
+}
+
+static void RunBench(BenchResult *result, uint32_t runs, JPEGOutputFormat format, JPEGRowSink *sink,
+                     PerfCounters *counters, JPEGEntropyStats *stats)
+{
+    JPEG        jpeg    = {0};
+    JPEGTimings timings = {.counters = counters};
+
+    result->error       = LoadJpegFile(&jpeg, result->path);
+    result->file_size   = jpeg.size;
+    for (int stage = 0; stage <= STAGE_TOTAL && result->error == JPEG_OK; ++stage)
+    {
+        result->ns[stage] = calloc(runs, sizeof(*result->ns[stage]));
+        if (!result->ns[stage])
+            result->error = JPEG_ERR_OUT_OF_MEMORY;
+    }
+
+    // The file stays loaded, every run decodes the same buffer with the allocations of the previous one
+    uint8_t *data = jpeg.buffer;
+    uint64_t size = jpeg.size;
+    for (uint32_t run = 0; run <= runs && result->error == JPEG_OK; ++run)
+    {
+        ResetJPEGDecoder(&jpeg, data, size);
+        jpeg.format        = format;
+        jpeg.sink          = sink;
+        jpeg.timings       = &timings;
+        jpeg.entropy_stats = run ? NULL : stats;
+
+        uint64_t start  = Now();
+        result->error   = DecodeJPEG(&jpeg);
+        uint64_t total  = Now() - start;
+        if (!run || result->error != JPEG_OK)
+            continue;
+
+        for (int stage = 0; stage < JPEG_STAGE_COUNT; ++stage)
+        {
+            result->ns[stage][run - 1] = timings.ns[stage];
+            for (int i = 0; i < JPEG_COUNTER_COUNT; ++i)
+            {
+                result->events[stage][i]       += timings.events[stage][i];
+                result->events[STAGE_TOTAL][i] += timings.events[stage][i];
+            }
+        }
+        result->ns[STAGE_TOTAL][run - 1] = total;
+        result->runs                     = run;
+    }
+
+    result->width       = jpeg.output.width;
+    result->height      = jpeg.output.height;
+    result->progressive = jpeg.img.progressive;
+    CleanUpDecoder(&jpeg);
+}
+
+static double Throughput(const BenchResult *result)
+{
+    BenchStats total = Stats(result->ns[STAGE_TOTAL], result->runs);
+    return total.median_ms > 0 ? (double)result->width * result->height / (total.median_ms * 1e3) : 0;
+}
+
+// Mean count of one run divided by the megapixels of the image
+static double EventsPerMP(const BenchResult *result, int stage, JPEGCounter counter)
+{
+    double megapixels = (double)result->width * result->height / 1e6;
+    return result->runs && megapixels > 0 ? result->events[stage][counter] / (result->runs * megapixels) : 0;
+}
+
+// Per megapixel counts of every stage, plus instructions per cycle which tells apart the stages stalling on branches
+// (huffman) or memory (color, output) from the ones that don't
+static void PrintCounters(FILE *fp, const BenchResult *result, const PerfCounters *counters)
+{
+    static const char *labels[JPEG_COUNTER_COUNT] = {"cycles/MP",  "instr/MP",    "br-miss/MP",
+                                                     "L1D-miss/MP", "LLC-miss/MP", "faults/MP"};
+    bool               ipc                        = PerfCounterAvailable(counters, JPEG_COUNTER_CYCLES) &&
+                       PerfCounterAvailable(counters, JPEG_COUNTER_INSTRUCTIONS);
+
+    fprintf(fp, "  %-10s", "stage");
+    for (int i = 0; i < JPEG_COUNTER_COUNT; ++i)
+        fprintf(fp, " %14s", labels[i]);
+    fprintf(fp, " %6s\n", "IPC");
+
+    for (int stage = 0; stage <= STAGE_TOTAL; ++stage)
+    {
+        fprintf(fp, "  %-10s", StageLabel(stage));
+        for (int i = 0; i < JPEG_COUNTER_COUNT; ++i)
+        {
+            if (PerfCounterAvailable(counters, i))
+                fprintf(fp, " %14.0f", EventsPerMP(result, stage, i));
+            else
+                fprintf(fp, " %14s", "-");
+        }
+        uint64_t cycles = result->events[stage][JPEG_COUNTER_CYCLES];
+        if (ipc && cycles)
+            fprintf(fp, " %6.2f\n", (double)result->events[stage][JPEG_COUNTER_INSTRUCTIONS] / cycles);
+        else
+            fprintf(fp, " %6s\n", "-");
+    }
+    fprintf(fp, "\n");
+}
+
+static void PrintTable(FILE *fp, const BenchResult *result, const PerfCounters *counters)
+{
+    if (result->error != JPEG_OK)
+    {
+        fprintf(fp, "%s : %s\n\n", result->path, JPEGErrorString(result->error));
+        return;
+    }
+
+    fprintf(fp, "%s  %ux%u %s, %lu bytes, %u runs\n", result->path, result->width, result->height,
+            result->progressive ? "progressive" : "baseline", result->file_size, result->runs);
+    fprintf(fp, "  %-10s %12s %12s\n", "stage", "median ms", "p99 ms");
+    for (int stage = 0; stage <= STAGE_TOTAL; ++stage)
+    {
+        BenchStats stats = Stats(result->ns[stage], result->runs);
+        fprintf(fp, "  %-10s %12.3f %12.3f\n", StageLabel(stage), stats.median_ms, stats.p99_ms);
+    }
+    fprintf(fp, "  %-10s %12.2f MP/s\n\n", "throughput", Throughput(result));
+    if (counters)
+        PrintCounters(fp, result, counters);
+}
+
+static void PrintJSONString(FILE *fp, const char *str)
+{
+    fputc('"', fp);
+    for (; *str; ++str)
+    {
+        if (*str == '"' || *str == '\\')
+            fprintf(fp, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            fprintf(fp, "\\u%04x", *str);
+        else
+            fputc(*str, fp);
+    }
+    fputc('"', fp);
+}
+
+static bool WriteJSON(const char *path, const BenchResult *results, uint32_t count, uint32_t runs,
+                      const PerfCounters *counters)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+        return false;
+
+    fprintf(fp, "{\n  \"runs\": %u,\n  \"results\": [", runs);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        const BenchResult *result = results + i;
+        fprintf(fp, "%s\n    {\"file\": ", i ? "," : "");
+        PrintJSONString(fp, result->path);
+        if (result->error != JPEG_OK)
+        {
+            fprintf(fp, ", \"error\": ");
+            PrintJSONString(fp, JPEGErrorString(result->error));
+            fprintf(fp, "}");
+            continue;
+        }
+
+        fprintf(fp, ", \"bytes\": %lu, \"width\": %u, \"height\": %u, \"progressive\": %s, \"runs\": %u,",
+                result->file_size, result->width, result->height, result->progressive ? "true" : "false",
+                result->runs);
+        fprintf(fp, " \"megapixels_per_second\": %.4f,\n     \"stages\": {", Throughput(result));
+        for (int stage = 0; stage <= STAGE_TOTAL; ++stage)
+        {
+            BenchStats stats = Stats(result->ns[stage], result->runs);
+            fprintf(fp, "%s\"%s\": {\"median_ms\": %.6f, \"p99_ms\": %.6f", stage ? ",\n       " : "",
+                    StageLabel(stage), stats.median_ms, stats.p99_ms);
+
+            // Only the counters that could be opened, as the mean per megapixel
+            for (int i = 0; counters && i < JPEG_COUNTER_COUNT; ++i)
+                if (PerfCounterAvailable(counters, i))
+                    fprintf(fp, ", \"%s_per_mp\": %.1f", JPEGCounterName(i), EventsPerMP(result, stage, i));
+            fprintf(fp, "}");
+        }
+        fprintf(fp, "}}");
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    return !fclose(fp);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t         runs       = 10;
+    const char      *json       = NULL;
+    JPEGOutputFormat format     = JPEG_OUTPUT_NATIVE;
+    OutputFile       file       = {.path = "/dev/null", .format = OUTPUT_FILE_RAW};
+    char           **inputs     = NULL;
+    uint32_t         count      = 0;
+    bool             counted    = false;
+    const char      *stats_path = NULL;
+
+    for (int arg = 1; arg < argc; ++arg)
+    {
+        if (!strcmp(argv[arg], "--runs") && arg + 1 < argc)
+            runs = atoi(argv[++arg]);
+        else if (!strcmp(argv[arg], "--json") && arg + 1 < argc)
+            json = argv[++arg];
+        else if (!strcmp(argv[arg], "--gray"))
+            format = JPEG_OUTPUT_GRAY;
+        else if (!strcmp(argv[arg], "--counters"))
+            counted = true;
+        else if (!strcmp(argv[arg], "--entropy-stats") && arg + 1 < argc)
+        {
+            stats_path = argv[++arg];
+            if (!JPEG_ENTROPY_STATS)
+                fprintf(stderr, "Entropy statistics aren't compiled in, rebuild with -DJPEG_ENTROPY_STATS=1\n");
+        }
+        // Where the output stage writes to, raw pixels to /dev/null unless given
+        else if (!strcmp(argv[arg], "--out") && arg + 1 < argc)
+        {
+            file.path = argv[++arg];
+            if (!OutputFileFormatFromPath(file.path, &file.format))
+            {
+                fprintf(stderr, "Output should be a .bmp, .ppm, .pgm, .pnm, .raw, .rgb or .gray file\n");
+                return -1;
+            }
+        }
+        else if (!CollectInputs(argv[arg], &inputs, &count))
+            return -1;
+    }
+    if (!count || !runs)
+    {
+        fprintf(stderr, "USAGE : jpeg_bench [--runs n] [--json results.json] [--out file] [--gray] [--counters] "
+                        "[--entropy-stats stats.json] <jpegs or dirs>\n");
+        return -1;
+    }
+
+    PerfCounters  perf     = {0};
+    PerfCounters *counters = NULL;
+    if (counted)
+    {
+        if (OpenPerfCounters(&perf))
+            counters = &perf;
+        else
+            fprintf(stderr, "No perf counters could be opened, check /proc/sys/kernel/perf_event_paranoid\n");
+    }
+
+    BenchResult      *results = calloc(count, sizeof(*results));
+    JPEGEntropyStats *stats   = stats_path && JPEG_ENTROPY_STATS ? calloc(1, sizeof(*stats)) : NULL;
+    JPEGRowSink       sink    = OutputFileSink(&file);
+    if (!results || (stats_path && JPEG_ENTROPY_STATS && !stats))
+        return -1;
+
+    bool failed = false;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        results[i].path = inputs[i];
+        RunBench(results + i, runs, format, &sink, counters, stats);
+        PrintTable(stdout, results + i, counters);
+        fflush(stdout);
+        failed = failed || results[i].error != JPEG_OK;
+    }
+
+    if (json && !WriteJSON(json, results, count, runs, counters))
+    {
+        fprintf(stderr, "Failed to write %s\n", json);
+        failed = true;
+    }
+
+    if (stats)
+    {
+        FILE *fp      = fopen(stats_path, "w");
+        bool  written = fp && WriteEntropyStatsJSON(fp, stats);
+        if ((fp && fclose(fp)) || !written)
+        {
+            fprintf(stderr, "Failed to write %s\n", stats_path);
+            failed = true;
+        }
+    }
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        for (int stage = 0; stage <= STAGE_TOTAL; ++stage)
+            free(results[i].ns[stage]);
+        free(results[i].path);
+    }
+    free(results);
+    free(stats);
+    free(inputs);
+    if (counters)
+        ClosePerfCounters(counters);
+    return failed ? -2 : 0;
+}
@@ -1,7 +1,9 @@
 #include <stdlib.h>
 
 #include "../../utility/log.h"
+#include "../../utility/trace.h"
 #include "./bitstream.h"
+#include "./entropystats.h"
 #include "jpeg.h"
 
 typedef struct Symbol
@@ -14,6 +16,7 @@ bool ClearBitStream(BitStream* bit_stream, JPEG* img)
 {
     bit_stream->len    = 0;
     bit_stream->buffer = 0;
+    return true;
 }
 
 uint64_t ExtractBits(BitStream *bit_stream, uint64_t count, JPEG *img)
@@ -25,7 +28,8 @@ uint64_t ExtractBits(BitStream *bit_stream, uint64_t count, JPEG *img)
         if (img->hstream.pos >= img->hstream.size)
         {
             Log(Error, "Decoding went too far ahead");
-            return -1;
+            SetJPEGError(img, JPEG_ERR_TRUNCATED);
+            return 0;
         }
         bit_stream->buffer = (bit_stream->buffer << 8) | img->hstream.buffer[img->hstream.pos++];
         bit_stream->len    = bit_stream->len + 8;
@@ -55,8 +59,10 @@ Symbol DecodeHuffmanSymbol(BitStream *bit_stream, JPEG *jpeg, HTable *htable)
             if (index + code - first >= htable->total_codes)
             {
                 Log(Error, "Index out of range");
-                exit(-1);
+                SetJPEGError(jpeg, JPEG_ERR_BAD_HUFFMAN);
+                return (Symbol){0};
             }
+            CountEntropySymbol(jpeg, htable, i, htable->huffman_val[index + code - first]);
             return (Symbol){i, htable->huffman_val[index + code - first]};
         }
 
@@ -66,52 +72,48 @@ Symbol DecodeHuffmanSymbol(BitStream *bit_stream, JPEG *jpeg, HTable *htable)
         code  = code << 1;
     }
     Log(Error, "Failed to decode huffman code");
-    exit(0);
+    SetJPEGError(jpeg, JPEG_ERR_BAD_HUFFMAN);
     return (Symbol){0};
 }
 
 bool ExtractHuffmanEncoded(JPEG *jpeg)
 {
     // start from jpeg->current pos and extract all the relevant huffman encoded stream
-    uint8_t  current = 0;
-    uint32_t hold    = jpeg->pos;
-    uint8_t  last    = jpeg->buffer[jpeg->pos++];
+    // Stuffed 0xFF 0x00 become 0xFF, fill bytes and restart markers are dropped, any other marker ends the scan and is
+    // left at jpeg->pos for the marker parser
+    jpeg->hstream.pos = 0;
     while (jpeg->pos < jpeg->size)
     {
-        current = jpeg->buffer[jpeg->pos++];
-        if (last == 0xFF)
+        uint8_t current = jpeg->buffer[jpeg->pos];
+        if (current != 0xFF)
         {
-            // see if current is any weird marker
-            if (current == EOI)
-            {
-                jpeg->hstream.size = jpeg->hstream.pos;
-                jpeg->hstream.pos  = 0;
-                Log(Warning, "Length of the encoded stream : %d.", jpeg->hstream.size);
-                Log(Warning, "End of the File Parsed");
-                return true;
-            }
-            else if (current >= RST0 && current <= RST7)
-            {
-                // Do nothing for now
-                current = jpeg->buffer[jpeg->pos++]; // Basically skipping it
-            }
-            if (current == 0xFF)
-            {
-                continue;
-            }
-            else if (current == 0x00)
-            {
-                jpeg->hstream.buffer[jpeg->hstream.pos++] = last;
-                current                                   = jpeg->buffer[jpeg->pos++];
-            }
+            jpeg->hstream.buffer[jpeg->hstream.pos++] = current;
+            jpeg->pos++;
+            continue;
         }
-        else
-            jpeg->hstream.buffer[jpeg->hstream.pos++] = last;
 
-        last = current;
+        // the file buffer has one spare byte at the end, so this look ahead stays in bounds
+        uint8_t next = jpeg->buffer[jpeg->pos + 1];
+        if (next == 0x00)
+        {
+            jpeg->hstream.buffer[jpeg->hstream.pos++] = 0xFF;
+            jpeg->pos += 2;
+        }
+        else if (next == 0xFF)
+            jpeg->pos++; // fill byte
+        else if (next >= RST0 && next <= RST7)
+            jpeg->pos += 2; // Restart handling is done by the decoder, just skip it
+        else
+        {
+            jpeg->hstream.size = jpeg->hstream.pos;
+            jpeg->hstream.pos  = 0;
+            Log(Warning, "Length of the encoded stream : %d.", jpeg->hstream.size);
+            Log(Warning, "End of the scan reached with marker %02X", next);
+            return true;
+        }
     }
     Log(Error, "Invalid JPEG Encoded Stream, its a mess");
-    return false;
+    return SetJPEGError(jpeg, JPEG_ERR_TRUNCATED);
 }
 
 int32_t InterpretValue(uint64_t val, uint8_t len, JPEG *jpeg)
@@ -121,7 +123,7 @@ int32_t InterpretValue(uint64_t val, uint8_t len, JPEG *jpeg)
     {
         Log(Error, "Invalid length to be interpreted.");
         Log(Error, "Error occured at position %d.", jpeg->hstream.pos);
-        exit(0);
+        SetJPEGError(jpeg, JPEG_ERR_BAD_COEFFICIENT);
         return 0;
     }
     if (val & (1 << (len - 1)))
@@ -139,6 +141,8 @@ int32_t DecodeDC(BitStream *bit_stream, JPEG *jpeg, HTable *htable_dc)
     // It will return a symbol with its length
     Symbol  sym = DecodeHuffmanSymbol(bit_stream, jpeg, htable_dc);
     uint8_t len = sym.val & 0x0F; // Lower nibble contains length
+    if (jpeg->error != JPEG_OK)
+        return 0;
     if (len == 0)
     {
         Log(Warning, "DC coefficients with length 0 found");
@@ -147,15 +151,16 @@ int32_t DecodeDC(BitStream *bit_stream, JPEG *jpeg, HTable *htable_dc)
     if (len > 11)
     {
         Log(Error, "DC coefficient greater than 11 bits");
-        exit(-2);
+        SetJPEGError(jpeg, JPEG_ERR_BAD_COEFFICIENT);
+        return 0;
     }
     uint64_t val = ExtractBits(bit_stream, len, jpeg);
     // Check whether its positive or negative
     return InterpretValue(val, len, jpeg);
 }
 
-// Fills the remaining ac coefficients in given mcu
-void DecodeAC(BitStream *bit_stream, JPEG *jpeg, HTable *htable_ac, MCUBlock *mcu)
+// Fills the remaining ac coefficients in given mcu, returns false on a corrupt stream
+bool DecodeAC(BitStream *bit_stream, JPEG *jpeg, HTable *htable_ac, MCUBlock *mcu, EntropyComponentStats *stats)
 {
     // Now interpret the run length encoding
     uint8_t start = 1; // zero is to be filled by the DecodeDC functions
@@ -165,10 +170,12 @@ void DecodeAC(BitStream *bit_stream, JPEG *jpeg, HTable *htable_ac, MCUBlock *mc
         uint8_t len         = sym.val & 0x0F;
         uint8_t zero_counts = (sym.val & 0xF0) >> 4;
 
+        if (jpeg->error != JPEG_OK)
+            return false;
         if (len > 10)
         {
             Log(Error, "AC Coefficients can't have length greater than 10");
-            exit(-3);
+            return SetJPEGError(jpeg, JPEG_ERR_BAD_COEFFICIENT);
         }
 
         if (len == 0 && zero_counts == 0)
@@ -180,16 +187,23 @@ void DecodeAC(BitStream *bit_stream, JPEG *jpeg, HTable *htable_ac, MCUBlock *mc
 
         if (len == 0 && zero_counts == 15)
         {
+            if (start + 16 > 64)
+                return SetJPEGError(jpeg, JPEG_ERR_BAD_COEFFICIENT);
             for (uint8_t rem = start; rem < start + 16; ++rem)
                 mcu->block[jpeg->zigzag.order[rem]] = 0;
             start = start + 16;
+            if (JPEG_ENTROPY_STATS && stats)
+                stats->zrl++;
             continue;
         }
 
-        if (len == 0)
+        if (len == 0 || start + zero_counts >= 64)
         {
             Log(Error, "Len zero found, with count %d.", zero_counts);
+            return SetJPEGError(jpeg, JPEG_ERR_BAD_COEFFICIENT);
         }
+        if (JPEG_ENTROPY_STATS && stats)
+            stats->zero_runs[zero_counts]++;
 
         while (zero_counts--) // TODO :: Look at it
         {
@@ -199,6 +213,8 @@ void DecodeAC(BitStream *bit_stream, JPEG *jpeg, HTable *htable_ac, MCUBlock *mc
         uint64_t val                            = ExtractBits(bit_stream, len, jpeg);
         mcu->block[jpeg->zigzag.order[start++]] = InterpretValue(val, len, jpeg);
     }
+    CountEntropyBlock(stats, start);
+    return jpeg->error == JPEG_OK;
 }
 
 /* bool DecodeHuffmanStream(JPEG *jpeg) */
@@ -263,127 +279,374 @@ void DecodeAC(BitStream *bit_stream, JPEG *jpeg, HTable *htable_ac, MCUBlock *mc
 
 // bool DecodeHuffmanStreamChromaSubsampled(JPEG *jpeg)
 
-bool DecodeHuffmanStream(JPEG *jpeg)
+// Walks the ac coefficients of a block outside the decoded region without storing them
+bool SkipAC(BitStream *bit_stream, JPEG *jpeg, HTable *htable_ac, EntropyComponentStats *stats)
 {
-    // for each mcu and each component, decode the value
-    // No of mcu are total no. of 8x8 blocks that can be adjusted in the image
-    // Divide the whole picture into grid of 8x8 blocks and that will give total no. of block used in jpeg
-    // Need to write a bmp writer too, that will help use visualize the image
-    // Always assuming the maximum subsampling is 2 we have
+    uint8_t start = 1;
+    while (start < 64)
+    {
+        Symbol  sym         = DecodeHuffmanSymbol(bit_stream, jpeg, htable_ac);
+        uint8_t len         = sym.val & 0x0F;
+        uint8_t zero_counts = (sym.val & 0xF0) >> 4;
+
+        if (jpeg->error != JPEG_OK)
+            return false;
+
+        if (len == 0 && zero_counts == 0)
+            break;
+
+        if (len == 0 && zero_counts == 15)
+        {
+            if (start + 16 > 64)
+                return SetJPEGError(jpeg, JPEG_ERR_BAD_COEFFICIENT);
+            start = start + 16;
+            if (JPEG_ENTROPY_STATS && stats)
+                stats->zrl++;
+            continue;
+        }
 
-    int nmcu_h = (jpeg->img.width + 7) / 8; // Number of horizontal block of 8-pixel if no subsampling done
+        if (len == 0 || len > 10 || start + zero_counts >= 64)
+            return SetJPEGError(jpeg, JPEG_ERR_BAD_COEFFICIENT);
+        if (JPEG_ENTROPY_STATS && stats)
+            stats->zero_runs[zero_counts]++;
 
-    if (nmcu_h % jpeg->img.horizontal_subsampling) // Assuming its either 1 or 2
-        nmcu_h += 1;
+        start = start + zero_counts + 1;
+        ExtractBits(bit_stream, len, jpeg);
+    }
+    CountEntropyBlock(stats, start);
+    return jpeg->error == JPEG_OK;
+}
 
-    int nmcu_w = (jpeg->img.height + 7) / 8;
-    if (nmcu_w % jpeg->img.vertical_subsampling)
-        nmcu_w += 1;
+bool DecodeHuffmanStream(JPEG *jpeg, const MCUIndexEntry *resume)
+{
+    // for each mcu and each component, decode the value
+    // MCUs are decoded in raster order, each one holding HiVi blocks of every component
+    // Only the MCUs inside the decode region get their coefficients stored, the rest are walked just to keep the
+    // bit position and the DC predictors correct
+    // With a resume entry from an MCU index, jpeg->hstream starts at that entry instead of the start of the scan
+    // Components past DecodedComponents (chroma of a gray decode) are walked like the MCUs outside the region
+    JPEGInfo      *info    = &jpeg->img;
+    const uint32_t decoded = DecodedComponents(jpeg);
 
     // Allocate resource for mcu blocks
-    BitStream bit_stream               = {0};
-    jpeg->img.components[0].mcu_counts = nmcu_h * nmcu_w;
-    jpeg->img.components[1].mcu_counts =
-        (nmcu_h / jpeg->img.horizontal_subsampling) * (nmcu_w / jpeg->img.vertical_subsampling);
-    jpeg->img.components[2].mcu_counts =
-        (nmcu_h / jpeg->img.horizontal_subsampling) * (nmcu_w / jpeg->img.vertical_subsampling);
-
-    for (uint32_t i = 0; i < jpeg->img.channels; ++i)
-        jpeg->img.components[i].mcu_blocks =
-            malloc(sizeof(*jpeg->img.components[i].mcu_blocks) * jpeg->img.components[i].mcu_counts);
-
-    int total_mcus = 0;
-    for (uint32_t i = 0; i < jpeg->img.channels; ++i)
-        total_mcus += jpeg->img.components[i].mcu_counts;
+    BitStream bit_stream = {0};
+    MCUBlock *next_block[4];
+    for (uint32_t i = 0; i < decoded; ++i)
+    {
+        JPEGComponent *component = &info->components[i];
+        if (!ReserveBlocks(jpeg, component,
+                           info->region_cols * info->region_rows * (component->HiVi >> 4) * (component->HiVi & 0x0F)))
+            return false;
+        next_block[i] = component->mcu_blocks;
+    }
+
     // Previous differential DC values component wise
-    int32_t prevDC[4] = {0};
+    int32_t  prevDC[4]        = {0};
+    uint32_t successive_count = 0;
+    uint32_t first_row        = 0;
 
-    // Print all DC tables and their components
-    // for (int mcu = 0; mcu < nmcu_h * nmcu_w; ++mcu)
-    int       luma_count = 0;
-    int       cb_index = 0, cr_index = 0, luma_index = 0;
-    const int luma_max_sample = jpeg->img.vertical_subsampling * jpeg->img.horizontal_subsampling;
+    if (resume)
+    {
+        first_row = resume->mcu_row;
+        for (int i = 0; i < 4; ++i)
+            prevDC[i] = resume->dc[i];
+        successive_count = resume->restart_count;
+        ExtractBits(&bit_stream, resume->bit_offset, jpeg);
+    }
 
-    bool      sampleCb = false, sampleCr = false, sampleLuma = true;
+    // Nothing below the region is needed, so stop right after its last row, unless an index is being built
+    const uint32_t last_row = jpeg->build_index ? info->mcu_rows : info->region_y + info->region_rows;
 
-    uint32_t  successive_count = 0;
-    for (int mcu = 0; mcu < total_mcus; ++mcu)
+    for (uint32_t mcu_y = first_row; mcu_y < last_row; ++mcu_y)
     {
-        // TODO :: Write this loop better
-        int comp = 0;
-        if (luma_count < luma_max_sample)
-        {
-            luma_count++;
-            sampleLuma = true;
-            comp       = 0;
-        }
-        else
+        bool row_inside = mcu_y >= info->region_y && mcu_y < info->region_y + info->region_rows;
+        if (jpeg->build_index && mcu_y % jpeg->build_index->rows_per_entry == 0 &&
+            !RecordMCUIndexEntry(jpeg, jpeg->hstream.pos * 8 - bit_stream.len, prevDC, successive_count))
+            return false;
+        for (uint32_t mcu_x = 0; mcu_x < info->mcu_cols; ++mcu_x)
         {
-            if (!sampleCb && !sampleCr)
+            if (info->use_restart_interval && (successive_count >= info->restart_interval))
             {
-                sampleLuma = false;
-                sampleCb   = true;
-                comp       = 1;
+                ClearBitStream(&bit_stream, jpeg);
+                for (int i = 0; i < 4; ++i)
+                    prevDC[i] = 0;
+                successive_count = 0;
+                Log(Info, "Successfully restarted interval...");
             }
-            else if (sampleCb && !sampleCr)
+            successive_count = successive_count + 1;
+
+            bool inside = row_inside && mcu_x >= info->region_x && mcu_x < info->region_x + info->region_cols;
+
+            for (uint32_t comp = 0; comp < info->channels; ++comp)
             {
-                sampleCr = true;
-                sampleCb = false;
-                comp     = 2;
+                JPEGComponent         *component = &info->components[comp];
+                HTable                *htable_dc = &jpeg->huffman_tables.tables[component->htable_dc_index];
+                HTable                *htable_ac = &jpeg->huffman_tables.tables[component->htable_ac_index];
+                const int              blocks    = (component->HiVi >> 4) * (component->HiVi & 0x0F);
+                EntropyComponentStats *stats     = ComponentEntropyStats(jpeg, comp);
+
+                for (int b = 0; b < blocks; ++b)
+                {
+                    // Now off to decoding actual image
+                    prevDC[comp] = DecodeDC(&bit_stream, jpeg, htable_dc) + prevDC[comp];
+                    if (inside && comp < decoded)
+                    {
+                        MCUBlock *active_mcu = next_block[comp]++;
+                        active_mcu->block[0] = prevDC[comp];
+                        if (!DecodeAC(&bit_stream, jpeg, htable_ac, active_mcu, stats))
+                            return false;
+                    }
+                    else if (!SkipAC(&bit_stream, jpeg, htable_ac, stats))
+                        return false;
+                }
             }
-            else
+        }
+        Log(Warning, "The ptr is at %d after mcu row %d.", jpeg->hstream.pos, mcu_y);
+    }
+
+    for (int i = 0; TraceEnabled(TRACE_BLOCKS) && i < 8; ++i)
+    {
+        const int16_t *row = jpeg->img.components[0].mcu_blocks[0].block + i * 8;
+        TRACE(TRACE_BLOCKS, "first MCU : %7d %7d %7d %7d %7d %7d %7d %7d", row[0], row[1], row[2], row[3], row[4],
+              row[5], row[6], row[7]);
+    }
+    return true;
+}
+
+// Progressive decoding
+// Every scan refines the coefficients already in the component's mcu_blocks, either a band of them (spectral
+// selection) or one more bit of them (successive approximation)
+
+// Block (bx, by) of a component, inside its array of blocks laid out MCU by MCU
+static inline MCUBlock *ComponentBlock(JPEG *jpeg, JPEGComponent *component, uint32_t bx, uint32_t by)
+{
+    const uint32_t H   = component->HiVi >> 4;
+    const uint32_t V   = component->HiVi & 0x0F;
+    const uint32_t mcu = (by / V) * jpeg->img.mcu_cols + bx / H;
+    return component->mcu_blocks + mcu * H * V + (by % V) * H + bx % H;
+}
+
+bool DecodeDCFirst(BitStream *bit_stream, JPEG *jpeg, HTable *htable_dc, MCUBlock *mcu, int32_t *prevDC,
+                   const JPEGScan *scan)
+{
+    *prevDC       = DecodeDC(bit_stream, jpeg, htable_dc) + *prevDC;
+    mcu->block[0] = *prevDC * (1 << scan->Al);
+    return jpeg->error == JPEG_OK;
+}
+
+bool DecodeDCRefine(BitStream *bit_stream, JPEG *jpeg, MCUBlock *mcu, const JPEGScan *scan)
+{
+    if (ExtractBits(bit_stream, 1, jpeg))
+        mcu->block[0] |= 1 << scan->Al;
+    return jpeg->error == JPEG_OK;
+}
+
+bool DecodeACFirst(BitStream *bit_stream, JPEG *jpeg, HTable *htable_ac, MCUBlock *mcu, uint32_t *eobrun,
+                   const JPEGScan *scan)
+{
+    // Inside an EOB run the whole band of this block stays zero, nothing to read
+    if (*eobrun)
+    {
+        *eobrun = *eobrun - 1;
+        return true;
+    }
+
+    uint8_t k = scan->Ss;
+    while (k <= scan->Se)
+    {
+        Symbol  sym         = DecodeHuffmanSymbol(bit_stream, jpeg, htable_ac);
+        uint8_t len         = sym.val & 0x0F;
+        uint8_t zero_counts = (sym.val & 0xF0) >> 4;
+        if (jpeg->error != JPEG_OK)
+            return false;
+
+        if (len == 0)
+        {
+            if (zero_counts < 15)
             {
-                sampleCb         = false;
-                sampleCr         = false;
-                sampleLuma       = true;
-                successive_count = successive_count + 1;
-                luma_count       = 1;
-                comp             = 0;
+                // EOBn, this block and the next 2^n - 1 + (n extra bits) blocks end here
+                *eobrun = (1u << zero_counts) - 1;
+                if (zero_counts)
+                    *eobrun = *eobrun + ExtractBits(bit_stream, zero_counts, jpeg);
+                break;
             }
+            k = k + 16;
+            continue;
         }
 
+        k = k + zero_counts;
+        if (k > scan->Se || len > 14)
+            return SetJPEGError(jpeg, JPEG_ERR_BAD_COEFFICIENT);
+        uint64_t val                      = ExtractBits(bit_stream, len, jpeg);
+        mcu->block[jpeg->zigzag.order[k]] = InterpretValue(val, len, jpeg) * (1 << scan->Al);
+        k++;
+    }
+    return jpeg->error == JPEG_OK;
+}
+
+// Adds the correction bit to an already non zero coefficient
+static inline void RefineNonZero(BitStream *bit_stream, JPEG *jpeg, int16_t *coef, int16_t p1)
+{
+    if (ExtractBits(bit_stream, 1, jpeg) && !(*coef & p1))
+        *coef = *coef >= 0 ? *coef + p1 : *coef - p1;
+}
+
+bool DecodeACRefine(BitStream *bit_stream, JPEG *jpeg, HTable *htable_ac, MCUBlock *mcu, uint32_t *eobrun,
+                    const JPEGScan *scan)
+{
+    const int16_t p1 = 1 << scan->Al;
+    uint8_t       k  = scan->Ss;
 
-        if (jpeg->img.use_restart_interval && (successive_count >= jpeg->img.restart_interval))
+    if (!*eobrun)
+    {
+        while (k <= scan->Se)
         {
-            ClearBitStream(&bit_stream, jpeg);
-            for (int i = 0; i < 4; ++i)
-                prevDC[i] = 0;
-            successive_count = 0;
-            Log(Error, "Successfully restarted interval...");
-         }
-
-        MCUBlock *active_mcu;
-        if (sampleLuma)
-            active_mcu = jpeg->img.components[comp].mcu_blocks + luma_index++;
-        else if (sampleCb)
-            active_mcu = jpeg->img.components[comp].mcu_blocks + cb_index++;
-        else if (sampleCr)
-            active_mcu = jpeg->img.components[comp].mcu_blocks + cr_index++;
-        else
+            Symbol  sym         = DecodeHuffmanSymbol(bit_stream, jpeg, htable_ac);
+            uint8_t len         = sym.val & 0x0F;
+            int     zero_counts = (sym.val & 0xF0) >> 4;
+            int16_t value       = 0;
+            if (jpeg->error != JPEG_OK)
+                return false;
+
+            if (len)
+            {
+                // Newly non zero coefficients are always +-1 at this bit position
+                if (len != 1)
+                    return SetJPEGError(jpeg, JPEG_ERR_BAD_COEFFICIENT);
+                value = ExtractBits(bit_stream, 1, jpeg) ? p1 : -p1;
+            }
+            else if (zero_counts != 15)
+            {
+                *eobrun = 1u << zero_counts;
+                if (zero_counts)
+                    *eobrun = *eobrun + ExtractBits(bit_stream, zero_counts, jpeg);
+                break;
+            }
+
+            // Skip over zero_counts zero coefficients, refining the non zero ones on the way
+            while (k <= scan->Se)
+            {
+                int16_t *coef = &mcu->block[jpeg->zigzag.order[k]];
+                if (*coef)
+                    RefineNonZero(bit_stream, jpeg, coef, p1);
+                else if (--zero_counts < 0)
+                    break;
+                k++;
+            }
+
+            if (value)
+            {
+                if (k > scan->Se)
+                    return SetJPEGError(jpeg, JPEG_ERR_BAD_COEFFICIENT);
+                mcu->block[jpeg->zigzag.order[k]] = value;
+            }
+            k++;
+        }
+    }
+
+    if (*eobrun)
+    {
+        // Rest of the band only gets correction bits for its non zero coefficients
+        for (; k <= scan->Se; ++k)
         {
-            Log(Error,"Invalid sampling component.");
-            exit(-4);
+            int16_t *coef = &mcu->block[jpeg->zigzag.order[k]];
+            if (*coef)
+                RefineNonZero(bit_stream, jpeg, coef, p1);
         }
+        *eobrun = *eobrun - 1;
+    }
+    return jpeg->error == JPEG_OK;
+}
 
-        // Now off to decoding actual image
-        active_mcu->block[0] =
-            DecodeDC(&bit_stream, jpeg, &jpeg->huffman_tables.tables[jpeg->img.components[comp].htable_dc_index]) +
-            prevDC[comp];
-        prevDC[comp] = active_mcu->block[0];
-        DecodeAC(&bit_stream, jpeg, &jpeg->huffman_tables.tables[jpeg->img.components[comp].htable_ac_index],
-                 active_mcu);
-        Log(Warning, "The ptr is at %d after mcu %d.", jpeg->hstream.pos, mcu);
+bool DecodeProgressiveBlock(BitStream *bit_stream, JPEG *jpeg, JPEGComponent *component, MCUBlock *mcu,
+                            int32_t *prevDC, uint32_t *eobrun, const JPEGScan *scan)
+{
+    if (scan->Ss == 0)
+    {
+        if (scan->Ah == 0)
+            return DecodeDCFirst(bit_stream, jpeg, &jpeg->huffman_tables.tables[component->htable_dc_index], mcu,
+                                 prevDC, scan);
+        return DecodeDCRefine(bit_stream, jpeg, mcu, scan);
     }
+    if (scan->Ah == 0)
+        return DecodeACFirst(bit_stream, jpeg, &jpeg->huffman_tables.tables[component->htable_ac_index], mcu, eobrun,
+                             scan);
+    return DecodeACRefine(bit_stream, jpeg, &jpeg->huffman_tables.tables[component->htable_ac_index], mcu, eobrun,
+                          scan);
+}
+
+bool DecodeProgressiveScan(JPEG *jpeg, const JPEGScan *scan)
+{
+    JPEGInfo *info             = &jpeg->img;
+    BitStream bit_stream       = {0};
+    int32_t   prevDC[4]        = {0};
+    uint32_t  eobrun           = 0;
+    uint32_t  successive_count = 0;
 
-    putchar('\n');
-    InverseQuantization(jpeg);
-    Log(Warning, "****************************** Printing the first decoded MCU ******************************");
+    Log(Info, "Progressive scan of %u components, band %u..%u, approximation %u %u.", scan->count, scan->Ss,
+        scan->Se, scan->Ah, scan->Al);
 
-    for (int i = 0; i < 8; ++i)
+    if (scan->count == 1)
     {
-        for (int j = 0; j < 8; ++j)
-            printf("%7d ", jpeg->img.components[0].mcu_blocks[0].block[i * 8 + j]);
-        putchar('\n');
+        // Non interleaved, every block of the component is an MCU of its own, in raster order over the blocks that
+        // actually cover the image (not the padded MCU grid)
+        JPEGComponent *component = &info->components[scan->components[0]];
+        const uint32_t H         = component->HiVi >> 4;
+        const uint32_t V         = component->HiVi & 0x0F;
+        const uint32_t blocks_w =
+            ((info->width * H + info->horizontal_subsampling - 1) / info->horizontal_subsampling + 7) / 8;
+        const uint32_t blocks_h =
+            ((info->height * V + info->vertical_subsampling - 1) / info->vertical_subsampling + 7) / 8;
+
+        for (uint32_t by = 0; by < blocks_h; ++by)
+        {
+            for (uint32_t bx = 0; bx < blocks_w; ++bx)
+            {
+                if (info->use_restart_interval && (successive_count >= info->restart_interval))
+                {
+                    ClearBitStream(&bit_stream, jpeg);
+                    prevDC[0]        = 0;
+                    eobrun           = 0;
+                    successive_count = 0;
+                }
+                successive_count = successive_count + 1;
+
+                if (!DecodeProgressiveBlock(&bit_stream, jpeg, component, ComponentBlock(jpeg, component, bx, by),
+                                            &prevDC[0], &eobrun, scan))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    // Interleaved scans only ever carry DC coefficients
+    for (uint32_t mcu_y = 0; mcu_y < info->mcu_rows; ++mcu_y)
+    {
+        for (uint32_t mcu_x = 0; mcu_x < info->mcu_cols; ++mcu_x)
+        {
+            if (info->use_restart_interval && (successive_count >= info->restart_interval))
+            {
+                ClearBitStream(&bit_stream, jpeg);
+                for (int i = 0; i < 4; ++i)
+                    prevDC[i] = 0;
+                successive_count = 0;
+            }
+            successive_count = successive_count + 1;
+
+            for (uint32_t n = 0; n < scan->count; ++n)
+            {
+                JPEGComponent *component = &info->components[scan->components[n]];
+                const uint32_t H         = component->HiVi >> 4;
+                const uint32_t V         = component->HiVi & 0x0F;
+                MCUBlock      *blocks    = component->mcu_blocks + (mcu_y * info->mcu_cols + mcu_x) * H * V;
+
+                for (uint32_t b = 0; b < H * V; ++b)
+                {
+                    if (!DecodeProgressiveBlock(&bit_stream, jpeg, component, blocks + b, &prevDC[n], &eobrun, scan))
+                        return false;
+                }
+            }
+        }
     }
     return true;
 }
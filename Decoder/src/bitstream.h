@@ -2,6 +2,7 @@
 #define BITSTREAM_H_
 
 #include "./jpeg.h"
+#include "./mcuindex.h"
 // Handles bit stream and decoding of huffman values
 
 typedef struct BitStream
@@ -13,5 +14,6 @@ typedef struct BitStream
 uint64_t ExtractBit(BitStream *bit_stream, uint64_t count, JPEG *img);
 int64_t  DecodeMCU(BitStream *bit_stream, JPEG *jpeg, HTable *htable_DC, HTable* htable_AC);
 bool     ExtractHuffmanEncoded(JPEG* jpeg);
-bool     DecodeHuffmanStream(JPEG* jpeg);
+bool     DecodeHuffmanStream(JPEG* jpeg, const MCUIndexEntry *resume);
+bool     DecodeProgressiveScan(JPEG* jpeg, const JPEGScan *scan);
 #endif // BITSTREAM_H_
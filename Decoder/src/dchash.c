@@ -0,0 +1,154 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./dchash.h"
+
+#include "../../utility/log.h"
+
+// Block means of the luma, one float per block of the image (the padding blocks left out), from DC * quantizer / 8
+static float *DCImage(JPEG *jpeg, uint32_t *width, uint32_t *height)
+{
+    const JPEGInfo      *info      = &jpeg->img;
+    const JPEGComponent *component = &info->components[0];
+    const uint32_t       H         = component->HiVi >> 4;
+    const uint32_t       V         = component->HiVi & 0x0F;
+
+    const QTable *qtable = NULL;
+    for (uint8_t k = 0; k < jpeg->quantization_tables.count; ++k)
+        if (jpeg->quantization_tables.qtables[k].id == component->qtableptr)
+            qtable = &jpeg->quantization_tables.qtables[k];
+    if (!qtable)
+    {
+        SetJPEGError(jpeg, JPEG_ERR_BAD_QUANTIZATION);
+        return NULL;
+    }
+
+    *width       = (info->width + 7) / 8;
+    *height      = (info->height + 7) / 8;
+    float *means = malloc(sizeof(*means) * *width * *height);
+    if (!means)
+    {
+        SetJPEGError(jpeg, JPEG_ERR_OUT_OF_MEMORY);
+        return NULL;
+    }
+
+    // Blocks are laid out MCU by MCU
+    const MCUBlock *block = component->mcu_blocks;
+    for (uint32_t my = 0; my < info->mcu_rows; ++my)
+        for (uint32_t mx = 0; mx < info->mcu_cols; ++mx)
+            for (uint32_t v = 0; v < V; ++v)
+                for (uint32_t h = 0; h < H; ++h, ++block)
+                {
+                    uint32_t bx = mx * H + h, by = my * V + v;
+                    if (bx < *width && by < *height)
+                        means[by * *width + bx] = block->block[0] * qtable->data[0] / 8.0f + 128.0f;
+                }
+    return means;
+}
+
+// size x size cells, each the mean of the pixels it covers. Images smaller than that get their pixels repeated
+static void Resample(const float *in, uint32_t width, uint32_t height, float *out, uint32_t size)
+{
+    for (uint32_t y = 0; y < size; ++y)
+    {
+        uint32_t y0 = (uint64_t)y * height / size;
+        uint32_t y1 = ((uint64_t)(y + 1) * height + size - 1) / size;
+        for (uint32_t x = 0; x < size; ++x)
+        {
+            uint32_t x0  = (uint64_t)x * width / size;
+            uint32_t x1  = ((uint64_t)(x + 1) * width + size - 1) / size;
+            double   sum = 0;
+            for (uint32_t sy = y0; sy < y1; ++sy)
+                for (uint32_t sx = x0; sx < x1; ++sx)
+                    sum = sum + in[sy * width + sx];
+            out[y * size + x] = sum / ((y1 - y0) * (x1 - x0));
+        }
+    }
+}
+
+static int CompareFloats(const void *a, const void *b)
+{
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t DCTHash(const float *means, uint32_t width, uint32_t height)
+{
+    float cells[32 * 32];
+    Resample(means, width, height, cells, 32);
+
+    // Only the 8 lowest frequencies each way are needed, rows first then columns
+    float basis[8][32];
+    for (int u = 0; u < 8; ++u)
+        for (int x = 0; x < 32; ++x)
+            basis[u][x] = cosf((2 * x + 1) * u * (float)M_PI / 64.0f);
+
+    float rows[32][8];
+    for (int y = 0; y < 32; ++y)
+        for (int u = 0; u < 8; ++u)
+        {
+            float sum = 0;
+            for (int x = 0; x < 32; ++x)
+                sum = sum + cells[y * 32 + x] * basis[u][x];
+            rows[y][u] = sum;
+        }
+
+    float low[64], sorted[64];
+    for (int v = 0; v < 8; ++v)
+        for (int u = 0; u < 8; ++u)
+        {
+            float sum = 0;
+            for (int y = 0; y < 32; ++y)
+                sum = sum + basis[v][y] * rows[y][u];
+            low[v * 8 + u] = sum;
+        }
+
+    memcpy(sorted, low, sizeof(low));
+    qsort(sorted, 64, sizeof(*sorted), CompareFloats);
+    const float median = (sorted[31] + sorted[32]) / 2;
+
+    uint64_t hash      = 0;
+    for (int k = 0; k < 64; ++k)
+        hash = hash | (uint64_t)(low[k] > median) << k;
+    return hash;
+}
+
+static uint64_t AverageHash(const float *means, uint32_t width, uint32_t height)
+{
+    float cells[64];
+    Resample(means, width, height, cells, 8);
+
+    float mean = 0;
+    for (int k = 0; k < 64; ++k)
+        mean = mean + cells[k] / 64;
+
+    uint64_t hash = 0;
+    for (int k = 0; k < 64; ++k)
+        hash = hash | (uint64_t)(cells[k] > mean) << k;
+    return hash;
+}
+
+JPEGError JPEGImageHash(JPEG *jpeg, JPEGHashType type, uint64_t *hash)
+{
+    jpeg->crop              = (JPEGRect){0};
+    jpeg->format            = JPEG_OUTPUT_GRAY;
+    jpeg->sink              = NULL;
+    jpeg->coefficients_only = true;
+    if (DecodeJPEG(jpeg) != JPEG_OK)
+        return jpeg->error;
+
+    uint32_t width, height;
+    float   *means = DCImage(jpeg, &width, &height);
+    if (!means)
+        return jpeg->error;
+    *hash = type == JPEG_HASH_AVERAGE ? AverageHash(means, width, height) : DCTHash(means, width, height);
+    Log(Info, "Hash of the %ux%u DC image : %016lx.", width, height, *hash);
+    free(means);
+    return JPEG_OK;
+}
+
+uint32_t JPEGHashDistance(uint64_t a, uint64_t b)
+{
+    return __builtin_popcountll(a ^ b);
+}
@@ -0,0 +1,24 @@
+#ifndef DCHASH_H_
+#define DCHASH_H_
+
+#include <stdint.h>
+
+#include "./jpeg.h"
+// Perceptual hashes for near duplicate detection, straight from the entropy decoded luma. The DC coefficient of a
+// block is its mean, so the DC terms make an image at 1/8 of the size without any IDCT, upsampling or color conversion,
+// and the hash is computed from that. Chroma is only walked over, never stored
+
+typedef enum JPEGHashType
+{
+    JPEG_HASH_DCT = 0, // pHash: DC image resampled to 32x32, its 8x8 lowest DCT frequencies against their median
+    JPEG_HASH_AVERAGE  // aHash: DC image resampled to 8x8, every cell against the mean
+} JPEGHashType;
+
+// jpeg has to be loaded but not decoded yet, its crop, output format and sink get replaced. Bit k of the hash is cell
+// (or frequency) k in row major order
+JPEGError JPEGImageHash(JPEG *jpeg, JPEGHashType type, uint64_t *hash);
+
+// Bits that differ, near duplicates usually stay below 10
+uint32_t  JPEGHashDistance(uint64_t a, uint64_t b);
+
+#endif // DCHASH_H_
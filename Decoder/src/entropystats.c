@@ -0,0 +1,77 @@
+#include "./entropystats.h"
+
+static uint64_t Sum(const uint64_t *values, uint32_t count)
+{
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < count; ++i)
+        sum = sum + values[i];
+    return sum;
+}
+
+// Sparse, "index": count for the nonzero entries only, symbols are keyed in hex (run and size nibbles for AC)
+static void WriteCounts(FILE *fp, const char *name, const uint64_t *values, uint32_t first, uint32_t count, bool hex)
+{
+    bool first_entry = true;
+    fprintf(fp, "\"%s\": {", name);
+    for (uint32_t i = first; i < count; ++i)
+    {
+        if (!values[i])
+            continue;
+        fprintf(fp, hex ? "%s\"0x%02X\": %lu" : "%s\"%u\": %lu", first_entry ? "" : ", ", i, values[i]);
+        first_entry = false;
+    }
+    fprintf(fp, "}");
+}
+
+static void WriteTables(FILE *fp, const char *name, const EntropyTableStats *tables, bool *first_table)
+{
+    for (int id = 0; id < 4; ++id)
+    {
+        const EntropyTableStats *table = tables + id;
+        uint64_t                 total = Sum(table->code_lengths, 17);
+        if (!total)
+            continue;
+
+        double bits = 0;
+        for (int length = 1; length <= 16; ++length)
+            bits = bits + (double)length * table->code_lengths[length];
+
+        fprintf(fp, "%s\n    {\"class\": \"%s\", \"id\": %d, \"symbols_decoded\": %lu, "
+                    "\"mean_code_length\": %.3f,\n     ",
+                *first_table ? "" : ",", name, id, total, bits / total);
+        WriteCounts(fp, "code_lengths", table->code_lengths, 1, 17, false);
+        fprintf(fp, ",\n     ");
+        WriteCounts(fp, "symbols", table->symbols, 0, 256, true);
+        fprintf(fp, "}");
+        *first_table = false;
+    }
+}
+
+bool WriteEntropyStatsJSON(FILE *fp, const JPEGEntropyStats *stats)
+{
+    bool first = true;
+    fprintf(fp, "{\n  \"tables\": [");
+    WriteTables(fp, "DC", stats->dc, &first);
+    WriteTables(fp, "AC", stats->ac, &first);
+
+    first = true;
+    fprintf(fp, "\n  ],\n  \"components\": [");
+    for (int comp = 0; comp < 4; ++comp)
+    {
+        const EntropyComponentStats *component = stats->components + comp;
+        if (!component->blocks)
+            continue;
+
+        fprintf(fp, "%s\n    {\"component\": %d, \"blocks\": %lu, \"dc_only_blocks\": %lu, \"dc_only_fraction\": %.4f, "
+                    "\"zrl\": %lu,\n     ",
+                first ? "" : ",", comp, component->blocks, component->dc_only_blocks,
+                (double)component->dc_only_blocks / component->blocks, component->zrl);
+        WriteCounts(fp, "zero_runs", component->zero_runs, 0, 16, false);
+        fprintf(fp, ",\n     ");
+        WriteCounts(fp, "eob_positions", component->eob_positions, 1, 65, false);
+        fprintf(fp, "}");
+        first = false;
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    return !ferror(fp);
+}
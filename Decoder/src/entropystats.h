@@ -0,0 +1,67 @@
+#ifndef ENTROPYSTATS_H_
+#define ENTROPYSTATS_H_
+
+#include <stdio.h>
+
+#include "./jpeg.h"
+// What the entropy decoder sees, summed over every decode that has jpeg->entropy_stats set: symbols and code lengths
+// per huffman table, and per component the zero runs, where blocks end and how many of them carry only DC. It's meant
+// for picking lookup table sizes and sparse IDCT thresholds from real images
+// Only built with -DJPEG_ENTROPY_STATS=1 (cmake -DJPEG_ENTROPY_STATS=ON), otherwise the hooks in the decoder are
+// constant false and jpeg->entropy_stats is never touched
+
+#ifndef JPEG_ENTROPY_STATS
+#define JPEG_ENTROPY_STATS 0
+#endif
+
+typedef struct EntropyTableStats
+{
+    uint64_t symbols[256];     // times every symbol got decoded
+    uint64_t code_lengths[17]; // codes decoded by their length in bits, 1 to 16
+} EntropyTableStats;
+
+// Baseline scans only, progressive scans spread a block over several of them and only count symbols
+typedef struct EntropyComponentStats
+{
+    uint64_t blocks;
+    uint64_t dc_only_blocks;    // EOB right after the DC coefficient
+    uint64_t zero_runs[16];     // zeros skipped in front of every nonzero AC coefficient
+    uint64_t zrl;               // ZRL symbols, 16 zeros each
+    uint64_t eob_positions[65]; // zigzag index the EOB came at, 64 for blocks that run to the end without one
+} EntropyComponentStats;
+
+typedef struct JPEGEntropyStats
+{
+    EntropyTableStats     dc[4]; // by table id
+    EntropyTableStats     ac[4];
+    EntropyComponentStats components[4];
+} JPEGEntropyStats;
+
+// Decoder hooks, stats is NULL for decodes that don't collect
+static inline EntropyComponentStats *ComponentEntropyStats(const JPEG *jpeg, uint32_t comp)
+{
+    return JPEG_ENTROPY_STATS && jpeg->entropy_stats ? jpeg->entropy_stats->components + comp : NULL;
+}
+
+static inline void CountEntropySymbol(const JPEG *jpeg, const HTable *htable, uint8_t length, uint8_t symbol)
+{
+    if (!JPEG_ENTROPY_STATS || !jpeg->entropy_stats)
+        return;
+    EntropyTableStats *table = htable->type == AC ? jpeg->entropy_stats->ac : jpeg->entropy_stats->dc;
+    table[htable->id & 3].symbols[symbol]++;
+    table[htable->id & 3].code_lengths[length]++;
+}
+
+static inline void CountEntropyBlock(EntropyComponentStats *stats, uint8_t eob_position)
+{
+    if (!JPEG_ENTROPY_STATS || !stats)
+        return;
+    stats->blocks++;
+    stats->dc_only_blocks += eob_position == 1;
+    stats->eob_positions[eob_position]++;
+}
+
+// Object with the totals, tables and components that never came up are left out
+bool WriteEntropyStatsJSON(FILE *fp, const JPEGEntropyStats *stats);
+
+#endif // ENTROPYSTATS_H_
@@ -0,0 +1,195 @@
+#include <string.h>
+
+#include "./exif.h"
+#include "./jpeg.h"
+
+static uint16_t ReadShort(const uint8_t *p, bool big_endian)
+{
+    return big_endian ? p[0] << 8 | p[1] : p[1] << 8 | p[0];
+}
+
+static uint32_t ReadLong(const uint8_t *p, bool big_endian)
+{
+    return big_endian ? (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]
+                      : (uint32_t)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+}
+
+// A SHORT or a LONG, either one fits into the value field of the entry
+static uint32_t ReadValue(const uint8_t *entry, bool big_endian)
+{
+    uint16_t type = ReadShort(entry + 2, big_endian);
+    return type == 3 ? ReadShort(entry + 8, big_endian) : type == 4 ? ReadLong(entry + 8, big_endian) : 0;
+}
+
+// Tags of IFD number index (0 the image, 1 the thumbnail) at offset ifd, *next set to the offset of the IFD after it
+static bool ParseIFD(const uint8_t *tiff, uint32_t ifd, uint32_t index, EXIFInfo *exif, uint32_t *next)
+{
+    if (ifd < 8 || ifd > exif->size - 2)
+        return false;
+    uint16_t entries = ReadShort(tiff + ifd, exif->big_endian);
+    if (entries > (exif->size - ifd - 2) / 12)
+        return false;
+
+    for (uint16_t i = 0; i < entries; ++i)
+    {
+        const uint32_t entry = ifd + 2 + 12 * i;
+        const uint16_t tag   = ReadShort(tiff + entry, exif->big_endian);
+        const uint16_t type  = ReadShort(tiff + entry + 2, exif->big_endian);
+        // A single SHORT, held in the first two bytes of the value field
+        if (index == 0 && tag == 0x0112 && type == 3)
+        {
+            exif->orientation        = ReadShort(tiff + entry + 8, exif->big_endian);
+            exif->orientation_offset = entry + 8;
+        }
+        else if (index == 1 && tag == 0x0201)
+            exif->thumbnail_offset = ReadValue(tiff + entry, exif->big_endian);
+        else if (index == 1 && tag == 0x0202)
+            exif->thumbnail_size = ReadValue(tiff + entry, exif->big_endian);
+    }
+
+    // The offset of the next IFD follows the entries, 0 for the last one
+    const uint32_t link = ifd + 2 + 12 * entries;
+    *next               = link + 4 <= exif->size ? ReadLong(tiff + link, exif->big_endian) : 0;
+    return true;
+}
+
+// TIFF header, IFD0 and IFD1 if there is one, exif->tiff and exif->size set
+static bool ParseTIFF(const uint8_t *data, EXIFInfo *exif)
+{
+    const uint8_t *tiff = data + exif->tiff;
+    if (exif->size < 8 || (memcmp(tiff, "MM\0*", 4) && memcmp(tiff, "II*\0", 4)))
+        return false;
+    exif->big_endian = tiff[0] == 'M';
+
+    uint32_t ifd1 = 0, next = 0;
+    if (!ParseIFD(tiff, ReadLong(tiff + 4, exif->big_endian), 0, exif, &ifd1))
+        return false;
+
+    // A broken IFD1 only costs the thumbnail
+    if (!ifd1 || !ParseIFD(tiff, ifd1, 1, exif, &next) || !exif->thumbnail_size ||
+        exif->thumbnail_offset > exif->size || exif->thumbnail_size > exif->size - exif->thumbnail_offset)
+    {
+        exif->thumbnail_offset = 0;
+        exif->thumbnail_size   = 0;
+    }
+    return true;
+}
+
+// Segment at *pos (its 0xFF) in front of the first scan, fill bytes skipped. The payload starts at *pos + 4 and
+// holds *length - 2 bytes. False at SOS, EOI, anything that isn't a marker or a segment running past the end
+static bool NextSegment(const uint8_t *data, uint64_t size, uint64_t *pos, uint8_t *marker, uint64_t *length)
+{
+    while (*pos + 4 <= size && data[*pos] == 0xFF)
+    {
+        *marker = data[*pos + 1];
+        if (*marker == 0xFF) // fill byte
+        {
+            (*pos)++;
+            continue;
+        }
+        if (*marker == SOS || *marker == EOI)
+            return false;
+
+        *length = GetMarkerLength((uint8_t *)data + *pos + 2);
+        return *length >= 2 && *pos + 2 + *length <= size;
+    }
+    return false;
+}
+
+bool ReadEXIF(const uint8_t *data, uint64_t size, EXIFInfo *exif)
+{
+    memset(exif, 0, sizeof(*exif));
+    uint64_t length = 0;
+    uint8_t  marker = 0;
+    for (uint64_t pos = 2; NextSegment(data, size, &pos, &marker, &length); pos = pos + 2 + length)
+    {
+        // "Exif\0\0" and the TIFF structure right after it
+        if (marker == 0xE1 && length >= 8 && !memcmp(data + pos + 4, "Exif\0\0", 6))
+        {
+            exif->tiff = pos + 10;
+            exif->size = length - 8;
+            return ParseTIFF(data, exif);
+        }
+    }
+    return false;
+}
+
+// The thumbnail has to be a JPEG of its own, its size comes from the first frame header
+static bool ThumbnailFrame(JPEGThumbnail *thumbnail)
+{
+    const uint8_t *data   = thumbnail->data;
+    uint64_t       length = 0;
+    uint8_t        marker = 0;
+    if (thumbnail->size < 4 || data[0] != 0xFF || data[1] != SOI)
+        return false;
+    for (uint64_t pos = 2; NextSegment(data, thumbnail->size, &pos, &marker, &length); pos = pos + 2 + length)
+    {
+        if ((marker == SOF0 || marker == SOF1 || marker == SOF2) && length >= 8)
+        {
+            thumbnail->height = GetMarkerLength((uint8_t *)data + pos + 5);
+            thumbnail->width  = GetMarkerLength((uint8_t *)data + pos + 7);
+            return thumbnail->width && thumbnail->height;
+        }
+    }
+    return false;
+}
+
+bool FindJPEGThumbnail(const uint8_t *data, uint64_t size, JPEGThumbnail *thumbnail)
+{
+    memset(thumbnail, 0, sizeof(*thumbnail));
+    if (size < 4 || data[0] != 0xFF || data[1] != SOI)
+        return false;
+
+    EXIFInfo exif;
+    if (ReadEXIF(data, size, &exif) && exif.thumbnail_size)
+    {
+        thumbnail->data   = data + exif.tiff + exif.thumbnail_offset;
+        thumbnail->size   = exif.thumbnail_size;
+        thumbnail->source = JPEG_THUMBNAIL_EXIF;
+        if (ThumbnailFrame(thumbnail))
+            return true;
+    }
+
+    // "JFXX\0", extension code 0x10 and the JPEG file
+    uint64_t length = 0;
+    uint8_t  marker = 0;
+    for (uint64_t pos = 2; NextSegment(data, size, &pos, &marker, &length); pos = pos + 2 + length)
+    {
+        if (marker == 0xE0 && length >= 8 && !memcmp(data + pos + 4, "JFXX\0\x10", 6))
+        {
+            thumbnail->data   = data + pos + 10;
+            thumbnail->size   = length - 8;
+            thumbnail->source = JPEG_THUMBNAIL_JFXX;
+            if (ThumbnailFrame(thumbnail))
+                return true;
+        }
+    }
+    memset(thumbnail, 0, sizeof(*thumbnail));
+    return false;
+}
+
+JPEGError DecodeJPEGThumbnail(JPEG *jpeg, const JPEGThumbnail *thumbnail)
+{
+    uint8_t *buffer = jpeg->buffer;
+    uint64_t size   = jpeg->size;
+    if (!buffer || thumbnail->data < buffer || thumbnail->size > size ||
+        (uint64_t)(thumbnail->data - buffer) > size - thumbnail->size)
+    {
+        SetJPEGError(jpeg, JPEG_ERR_INVALID_ARGUMENT);
+        return jpeg->error;
+    }
+
+    // The decoder gets pointed at the thumbnail's bytes for the decode, an MCU index of the image doesn't apply to it
+    const struct MCUIndex *index       = jpeg->index;
+    struct MCUIndex       *build_index = jpeg->build_index;
+    jpeg->index                        = NULL;
+    jpeg->build_index                  = NULL;
+    if (ResetJPEGDecoder(jpeg, buffer + (thumbnail->data - buffer), thumbnail->size) == JPEG_OK)
+        DecodeJPEG(jpeg);
+
+    jpeg->buffer      = buffer;
+    jpeg->size        = size;
+    jpeg->index       = index;
+    jpeg->build_index = build_index;
+    return jpeg->error;
+}
@@ -0,0 +1,56 @@
+#ifndef EXIF_H_
+#define EXIF_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "./jpeg.h"
+// Just enough EXIF to find the tags we act on, read straight out of the file's APP1 segment. EXIF is a TIFF
+// structure: a byte order mark, then directories (IFDs) of 12 byte entries, offsets counted from the TIFF header
+
+// Offset of the TIFF header inside the file, everything else relative to it
+typedef struct EXIFInfo
+{
+    uint64_t tiff;
+    uint32_t size;       // bytes from the TIFF header to the end of the APP1 segment
+    bool     big_endian; // "MM", "II" otherwise
+
+    uint16_t orientation;        // IFD0 Orientation (0x0112), 1 - 8, 0 without the tag
+    uint32_t orientation_offset; // of its value, 0 without the tag
+
+    // IFD1 JPEGInterchangeFormat (0x0201) and JPEGInterchangeFormatLength (0x0202), the embedded JPEG thumbnail.
+    // Both 0 without one or when it doesn't fit inside the segment
+    uint32_t thumbnail_offset;
+    uint32_t thumbnail_size;
+} EXIFInfo;
+
+// Looks through the segments in front of the first scan for an Exif APP1 segment, false without a valid one
+bool ReadEXIF(const uint8_t *data, uint64_t size, EXIFInfo *exif);
+
+typedef enum JPEGThumbnailSource
+{
+    JPEG_THUMBNAIL_EXIF = 0, // IFD1 of the Exif APP1 segment, what cameras and phones write
+    JPEG_THUMBNAIL_JFXX      // JFIF extension APP0 segment coded as JPEG (extension code 0x10)
+} JPEGThumbnailSource;
+
+// A complete JPEG file inside the one it was found in, data points into that buffer and nothing is copied.
+// Thumbnails stored as raw RGB or palette pixels (plain JFIF, JFXX 0x11 / 0x13, uncompressed TIFF strips) aren't found
+typedef struct JPEGThumbnail
+{
+    const uint8_t      *data;
+    uint64_t            size;
+    uint16_t            width; // from its frame header
+    uint16_t            height;
+    JPEGThumbnailSource source;
+} JPEGThumbnail;
+
+// Only walks the segments in front of the first scan, so it costs next to nothing next to a decode. EXIF is looked at
+// before JFXX, false without a thumbnail that starts with SOI and has a frame header
+bool FindJPEGThumbnail(const uint8_t *data, uint64_t size, JPEGThumbnail *thumbnail);
+
+// Decodes the thumbnail with jpeg's settings (format, crop, sink, ...) in place of the image, thumbnail has to point
+// into jpeg->buffer. jpeg->img and jpeg->output describe the thumbnail afterwards, while jpeg->buffer stays the whole
+// file so CleanUpDecoder frees the right thing
+JPEGError DecodeJPEGThumbnail(JPEG *jpeg, const JPEGThumbnail *thumbnail);
+
+#endif // EXIF_H_
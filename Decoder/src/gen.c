@@ -0,0 +1,262 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "./jpeg.h"
+#include "../../Encoder/src/encoder.h"
+
+// jpeg_gen [--mp list | --size list] [--sampling list] [--quality list] [--restart list] [--gray] [--seed n]
+//          [--threads n] <dir>
+// Writes synthetic baseline JPEGs for scaling runs of jpeg_bench, one for every combination of the lists (comma
+// separated), named gen_<width>x<height>_<sampling>_q<quality>_r<restart>.jpg. Pixels are generated a band of rows at
+// a time and streamed through the encoder (Encoder/src), so even a 200+ MP image takes no more memory than one band
+
+#define MAX_LIST 32
+
+typedef struct GenImage
+{
+    uint32_t     width;
+    uint32_t     height;
+    JPEGSampling sampling;
+    uint32_t     quality;
+    uint32_t     restart; // MCUs per restart interval, 0 for none
+    uint32_t     threads; // encoder threads, see JPEGEncodeSettings
+    bool         gray;
+    uint32_t     seed;
+} GenImage;
+
+static uint32_t Hash(uint32_t x, uint32_t y, uint32_t seed)
+{
+    uint32_t h = x * 0x9E3779B1u ^ y * 0x85EBCA77u ^ seed * 0xC2B2AE3Du;
+    h          = (h ^ (h >> 15)) * 0x2C1B3C6Du;
+    h          = (h ^ (h >> 12)) * 0x297A2D39u;
+    return h ^ (h >> 15);
+}
+
+static uint8_t Clamp(int value)
+{
+    return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+// What the entropy coder sees in real photos, roughly: smooth gradients, sensor like noise, hard edges and flat blocks,
+// picked per 64x64 tile
+static void SyntheticPixel(const GenImage *image, uint32_t x, uint32_t y, uint8_t rgb[3])
+{
+    int r = x * 255 / image->width;
+    int g = y * 255 / image->height;
+    int b = 255 - (r + g) / 2;
+
+    switch (Hash(x >> 6, y >> 6, image->seed) % 4)
+    {
+    case 1: {
+        int noise = (int)(Hash(x, y, image->seed) & 63) - 32;
+        r         = r + noise;
+        g         = g + noise;
+        b         = b + noise;
+        break;
+    }
+    case 2: {
+        int stripe = ((x + 2 * y) >> 2) & 1 ? 230 : 25;
+        r          = stripe;
+        g          = (stripe + g) / 2;
+        b          = 255 - stripe;
+        break;
+    }
+    case 3: {
+        uint32_t flat = Hash(x >> 3, y >> 3, image->seed + 1);
+        r             = flat & 0xFF;
+        g             = (flat >> 8) & 0xFF;
+        b             = (flat >> 16) & 0xFF;
+        break;
+    }
+    }
+    rgb[0] = Clamp(r);
+    rgb[1] = Clamp(g);
+    rgb[2] = Clamp(b);
+}
+
+static bool GenerateJPEG(const GenImage *image, const char *path)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "Failed to open %s for writing\n", path);
+        return false;
+    }
+
+    // A band of rows at a time, gray ones get the luma of the color pixel
+    const uint32_t     band     = 16;
+    const uint32_t     channels = image->gray ? 1 : 3;
+    JPEGEncodeSettings settings = {image->quality, image->sampling, image->restart, image->threads};
+    JPEGEncoder        encoder;
+    uint8_t           *rows = malloc((uint64_t)image->width * channels * band);
+    JPEGError          err  = rows ? InitJPEGEncoder(&encoder, image->width, image->height, channels, &settings,
+                                                     WriteJPEGToFile, fp)
+                                   : JPEG_ERR_OUT_OF_MEMORY;
+    for (uint32_t y = 0; y < image->height && err == JPEG_OK; y += band)
+    {
+        uint32_t count = image->height - y < band ? image->height - y : band;
+        uint8_t *out   = rows;
+        for (uint32_t r = 0; r < count; ++r)
+        {
+            for (uint32_t x = 0; x < image->width; ++x, out += channels)
+            {
+                uint8_t rgb[3];
+                SyntheticPixel(image, x, y + r, rgb);
+                if (image->gray)
+                    out[0] = (77 * rgb[0] + 150 * rgb[1] + 29 * rgb[2] + 128) >> 8;
+                else
+                    memcpy(out, rgb, 3);
+            }
+        }
+        err = EncodeJPEGRows(&encoder, rows, 0, count);
+    }
+    if (err == JPEG_OK)
+        err = FinishJPEGEncode(&encoder);
+    if (rows)
+        CleanUpEncoder(&encoder);
+    free(rows);
+
+    if (err != JPEG_OK)
+        fprintf(stderr, "Failed to encode %s : %s\n", path, JPEGErrorString(err));
+    return !fclose(fp) && err == JPEG_OK;
+}
+
+// Wall clock, so runs with --threads show the speedup rather than CPU time summed over the workers
+static double Seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Comma separated unsigned list, every entry run through parse
+static uint32_t ParseList(char *arg, uint32_t *values, bool (*parse)(const char *, uint32_t *))
+{
+    uint32_t count = 0;
+    for (char *item = strtok(arg, ","); item && count < MAX_LIST; item = strtok(NULL, ","))
+    {
+        if (!parse(item, values + count))
+            return 0;
+        count++;
+    }
+    return count;
+}
+
+static bool ParseNumber(const char *item, uint32_t *value)
+{
+    char *end = NULL;
+    *value    = strtoul(item, &end, 10);
+    return end != item && !*end;
+}
+
+static bool ParseSampling(const char *item, uint32_t *value)
+{
+    JPEGSampling sampling;
+    if (!JPEGSamplingFromString(item, &sampling))
+        return false;
+    *value = sampling;
+    return true;
+}
+
+// Megapixels at a 3:2 aspect ratio, packed as width << 16 | height
+static bool ParseMegapixels(const char *item, uint32_t *value)
+{
+    uint32_t mp = 0;
+    if (!ParseNumber(item, &mp) || !mp)
+        return false;
+    uint32_t width  = lround(sqrt(mp * 1e6 * 1.5));
+    uint32_t height = lround(width / 1.5);
+    *value          = width << 16 | height;
+    return width <= 0xFFFF && height <= 0xFFFF;
+}
+
+// WIDTHxHEIGHT, packed as width << 16 | height
+static bool ParseSize(const char *item, uint32_t *value)
+{
+    uint32_t width = 0, height = 0;
+    if (sscanf(item, "%ux%u", &width, &height) != 2 || !width || !height || width > 0xFFFF || height > 0xFFFF)
+        return false;
+    *value = width << 16 | height;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t    sizes[MAX_LIST], samplings[MAX_LIST] = {0x22}, qualities[MAX_LIST] = {90}, restarts[MAX_LIST] = {0};
+    uint32_t    size_count = 0, sampling_count = 1, quality_count = 1, restart_count = 1;
+    GenImage    image      = {.seed = 1};
+    const char *dir        = NULL;
+    bool        valid      = true;
+
+    for (int arg = 1; arg < argc && valid; ++arg)
+    {
+        if (!strcmp(argv[arg], "--mp") && arg + 1 < argc)
+            valid = (size_count = ParseList(argv[++arg], sizes, ParseMegapixels));
+        else if (!strcmp(argv[arg], "--size") && arg + 1 < argc)
+            valid = (size_count = ParseList(argv[++arg], sizes, ParseSize));
+        else if (!strcmp(argv[arg], "--sampling") && arg + 1 < argc)
+            valid = (sampling_count = ParseList(argv[++arg], samplings, ParseSampling));
+        else if (!strcmp(argv[arg], "--quality") && arg + 1 < argc)
+            valid = (quality_count = ParseList(argv[++arg], qualities, ParseNumber));
+        else if (!strcmp(argv[arg], "--restart") && arg + 1 < argc)
+            valid = (restart_count = ParseList(argv[++arg], restarts, ParseNumber));
+        else if (!strcmp(argv[arg], "--seed") && arg + 1 < argc)
+            valid = ParseNumber(argv[++arg], &image.seed);
+        else if (!strcmp(argv[arg], "--threads") && arg + 1 < argc)
+            valid = ParseNumber(argv[++arg], &image.threads);
+        else if (!strcmp(argv[arg], "--gray"))
+            image.gray = true;
+        else
+            dir = argv[arg];
+    }
+    for (uint32_t i = 0; i < quality_count; ++i)
+        valid = valid && qualities[i] >= 1 && qualities[i] <= 100;
+    for (uint32_t i = 0; i < restart_count; ++i)
+        valid = valid && restarts[i] <= 0xFFFF;
+
+    if (!valid || !dir)
+    {
+        fprintf(stderr, "USAGE : jpeg_gen [--mp 1,4,16 | --size 1920x1080,...] [--sampling 444,422,420,440] "
+                        "[--quality 90,...] [--restart 0,...] [--gray] [--seed n] [--threads n] <output dir>\n");
+        return -1;
+    }
+    if (!size_count)
+        size_count = ParseList((char[]){"1,4,16,64"}, sizes, ParseMegapixels);
+
+    // Gray images have a single sampling
+    if (image.gray)
+        sampling_count = 1;
+
+    for (uint32_t s = 0; s < size_count; ++s)
+    {
+        for (uint32_t f = 0; f < sampling_count; ++f)
+        {
+            for (uint32_t q = 0; q < quality_count; ++q)
+            {
+                for (uint32_t r = 0; r < restart_count; ++r)
+                {
+                    image.width    = sizes[s] >> 16;
+                    image.height   = sizes[s] & 0xFFFF;
+                    image.sampling = samplings[f];
+                    image.quality  = qualities[q];
+                    image.restart  = restarts[r];
+
+                    char path[4096];
+                    snprintf(path, sizeof(path), "%s/gen_%ux%u_%s_q%u_r%u.jpg", dir, image.width, image.height,
+                             image.gray ? "gray" : JPEGSamplingName(image.sampling),
+                             image.quality, image.restart);
+
+                    double start = Seconds();
+                    if (!GenerateJPEG(&image, path))
+                        return -2;
+                    printf("%s  %.1f MP in %.2f s\n", path, image.width * (double)image.height / 1e6,
+                           Seconds() - start);
+                }
+            }
+        }
+    }
+    return 0;
+}
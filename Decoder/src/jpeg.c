@@ -4,33 +4,126 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "./bitstream.h"
 #include "./jpeg.h"
+#include "./mcuindex.h"
+#include "./perfcounters.h"
 
 #include "../../utility/bmp.h"
 #include "../../utility/log.h"
+#include "../../utility/trace.h"
 
 // JPEG decompressor using Inverse Cosine Transform
-void ProgressiveDCT(JPEG *img);
-void BaselineDCT(JPEG *img);
+bool ProgressiveDCT(JPEG *img);
+bool BaselineDCT(JPEG *img);
+bool FrameHeader(JPEG *img);
 
-void StartOfScanSegment(JPEG *img);
-void DefineRestartIntervalSegment(JPEG *img);
+bool StartOfScanSegment(JPEG *img);
+bool DefineRestartIntervalSegment(JPEG *img);
 
-void InitJPEGDecoder(JPEG *jpeg);
-void DecodeJPEG(JPEG *jpeg, HTable *htable, QTable *qtable);
+bool SetupDecodeRegion(JPEG *jpeg);
+bool ConvertToOutput(JPEG *jpeg);
 
 void JPEGtoBMP(JPEG *jpeg, const char *output_file);
-void JPEGtoBMPChromaSubsampled(JPEG *jpeg, const char *output);
 
-void LoadJpegFile(JPEG *image, const char *path)
+// Stage timing, the clock (and the counters) are only read when jpeg->timings is set
+typedef struct StageStart
+{
+    uint64_t ns;
+    uint64_t events[JPEG_COUNTER_COUNT];
+} StageStart;
+
+static StageStart StageClock(const JPEG *jpeg)
+{
+    StageStart      start = {0};
+    struct timespec now;
+    if (!jpeg->timings)
+        return start;
+    if (jpeg->timings->counters)
+        ReadPerfCounters(jpeg->timings->counters, start.events);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    start.ns = now.tv_sec * 1000000000ull + now.tv_nsec;
+    return start;
+}
+
+static void StageDone(JPEG *jpeg, JPEGStage stage, StageStart start)
+{
+    if (!jpeg->timings)
+        return;
+    StageStart now            = StageClock(jpeg);
+    jpeg->timings->ns[stage] += now.ns - start.ns;
+    for (int i = 0; i < JPEG_COUNTER_COUNT; ++i)
+        jpeg->timings->events[stage][i] += now.events[i] - start.events[i];
+}
+
+const char *JPEGStageName(JPEGStage stage)
+{
+    static const char *names[JPEG_STAGE_COUNT] = {"markers", "destuff", "huffman", "dequant",
+                                                  "idct",    "color",   "output"};
+    return stage < JPEG_STAGE_COUNT ? names[stage] : "unknown";
+}
+
+const char *JPEGCounterName(JPEGCounter counter)
+{
+    static const char *names[JPEG_COUNTER_COUNT] = {"cycles",     "instructions", "branch_misses",
+                                                    "l1d_misses", "llc_misses",   "page_faults"};
+    return counter < JPEG_COUNTER_COUNT ? names[counter] : "unknown";
+}
+
+uint32_t DecodedComponents(const JPEG *jpeg)
+{
+    if (jpeg->img.channels == 1 || jpeg->format == JPEG_OUTPUT_GRAY)
+        return 1;
+    return jpeg->img.channels;
+}
+
+bool SetJPEGError(JPEG *jpeg, JPEGError error)
+{
+    if (jpeg->error == JPEG_OK)
+        jpeg->error = error;
+    return false;
+}
+
+const char *JPEGErrorString(JPEGError error)
+{
+    switch (error)
+    {
+    case JPEG_OK:
+        return "No error";
+    case JPEG_ERR_IO:
+        return "Failed to read the input file";
+    case JPEG_ERR_OUT_OF_MEMORY:
+        return "Out of memory";
+    case JPEG_ERR_INVALID_HEADER:
+        return "Invalid JPEG header";
+    case JPEG_ERR_BAD_SEGMENT:
+        return "Marker segment runs past the end of the data";
+    case JPEG_ERR_TRUNCATED:
+        return "Entropy coded data is truncated";
+    case JPEG_ERR_BAD_HUFFMAN:
+        return "Invalid huffman code or table";
+    case JPEG_ERR_BAD_QUANTIZATION:
+        return "Invalid quantization table";
+    case JPEG_ERR_BAD_COEFFICIENT:
+        return "Coefficient out of range";
+    case JPEG_ERR_UNSUPPORTED:
+        return "Unsupported JPEG feature";
+    case JPEG_ERR_INVALID_ARGUMENT:
+        return "Invalid argument";
+    }
+    return "Unknown error";
+}
+
+JPEGError LoadJpegFile(JPEG *image, const char *path)
 {
     FILE *fp = fopen(path, "rb");
     if (!fp)
     {
-        fprintf(stderr, "Error : Failed to open file %s.\n", path);
-        return;
+        Log(Error, "Failed to open file %s.", path);
+        SetJPEGError(image, JPEG_ERR_IO);
+        return image->error;
     }
 
     fseek(fp, 0, SEEK_END);
@@ -38,24 +131,33 @@ void LoadJpegFile(JPEG *image, const char *path)
 
     rewind(fp);
 
-    image->buffer   = malloc(sizeof(*image->buffer) * (size + 1));
+    image->buffer = malloc(sizeof(*image->buffer) * (size + 1));
+    if (!image->buffer)
+    {
+        fclose(fp);
+        SetJPEGError(image, JPEG_ERR_OUT_OF_MEMORY);
+        return image->error;
+    }
     size_t readSize = fread(image->buffer, sizeof(*image->buffer), size + 1, fp);
+    fclose(fp);
 
-    image->size     = readSize;
+    image->size = readSize;
     if (readSize != size)
     {
-        fprintf(stderr, "Warning : Unknown error in opening file %s.\n", path);
-        return;
+        Log(Error, "Unknown error in reading file %s.", path);
+        SetJPEGError(image, JPEG_ERR_IO);
+        return image->error;
     }
     InitJPEGDecoder(image);
+    return image->error;
 }
 
 bool ValidateJPEGHeader(JPEG *image)
 {
-    if (image->buffer[0] != 0xFF || image->buffer[1] != 0xD8)
+    if (image->size < 4 || image->buffer[0] != 0xFF || image->buffer[1] != 0xD8)
     {
-        fprintf(stdout, "\nInvalid JPEG file\n");
-        return false;
+        Log(Error, "Invalid JPEG file");
+        return SetJPEGError(image, JPEG_ERR_INVALID_HEADER);
     }
     Log(Info, "Valid JPG File");
     image->pos += 2;
@@ -83,22 +185,52 @@ uint16_t GetMarkerLength(uint8_t *buffer)
     return (buffer[0] << 8) | buffer[1];
 }
 
-void HandleAPPHeaders(JPEG *image)
+// Checks that the segment starting at image->pos (at its length field) lies completely inside the buffer
+bool ValidateSegment(JPEG *image)
+{
+    if (image->pos + 2 > image->size)
+        return SetJPEGError(image, JPEG_ERR_BAD_SEGMENT);
+    uint16_t len = GetMarkerLength(image->buffer + image->pos);
+    if (len < 2 || image->pos + len > image->size)
+    {
+        Log(Error, "Segment of length %u at %lu runs past the end of the file.", len, image->pos);
+        return SetJPEGError(image, JPEG_ERR_BAD_SEGMENT);
+    }
+    return true;
+}
+
+bool HandleAPPHeaders(JPEG *image)
 {
-    // Be aware of thumbnail datas here
-    while (image->pos < image->size)
+    // Thumbnails in APP0 / APP1 get skipped with the rest, FindJPEGThumbnail (exif.h) looks for them on its own
+    while (image->pos + 1 < image->size)
     {
         uint8_t next_byte = image->buffer[image->pos + 1];
         if (image->buffer[image->pos] == 0xFF)
         {
             // Try to examine the next pos
+            if (next_byte == EOI)
+            {
+                TRACE(TRACE_SCANS, "EOI at %lu", image->pos);
+                image->pos += 2;
+                return true;
+            }
+            else if (IsRSTMarker(next_byte))
+            {
+                Log(Info, "Skipped over the RST Marker");
+                image->pos += 2;
+                continue;
+            }
+
+            // Every other marker is followed by a length field
+            image->pos += 2;
+            if (!ValidateSegment(image))
+                return false;
 
             if (IsAPPMarker(next_byte))
             {
                 // Do something stupid here, that is parse whole Exif format or just glare and skip over it
                 // Two bytes following this are length of the segment
                 // Skip over everything that is not known
-                image->pos += 2;
                 if (next_byte == 0xE0) // EXIF metadata
                 {
                     // Don't bother with it
@@ -114,50 +246,50 @@ void HandleAPPHeaders(JPEG *image)
                     Log(Warning, "Skipping over 0xEE 0x%02X of length %u.", next_byte, len);
                 }
             }
-            else if (next_byte == SOF0) // baseline DCT
+            else if (next_byte == SOF0 || next_byte == SOF1) // baseline DCT
             {
-                image->pos = image->pos + 2;
-                BaselineDCT(image);
+                if (!BaselineDCT(image))
+                    return false;
             }
-            else if (next_byte == SOF1)
+            else if (next_byte == SOF2)
             {
-                image->pos = image->pos + 2;
-                ProgressiveDCT(image);
+                if (!ProgressiveDCT(image))
+                    return false;
             }
-            else if (next_byte == DQT)
+            else if ((next_byte & 0xF0) == 0xC0 && next_byte != DHT && next_byte != 0xC8 && next_byte != 0xCC)
             {
-                image->pos += 2;
-                QuantizationSegment(image);
+                // Lossless, hierarchical and arithmetic coded frames
+                Log(Error, "Frame type 0xFF %02X not supported.", next_byte);
+                return SetJPEGError(image, JPEG_ERR_UNSUPPORTED);
             }
-            else if (next_byte == DHT)
+            else if ((next_byte == DQT || next_byte == DHT) && image->keep_tables)
             {
-                image->pos += 2;
-                HuffmanSegment(image);
+                image->pos = image->pos + GetMarkerLength(image->buffer + image->pos);
             }
-            else if (next_byte == EOI)
+            else if (next_byte == DQT)
             {
-                fprintf(stderr, "\nEnd of the image reached at %lu.", image->pos);
+                if (!QuantizationSegment(image))
+                    return false;
             }
-            else if (IsRSTMarker(next_byte))
+            else if (next_byte == DHT)
             {
-                Log(Info, "Skipped over the RST Marker");
-                image->pos += 2;
+                if (!HuffmanSegment(image))
+                    return false;
             }
             else if (next_byte == DRI)
             {
-                image->pos += 2;
-                DefineRestartIntervalSegment(image);
+                if (!DefineRestartIntervalSegment(image))
+                    return false;
             }
             else if (next_byte == SOS)
             {
                 // Start of Scan segment
-                image->pos += 2;
-                StartOfScanSegment(image);
+                if (!StartOfScanSegment(image))
+                    return false;
             }
             else
             {
                 // Read the length and skip over it
-                image->pos      = image->pos + 2;
                 uint16_t length = GetMarkerLength(image->buffer + image->pos);
                 Log(Warning, "Skipping over marker 0xFF %02X with length %u", next_byte, length);
                 // skip over it
@@ -168,62 +300,167 @@ void HandleAPPHeaders(JPEG *image)
         {
             Log(Error, "Into the infinite world at %d and max size %d.", image->pos, image->size);
             Log(Warning, "This is probably the end, so quitting");
-            return;
+            return true;
+        }
+    }
+    return true;
+}
+
+JPEGError DecodeJPEG(JPEG *jpeg)
+{
+    if (jpeg->error != JPEG_OK)
+        return jpeg->error;
+
+    JPEGTimings *timings = jpeg->timings;
+    if (timings)
+    {
+        memset(timings->ns, 0, sizeof(timings->ns));
+        memset(timings->events, 0, sizeof(timings->events));
+    }
+    StageStart start = StageClock(jpeg);
+    if (ValidateJPEGHeader(jpeg) && HandleAPPHeaders(jpeg))
+    {
+        if (!jpeg->coefficients_only)
+            FinishDecode(jpeg);
+        else if (!jpeg->img.channels || !jpeg->img.components[0].mcu_counts)
+            SetJPEGError(jpeg, JPEG_ERR_INVALID_HEADER);
+    }
+
+    // Whatever isn't accounted to the other stages went into walking the markers
+    if (timings)
+    {
+        StageStart total = StageClock(jpeg);
+        total.ns         = total.ns - start.ns;
+        for (int i = 0; i < JPEG_COUNTER_COUNT; ++i)
+            total.events[i] = total.events[i] - start.events[i];
+        for (int stage = JPEG_STAGE_MARKERS + 1; stage < JPEG_STAGE_COUNT; ++stage)
+        {
+            total.ns = total.ns - timings->ns[stage];
+            for (int i = 0; i < JPEG_COUNTER_COUNT; ++i)
+                total.events[i] = total.events[i] - timings->events[stage][i];
         }
+        timings->ns[JPEG_STAGE_MARKERS] = total.ns;
+        memcpy(timings->events[JPEG_STAGE_MARKERS], total.events, sizeof(total.events));
     }
+    return jpeg->error;
 }
 
 void CleanUpDecoder(JPEG *image)
 {
+    // Safe to call on a partially initialized decoder, every pointer here is either NULL or owned
     free(image->buffer);
+    image->buffer = NULL;
 
     // Clean the huffman table and quantization tables
     // its hot mess, managing memory manually
-    for (int i = 0; i < image->img.channels; ++i)
-        free(image->img.components[i].mcu_blocks);
-    for (int i = 0; i < image->huffman_tables.count; ++i)
+    for (int i = 0; i < 4; ++i)
     {
-        free(image->huffman_tables.tables[i].huffman_val);
-        free(image->huffman_tables.tables[i].huffman_code);
+        free(image->img.components[i].mcu_blocks);
+        image->img.components[i].mcu_blocks   = NULL;
+        image->img.components[i].mcu_capacity = 0;
     }
+    if (image->huffman_tables.tables)
+        ClearJPEGTables(image);
 
     free(image->huffman_tables.tables);
     free(image->quantization_tables.qtables);
+    image->huffman_tables.tables      = NULL;
+    image->quantization_tables.qtables = NULL;
 
     free(image->hstream.buffer);
+    image->hstream.buffer = NULL;
+
+    free(image->output.data);
+    image->output.data     = NULL;
+    image->output.capacity = 0;
+}
+
+JPEGError ResetJPEGDecoder(JPEG *jpeg, uint8_t *data, uint64_t size)
+{
+    jpeg->error         = JPEG_OK;
+    jpeg->pos           = 0;
+    jpeg->buffer        = data;
+    jpeg->size          = size;
+    jpeg->scans_decoded = 0;
+
+    // Only the block allocations survive from the previous image
+    JPEGInfo img = {0};
+    for (int i = 0; i < 4; ++i)
+    {
+        img.components[i].mcu_blocks   = jpeg->img.components[i].mcu_blocks;
+        img.components[i].mcu_capacity = jpeg->img.components[i].mcu_capacity;
+    }
+    jpeg->img = img;
+
+    // The destuffed scan is never longer than the image
+    if (jpeg->hstream.capacity < size)
+    {
+        free(jpeg->hstream.buffer);
+        jpeg->hstream.buffer   = malloc(sizeof(*jpeg->hstream.buffer) * size);
+        jpeg->hstream.capacity = jpeg->hstream.buffer ? size : 0;
+        if (!jpeg->hstream.buffer)
+            SetJPEGError(jpeg, JPEG_ERR_OUT_OF_MEMORY);
+    }
+    return jpeg->error;
 }
 
-int main(int argc, char **argv)
+bool ReserveBlocks(JPEG *jpeg, JPEGComponent *component, uint32_t count)
 {
-    if (argc < 2)
+    if (count > component->mcu_capacity)
     {
-        fprintf(stderr, "Insufficient argument provided\nUSAGE : exe ./img.jpg\n");
-        return -1;
+        free(component->mcu_blocks);
+        component->mcu_blocks   = malloc(sizeof(*component->mcu_blocks) * count);
+        component->mcu_capacity = component->mcu_blocks ? count : 0;
+        if (!component->mcu_blocks)
+            return SetJPEGError(jpeg, JPEG_ERR_OUT_OF_MEMORY);
     }
-    JPEG image = {0};
-    LoadJpegFile(&image, argv[1]);
-    if (!ValidateJPEGHeader(&image))
+    component->mcu_counts = count;
+    return true;
+}
+
+uint8_t *ReserveOutput(JPEG *jpeg, uint64_t size)
+{
+    if (size > jpeg->output.capacity)
     {
-        fprintf(stderr, "Not a valid JPEG file\n");
-        return -3;
+        free(jpeg->output.data);
+        jpeg->output.data     = malloc(sizeof(*jpeg->output.data) * size);
+        jpeg->output.capacity = jpeg->output.data ? size : 0;
+        if (!jpeg->output.data)
+            SetJPEGError(jpeg, JPEG_ERR_OUT_OF_MEMORY);
     }
-    HandleAPPHeaders(&image);
-    CleanUpDecoder(&image);
-    return 0;
+    return jpeg->output.data;
 }
 
-void ProgressiveDCT(JPEG *img)
+bool ProgressiveDCT(JPEG *img)
 {
     Log(Info,
         "------------------------------ Progressive Discrete Cosine Transformed JPEG ------------------------------");
+    img->img.progressive = true;
+    if (!FrameHeader(img))
+        return false;
 
-    Log(Error, "Not Handled Yet");
+    // Every scan refines the same coefficient buffer, so it is allocated (zeroed) for the whole image up front
+    for (uint32_t i = 0; i < img->img.channels; ++i)
+    {
+        JPEGComponent *component = &img->img.components[i];
+        if (!ReserveBlocks(img, component,
+                           img->img.mcu_cols * img->img.mcu_rows * (component->HiVi >> 4) * (component->HiVi & 0x0F)))
+            return false;
+        memset(component->mcu_blocks, 0, sizeof(*component->mcu_blocks) * component->mcu_counts);
+    }
+    return true;
 }
 
-void BaselineDCT(JPEG *img)
+bool BaselineDCT(JPEG *img)
 {
     Log(Info,
         "\n------------------------------ Baseline Discrete Cosine Transformed JPEG ------------------------------");
+    img->img.progressive = false;
+    return FrameHeader(img);
+}
+
+bool FrameHeader(JPEG *img)
+{
     // Read the length of the image data
     uint16_t size      = GetMarkerLength(img->buffer + img->pos);
     uint8_t  bit_depth = img->buffer[img->pos + 2];
@@ -235,6 +472,11 @@ void BaselineDCT(JPEG *img)
     Log(Info, "Size of segment : %u.", size);
 
     uint8_t channels = img->buffer[img->pos + 7];
+    if (size < 8 + 3 * channels || !channels || channels > 4 || !width || !height)
+    {
+        Log(Error, "Invalid frame header with %u channels and dimension %ux%u.", channels, width, height);
+        return SetJPEGError(img, JPEG_ERR_INVALID_HEADER);
+    }
     // Fill image information
     img->img.width    = width;
     img->img.height   = height;
@@ -254,12 +496,80 @@ void BaselineDCT(JPEG *img)
             img->img.components[comp].identifier, img->img.components[comp].HiVi, img->img.components[comp].qtableptr);
     }
 
+    // A lone component is always scanned one block at a time, whatever sampling factors it declares
+    if (channels == 1)
+        img->img.components[0].HiVi = 0x11;
+    else if (channels != 3)
+    {
+        Log(Error, "%u channel images are not handled.", channels);
+        return SetJPEGError(img, JPEG_ERR_UNSUPPORTED);
+    }
+
     // Set up for chroma subsampling
     img->img.horizontal_subsampling = (img->img.components[0].HiVi & 0xF0) >> 4;
     img->img.vertical_subsampling   = (img->img.components[0].HiVi & 0x0F);
+    if (img->img.horizontal_subsampling < 1 || img->img.horizontal_subsampling > 2 ||
+        img->img.vertical_subsampling < 1 || img->img.vertical_subsampling > 2)
+    {
+        Log(Error, "Sampling factors %02X not supported.", img->img.components[0].HiVi);
+        return SetJPEGError(img, JPEG_ERR_UNSUPPORTED);
+    }
+    // Chroma is upsampled assuming it has one block per MCU
+    for (int comp = 1; comp < channels; ++comp)
+    {
+        if (img->img.components[comp].HiVi != 0x11)
+        {
+            Log(Error, "Sampling factors %02X of component %d not supported.", img->img.components[comp].HiVi, comp);
+            return SetJPEGError(img, JPEG_ERR_UNSUPPORTED);
+        }
+    }
+
+    img->img.mcu_cols = (width + 8 * img->img.horizontal_subsampling - 1) / (8 * img->img.horizontal_subsampling);
+    img->img.mcu_rows = (height + 8 * img->img.vertical_subsampling - 1) / (8 * img->img.vertical_subsampling);
+    return SetupDecodeRegion(img);
+}
+
+// Clamps the requested crop to the image and finds the MCUs covering it
+bool SetupDecodeRegion(JPEG *jpeg)
+{
+    JPEGInfo *info = &jpeg->img;
+    JPEGRect  roi  = {0, 0, info->width, info->height};
+
+    if (jpeg->crop.width && jpeg->crop.height)
+    {
+        if (jpeg->crop.x >= info->width || jpeg->crop.y >= info->height)
+        {
+            Log(Error, "Crop origin %u,%u lies outside of the image.", jpeg->crop.x, jpeg->crop.y);
+            return SetJPEGError(jpeg, JPEG_ERR_INVALID_ARGUMENT);
+        }
+        roi = jpeg->crop;
+        if (roi.width > info->width - roi.x)
+            roi.width = info->width - roi.x;
+        if (roi.height > info->height - roi.y)
+            roi.height = info->height - roi.y;
+    }
+
+    const uint32_t mcu_width  = 8 * info->horizontal_subsampling;
+    const uint32_t mcu_height = 8 * info->vertical_subsampling;
+
+    info->roi                 = roi;
+    info->region_x            = roi.x / mcu_width;
+    info->region_y            = roi.y / mcu_height;
+    info->region_cols         = (roi.x + roi.width + mcu_width - 1) / mcu_width - info->region_x;
+    info->region_rows         = (roi.y + roi.height + mcu_height - 1) / mcu_height - info->region_y;
+
+    // Progressive scans refine the coefficients of the whole image, only the output gets cropped
+    if (info->progressive)
+    {
+        info->region_x    = 0;
+        info->region_y    = 0;
+        info->region_cols = info->mcu_cols;
+        info->region_rows = info->mcu_rows;
+    }
+    return true;
 }
 
-void StartOfScanSegment(JPEG *img)
+bool StartOfScanSegment(JPEG *img)
 {
     uint16_t length = GetMarkerLength(img->buffer + img->pos);
 
@@ -268,8 +578,34 @@ void StartOfScanSegment(JPEG *img)
 
     uint8_t  no_of_components = img->buffer[img->pos + 2];
     uint16_t count            = 3;
+    if (!img->img.channels || !no_of_components || no_of_components > 4 || length < 6 + 2 * no_of_components)
+    {
+        Log(Error, "Start of scan before the frame header or with invalid length.");
+        return SetJPEGError(img, JPEG_ERR_INVALID_HEADER);
+    }
+
+    // Spectral selection and successive approximation follow the component list
+    JPEGScan scan          = {0};
+    uint16_t params        = count + 2 * no_of_components;
+    scan.count             = no_of_components;
+    scan.Ss                = img->buffer[img->pos + params];
+    scan.Se                = img->buffer[img->pos + params + 1];
+    scan.Ah                = img->buffer[img->pos + params + 2] >> 4;
+    scan.Al                = img->buffer[img->pos + params + 2] & 0x0F;
+
+    if (img->img.progressive &&
+        (scan.Se > 63 || scan.Ss > scan.Se || (scan.Ss == 0 && scan.Se != 0) || (scan.Ss && scan.count != 1) ||
+         scan.Al > 13))
+    {
+        Log(Error, "Invalid progressive scan %u..%u with approximation %u %u.", scan.Ss, scan.Se, scan.Ah, scan.Al);
+        return SetJPEGError(img, JPEG_ERR_INVALID_HEADER);
+    }
+
+    // Progressive scans only need the table they actually decode with
+    const bool needs_dc = !img->img.progressive || (scan.Ss == 0 && scan.Ah == 0);
+    const bool needs_ac = !img->img.progressive || scan.Ss > 0;
 
-    for (int i = 0; i < no_of_components; ++i)
+    for (int n = 0; n < no_of_components; ++n)
     {
         // For each components two bytes
         // First is the component identifier, defined in above jpeg struct
@@ -280,19 +616,21 @@ void StartOfScanSegment(JPEG *img)
         count         = count + 1;
 
         Log(Info, "Component identifier is : %d.", id);
-        printf("\t\tDC huffman : %d and AC huffman : %d.\n", DC_id, AC_id);
+        TRACE(TRACE_SCANS, "SOS component %d : DC table %d, AC table %d", id, DC_id, AC_id);
 
-        int found = true;
+        int found = false;
         for (int i = 0; i < img->img.channels; ++i)
         {
             if (id == img->img.components[i].identifier)
             {
+                found                        = true;
+                scan.components[n]           = i;
                 img->img.components[i].AC_id = AC_id;
                 img->img.components[i].DC_id = DC_id;
                 // store the pointer to the relevant DC
 
                 // Look for the AC and DC huffman table
-                bool ac_found = false, dc_found = false;
+                bool ac_found = !needs_ac, dc_found = !needs_dc;
                 for (uint8_t k = 0; k < img->huffman_tables.count; ++k)
                 {
                     if (img->huffman_tables.tables[k].type == AC)
@@ -311,21 +649,19 @@ void StartOfScanSegment(JPEG *img)
                             img->img.components[i].htable_dc_index = k;
                         }
                     }
-                    if (ac_found && dc_found)
-                        break;
                 }
 
                 if (!ac_found || !dc_found)
                 {
                     Log(Error, "Failed to find AC table for component %d.", id);
-                    found = false;
-                    break;
+                    return SetJPEGError(img, JPEG_ERR_BAD_HUFFMAN);
                 }
             }
         }
         if (!found)
         {
             Log(Error, "Failed to find corresponding identifier %d.", id);
+            return SetJPEGError(img, JPEG_ERR_INVALID_HEADER);
         }
     }
     Log(Info, "Last 3 bytes should be 0 63 and 0 -> Is it %d %d %d?", img->buffer[img->pos + count],
@@ -334,43 +670,97 @@ void StartOfScanSegment(JPEG *img)
     img->pos = img->pos + count;
     // Now comes the actually encoded data
     // Loop over till the number of components are consumed
-    ExtractHuffmanEncoded(img);
-    DecodeHuffmanStream(img);
+    if (img->img.progressive)
+    {
+        // Scans made only of components that never reach the output are stepped over without decoding them
+        bool needed = false;
+        for (int n = 0; n < scan.count; ++n)
+            needed = needed || scan.components[n] < DecodedComponents(img);
+
+        StageStart start = StageClock(img);
+        if (!ExtractHuffmanEncoded(img))
+            return false;
+        StageDone(img, JPEG_STAGE_DESTUFF, start);
+
+        start = StageClock(img);
+        if (needed && !DecodeProgressiveScan(img, &scan))
+            return false;
+        StageDone(img, JPEG_STAGE_HUFFMAN, start);
+
+        // Refinement scans only add low bits, the first scan of a band is what makes it usable
+        if (scan.Ah == 0)
+        {
+            uint64_t band = (scan.Se == 63 ? ~0ull : (1ull << (scan.Se + 1)) - 1) & ~((1ull << scan.Ss) - 1);
+            for (int n = 0; n < scan.count; ++n)
+                img->img.components[scan.components[n]].coef_received |= band;
+        }
+        img->scans_decoded++;
+        if (img->on_scan)
+            img->on_scan(img, img->scans_decoded, img->user_data);
+        return img->error == JPEG_OK;
+    }
+
+    if (scan.count != img->img.channels)
+    {
+        Log(Error, "Non interleaved baseline scans are not handled.");
+        return SetJPEGError(img, JPEG_ERR_UNSUPPORTED);
+    }
+
+    uint64_t             scan_offset = img->pos;
+    const MCUIndexEntry *resume      = NULL;
+    if (img->index && !img->build_index)
+        resume = SeekMCUIndex(img);
+    if (img->error != JPEG_OK)
+        return false;
+
+    StageStart start = StageClock(img);
+    if (!ExtractHuffmanEncoded(img))
+        return false;
+    StageDone(img, JPEG_STAGE_DESTUFF, start);
+
+    start = StageClock(img);
+    if (!DecodeHuffmanStream(img, resume))
+        return false;
+    StageDone(img, JPEG_STAGE_HUFFMAN, start);
+    if (img->build_index && !FinishMCUIndex(img, scan_offset))
+        return false;
     Log(Info, "JPEG decoded without any error :D");
+    return true;
+}
 
-    InverseCosineTransform(img);
+// Runs after the last scan, so progressive images go through IDCT only once
+bool FinishDecode(JPEG *jpeg)
+{
+    if (!jpeg->img.channels || !jpeg->img.components[0].mcu_counts)
+    {
+        Log(Error, "No scan was decoded.");
+        return SetJPEGError(jpeg, JPEG_ERR_INVALID_HEADER);
+    }
+    StageStart start = StageClock(jpeg);
+    if (!InverseQuantization(jpeg))
+        return false;
+    StageDone(jpeg, JPEG_STAGE_DEQUANT, start);
+
+    start = StageClock(jpeg);
+    InverseCosineTransform(jpeg);
 
-    InverseSignedNormalization(img);
+    InverseSignedNormalization(jpeg);
+    StageDone(jpeg, JPEG_STAGE_IDCT, start);
     // Now comes the merging part, but before that inverse discrete cosine transform
     // Lets try writing the grayscale image to the bmp format though
     // JPEGtoBMP(img, "whatever.bmp");
-    JPEGtoBMPChromaSubsampled(img, "chromasubsampled.bmp");
+    return ConvertToOutput(jpeg);
 }
 
-void InitJPEGDecoder(JPEG *jpeg)
+void BuildZigZagOrder(uint8_t order[64])
 {
-    jpeg->huffman_tables.tables =
-        malloc(sizeof(*jpeg->huffman_tables.tables) * 6); // A max of 6 huffman tables are allocated
-    jpeg->quantization_tables.qtables =
-        malloc(sizeof(*jpeg->quantization_tables.qtables) * 6); // Its around 4 but lets leave it
-
-    jpeg->quantization_tables.count = 0;
-    jpeg->huffman_tables.count      = 0;
-
-    // Make place for encoded stream of huffman
-    jpeg->hstream.pos      = 0;
-    jpeg->hstream.size     = 0;
-    jpeg->hstream.capacity = jpeg->size;
-    jpeg->hstream.buffer   = malloc(sizeof(*jpeg->hstream.buffer) * jpeg->size);
-
-    // Initialize the zigzag order
     int     x = 0, y = 0;
     int     arrow = 1;
 
     uint8_t index = 0;
     while (x != 7 || y != 7)
     {
-        jpeg->zigzag.order[index++] = x * 8 + y;
+        order[index++] = x * 8 + y;
         if ((y % 2 == 0) && (x == 0 || x == 7))
         {
             y = y + 1;
@@ -387,30 +777,49 @@ void InitJPEGDecoder(JPEG *jpeg)
             y = y + arrow;
         }
     }
-    jpeg->zigzag.order[index] = 63;
-    Log(Warning, "ZigZag Ordering is : \n");
-    for (uint8_t x = 0; x < 8; ++x)
-    {
-        for (uint8_t y = 0; y < 8; ++y)
-        {
-            printf("%6d  ", jpeg->zigzag.order[x * 8 + y]);
-        }
-        putchar('\n');
-    }
+    order[index] = 63;
 }
 
-void DecodeJPEG(JPEG *jpeg, HTable *htable, QTable *qtable)
+bool InitJPEGDecoder(JPEG *jpeg)
 {
+    jpeg->huffman_tables.tables =
+        malloc(sizeof(*jpeg->huffman_tables.tables) * 6); // A max of 6 huffman tables are allocated
+    jpeg->quantization_tables.qtables =
+        malloc(sizeof(*jpeg->quantization_tables.qtables) * 6); // Its around 4 but lets leave it
+
+    jpeg->quantization_tables.count = 0;
+    jpeg->huffman_tables.count      = 0;
+
+    // Make place for encoded stream of huffman
+    jpeg->hstream.pos      = 0;
+    jpeg->hstream.size     = 0;
+    jpeg->hstream.capacity = jpeg->size;
+    jpeg->hstream.buffer   = malloc(sizeof(*jpeg->hstream.buffer) * (jpeg->size + 1));
+
+    if (!jpeg->huffman_tables.tables || !jpeg->quantization_tables.qtables || !jpeg->hstream.buffer)
+        return SetJPEGError(jpeg, JPEG_ERR_OUT_OF_MEMORY);
+
+    BuildZigZagOrder(jpeg->zigzag.order);
+    for (uint8_t x = 0; TraceEnabled(TRACE_TABLES) && x < 8; ++x)
+    {
+        const uint8_t *row = jpeg->zigzag.order + x * 8;
+        TRACE(TRACE_TABLES, "zigzag : %6d %6d %6d %6d %6d %6d %6d %6d", row[0], row[1], row[2], row[3], row[4], row[5],
+              row[6], row[7]);
+    }
+    return true;
 }
 
-void DefineRestartIntervalSegment(JPEG *jpeg)
+bool DefineRestartIntervalSegment(JPEG *jpeg)
 {
     uint16_t length = GetMarkerLength(jpeg->buffer + jpeg->pos);
+    if (length < 4)
+        return SetJPEGError(jpeg, JPEG_ERR_BAD_SEGMENT);
     Log(Warning, "Got to JPEG Restart Interval and skipped with length : %d.", length);
     jpeg->img.use_restart_interval = true;
     jpeg->img.restart_interval     = (jpeg->buffer[jpeg->pos + 2] << 8) | jpeg->buffer[jpeg->pos + 3];
     jpeg->pos += length;
     Log(Warning, "Restart interval is set to : %d.", jpeg->img.restart_interval);
+    return true;
 }
 
 // Or should we say, blocks to raw array?
@@ -473,17 +882,21 @@ void ApplyInvQuantization(MCUBlock *mcu, QTable *qtable)
 bool InverseQuantization(JPEG *jpeg)
 {
     // for every dct block and every components inverse the quantization
-    for (uint8_t comp = 0; comp < jpeg->img.channels; ++comp)
+    for (uint8_t comp = 0; comp < DecodedComponents(jpeg); ++comp)
     {
-        if (jpeg->img.components[comp].qtableptr >= jpeg->quantization_tables.count)
+        // qtableptr is the id of the table, not its position
+        QTable *qtable = NULL;
+        for (uint8_t k = 0; k < jpeg->quantization_tables.count; ++k)
+            if (jpeg->quantization_tables.qtables[k].id == jpeg->img.components[comp].qtableptr)
+                qtable = &jpeg->quantization_tables.qtables[k];
+        if (!qtable)
         {
             Log(Error, "Invalid quantizationt table.");
-            exit(-1);
+            return SetJPEGError(jpeg, JPEG_ERR_BAD_QUANTIZATION);
         }
         for (uint32_t mcu = 0; mcu < jpeg->img.components[comp].mcu_counts; ++mcu)
         {
-            ApplyInvQuantization(&jpeg->img.components[comp].mcu_blocks[mcu],
-                                 &jpeg->quantization_tables.qtables[jpeg->img.components[comp].qtableptr]);
+            ApplyInvQuantization(&jpeg->img.components[comp].mcu_blocks[mcu], qtable);
         }
     }
     return true;
@@ -499,7 +912,7 @@ float alpha(uint8_t u)
 void InverseCosineTransform(JPEG *jpeg)
 {
     // For each block now apply the inverse discrete cosine transform
-    for (uint8_t comp = 0; comp < jpeg->img.channels; ++comp)
+    for (uint8_t comp = 0; comp < DecodedComponents(jpeg); ++comp)
     {
         for (uint32_t mcu = 0; mcu < jpeg->img.components[comp].mcu_counts; ++mcu)
         {
@@ -542,6 +955,133 @@ void InverseCosineTransform(JPEG *jpeg)
     /* } */
 }
 
+// Largest K (1, 2, 4 or 8) for which the top left KxK coefficients have all been received, 0 when not even DC
+static uint8_t PreviewScale(JPEG *jpeg, uint64_t received)
+{
+    uint8_t scale = 0;
+    for (uint8_t K = 1; K <= 8; K = K * 2)
+    {
+        uint64_t needed = 0;
+        for (uint8_t k = 0; k < 64; ++k)
+        {
+            if (jpeg->zigzag.order[k] / 8 < K && jpeg->zigzag.order[k] % 8 < K)
+                needed |= 1ull << k;
+        }
+        if ((received & needed) != needed)
+            break;
+        scale = K;
+    }
+    return scale;
+}
+
+// KxK IDCT of the low frequencies only, each output sample is the 8x8 IDCT evaluated at the center of its
+// (8/K)x(8/K) cell and gets replicated over the cell
+void ReducedInverseCosineTransform(MCUBlock *blocks, uint32_t count, uint8_t K)
+{
+    if (!K)
+    {
+        memset(blocks, 0, sizeof(*blocks) * count);
+        return;
+    }
+
+    float basis[8][8];
+    for (uint8_t i = 0; i < K; ++i)
+    {
+        for (uint8_t u = 0; u < K; ++u)
+            basis[i][u] = alpha(u) * cosf((2 * i + 1) * u * M_PI / (2 * K));
+    }
+
+    const uint8_t cell = 8 / K;
+    for (uint32_t mcu = 0; mcu < count; ++mcu)
+    {
+        MCUBlock *curblock = blocks + mcu;
+        float     rows[8][8];
+
+        // Separable, along v first then along u
+        for (uint8_t u = 0; u < K; ++u)
+        {
+            for (uint8_t y = 0; y < K; ++y)
+            {
+                float val = 0.0f;
+                for (uint8_t v = 0; v < K; ++v)
+                    val = val + curblock->block[u * 8 + v] * basis[y][v];
+                rows[u][y] = val;
+            }
+        }
+
+        for (uint8_t x = 0; x < K; ++x)
+        {
+            for (uint8_t y = 0; y < K; ++y)
+            {
+                float val = 0.0f;
+                for (uint8_t u = 0; u < K; ++u)
+                    val = val + basis[x][u] * rows[u][y];
+
+                int16_t sample = roundf(0.25f * val);
+                for (uint8_t i = 0; i < cell; ++i)
+                {
+                    for (uint8_t j = 0; j < cell; ++j)
+                        curblock->block[(x * cell + i) * 8 + y * cell + j] = sample;
+                }
+            }
+        }
+    }
+}
+
+JPEGError JPEGRenderPreview(JPEG *jpeg)
+{
+    if (jpeg->error != JPEG_OK)
+        return jpeg->error;
+    if (!jpeg->img.progressive || !jpeg->img.components[0].mcu_counts)
+    {
+        SetJPEGError(jpeg, JPEG_ERR_INVALID_ARGUMENT);
+        return jpeg->error;
+    }
+
+    // The later scans still need the coefficients, so the regular pipeline runs over copies swapped in for now
+    MCUBlock *coefficients[4] = {0};
+    for (uint8_t comp = 0; comp < DecodedComponents(jpeg); ++comp)
+    {
+        JPEGComponent *component = &jpeg->img.components[comp];
+        MCUBlock      *copy      = malloc(sizeof(*copy) * component->mcu_counts);
+        if (!copy)
+        {
+            SetJPEGError(jpeg, JPEG_ERR_OUT_OF_MEMORY);
+            break;
+        }
+        memcpy(copy, component->mcu_blocks, sizeof(*copy) * component->mcu_counts);
+        coefficients[comp]    = component->mcu_blocks;
+        component->mcu_blocks = copy;
+    }
+
+    if (jpeg->error == JPEG_OK && InverseQuantization(jpeg))
+    {
+        for (uint8_t comp = 0; comp < DecodedComponents(jpeg); ++comp)
+        {
+            JPEGComponent *component = &jpeg->img.components[comp];
+            uint8_t        K         = PreviewScale(jpeg, component->coef_received);
+            Log(Info, "Preview of component %u with a %ux%u IDCT.", comp, K, K);
+            ReducedInverseCosineTransform(component->mcu_blocks, component->mcu_counts, K);
+        }
+        InverseSignedNormalization(jpeg);
+
+        JPEGRowSink *sink = jpeg->sink;
+        jpeg->sink        = NULL;
+        ConvertToOutput(jpeg);
+        jpeg->sink = sink;
+    }
+
+    for (uint8_t comp = 0; comp < DecodedComponents(jpeg); ++comp)
+    {
+        if (coefficients[comp])
+        {
+            free(jpeg->img.components[comp].mcu_blocks);
+            jpeg->img.components[comp].mcu_blocks = coefficients[comp];
+        }
+    }
+    return jpeg->error;
+}
+
 uint8_t clamp0_255(int16_t val)
 {
     if (val < 0)
@@ -553,7 +1093,7 @@ uint8_t clamp0_255(int16_t val)
 void InverseSignedNormalization(JPEG *jpeg)
 {
     // For each block now apply the inverse discrete cosine transform
-    for (uint8_t comp = 0; comp < jpeg->img.channels; ++comp)
+    for (uint8_t comp = 0; comp < DecodedComponents(jpeg); ++comp)
     {
         for (uint32_t mcu = 0; mcu < jpeg->img.components[comp].mcu_counts; ++mcu)
         {
@@ -567,55 +1107,35 @@ void InverseSignedNormalization(JPEG *jpeg)
     }
 }
 
-void YCbCrToRGB(JPEG *jpeg, uint8_t *img_data)
+void YCbCrToRGB(JPEG *jpeg, uint8_t *img_data, uint32_t pixels)
 {
     int16_t colors[4];
-    for (uint32_t h = 0; h < jpeg->img.height; ++h)
+    for (uint32_t w = 0; w < pixels; ++w)
     {
-        for (uint32_t w = 0; w < jpeg->img.width; ++w)
-
-        {
-            colors[0] = img_data[0];
-            colors[1] = img_data[1] - 128;
-            colors[2] = img_data[2] - 128; // This concludes the JPEG decompressor
-                                           // Was fun doing it
+        colors[0] = img_data[0];
+        colors[1] = img_data[1] - 128;
+        colors[2] = img_data[2] - 128; // This concludes the JPEG decompressor
+                                       // Was fun doing it
 
-            int16_t r   = colors[0] + 1.402f * colors[2];
-            int16_t g   = colors[0] - 0.3441f * colors[1] - 0.71414f * colors[2];
-            int16_t b   = colors[0] + 1.772f * colors[1];
+        int16_t r   = colors[0] + 1.402f * colors[2];
+        int16_t g   = colors[0] - 0.3441f * colors[1] - 0.71414f * colors[2];
+        int16_t b   = colors[0] + 1.772f * colors[1];
 
-            img_data[0] = clamp0_255(r);
-            img_data[1] = clamp0_255(g);
-            img_data[2] = clamp0_255(b);
+        img_data[0] = clamp0_255(r);
+        img_data[1] = clamp0_255(g);
+        img_data[2] = clamp0_255(b);
 
-            // For grayscale - luminance image (only luma component)
-            /* img_data[0] = clamp0_255(img_data[0]); */
-            /* img_data[1] = clamp0_255(img_data[0]); */
-            /* img_data[2] = clamp0_255(img_data[0]); */
+        // For grayscale - luminance image (only luma component)
+        /* img_data[0] = clamp0_255(img_data[0]); */
+        /* img_data[1] = clamp0_255(img_data[0]); */
+        /* img_data[2] = clamp0_255(img_data[0]); */
 
-            img_data = img_data + jpeg->img.channels;
-        }
+        img_data = img_data + jpeg->img.channels;
     }
 }
 
 bool ChromaSubSamplingNone(JPEG *jpeg, uint8_t *image_data, uint32_t len);
 bool ChromaSubSamplingBoth(JPEG *jpeg, uint8_t *image_data, uint32_t len);
-bool ChromaSubSamplingAll(JPEG *jpeg, uint8_t *image_data, uint32_t len);
-
-// returns status
-bool JPEGToRawArray(JPEG *jpeg, uint8_t **out_data, uint32_t *len)
-{
-    *out_data = malloc(sizeof(**out_data) * (jpeg->img.width * jpeg->img.height * jpeg->img.channels));
-    *len      = jpeg->img.width * jpeg->img.height * jpeg->img.channels;
-
-    /* if (jpeg->img.vertical_subsampling == 1 && jpeg->img.horizontal_subsampling == 1) */
-    /*     return ChromaSubSamplingNone(jpeg,*out_data,*len); */
-    /* if (jpeg->img.vertical_subsampling == 2 && jpeg->img.horizontal_subsampling == 2) */
-    //    return ChromaSubSamplingBoth(jpeg,*out_data, *len);
-    return ChromaSubSamplingAll(jpeg, *out_data, *len);
-    Log(Error, "Chroma subsampling method not supported");
-    return false;
-}
 
 bool ChromaSubSamplingNone(JPEG *jpeg, uint8_t *image_data, uint32_t len)
 {
@@ -673,7 +1193,7 @@ bool ChromaSubSamplingBoth(JPEG *jpeg, uint8_t *image_data, uint32_t len)
     if (jpeg->img.channels < 3)
     {
         Log(Error, "Fewer channels than expected... Exiting ");
-        exit(-3);
+        return SetJPEGError(jpeg, JPEG_ERR_UNSUPPORTED);
     }
 
     uint32_t       hRange     = ceilf(nmcu_h / 2.0f);
@@ -684,6 +1204,8 @@ bool ChromaSubSamplingBoth(JPEG *jpeg, uint8_t *image_data, uint32_t len)
     // temporary buffer to hold the decoded subsampled data
     uint8_t *data = malloc(sizeof(*data) * alloc_size);
     Log(Info, "Allocation size : %d.", alloc_size);
+    if (!data)
+        return SetJPEGError(jpeg, JPEG_ERR_OUT_OF_MEMORY);
 
     MCUBlock *luma_y_block    = jpeg->img.components[0].mcu_blocks;
     MCUBlock *chroma_cb_block = jpeg->img.components[1].mcu_blocks;
@@ -755,128 +1277,253 @@ bool ChromaSubSamplingBoth(JPEG *jpeg, uint8_t *image_data, uint32_t len)
     return true;
 }
 
-bool ChromaSubSamplingAll(JPEG *jpeg, uint8_t *image_data, uint32_t len)
+// Copies a rectangle of a component, in its own (possibly subsampled) sample coordinates, out of the decoded region.
+// Every sample is written `repeat` times
+void CopyComponentSamples(JPEG *jpeg, uint32_t comp, JPEGRect rect, uint8_t *out, uint32_t repeat)
 {
-    // This can be made to handle every other ones too
-    Log(Warning, "Chroma SubSampling -> Both\n");
-    uint32_t total_pixels = 0;
-    uint32_t nmcu_h       = (jpeg->img.height + 7) / 8;
-    uint32_t nmcu_w       = (jpeg->img.width + 7) / 8;
-
-    if (jpeg->img.channels < 3)
+    const JPEGInfo      *info       = &jpeg->img;
+    const JPEGComponent *component  = &info->components[comp];
+    const uint32_t       H          = component->HiVi >> 4;
+    const uint32_t       V          = component->HiVi & 0x0F;
+    const uint32_t       mcu_width  = 8 * H;
+    const uint32_t       mcu_height = 8 * V;
+
+    for (uint32_t r = 0; r < rect.height; ++r)
     {
-        Log(Error, "Fewer channels than expected... Exiting ");
-        exit(-3);
-    }
-
-    uint32_t       hRange     = ceilf(nmcu_h / (float)jpeg->img.vertical_subsampling);
-    uint32_t       wRange     = ceilf(nmcu_w / (float)jpeg->img.horizontal_subsampling);
+        // Position of the row inside the decoded region
+        const uint32_t  ly  = rect.y + r - info->region_y * mcu_height;
+        const MCUBlock *row =
+            component->mcu_blocks + (ly / mcu_height) * info->region_cols * H * V + (ly % mcu_height) / 8 * H;
+        const uint32_t  py  = (ly % 8) * 8;
 
-    const uint32_t alloc_size = (hRange * jpeg->img.vertical_subsampling * 8) *
-                                (wRange * jpeg->img.horizontal_subsampling * 8) * jpeg->img.channels;
-
-    // temporary buffer to hold the decoded subsampled data
-    uint8_t *data = malloc(sizeof(*data) * alloc_size);
-    Log(Info, "Allocation size : %d.", alloc_size);
-
-    MCUBlock *luma_y_block    = jpeg->img.components[0].mcu_blocks;
-    MCUBlock *chroma_cb_block = jpeg->img.components[1].mcu_blocks;
-    MCUBlock *chroma_cr_block = jpeg->img.components[2].mcu_blocks;
+        for (uint32_t c = 0; c < rect.width; ++c)
+        {
+            const uint32_t  lx     = rect.x + c - info->region_x * mcu_width;
+            const MCUBlock *block  = row + (lx / mcu_width) * H * V + (lx % mcu_width) / 8;
+            const uint8_t   sample = block->block[py + lx % 8];
+            for (uint32_t ch = 0; ch < repeat; ++ch)
+                *(out++) = sample;
+        }
+    }
+}
 
-    // OOF, a greater pain
-    // Disregarding luminous intensity for now
-    // Read 4 blocks and arrange this is in a (0,1) -> (0,0) -> (1,1) -> (1,0) order
-    // Read 4 blocks and arrange them in a 2x2 blocks array
-    uint32_t adj_width  = wRange * jpeg->img.horizontal_subsampling * 8;
-    uint32_t adj_height = hRange * jpeg->img.vertical_subsampling * 8;
+// Interleaves Y, Cb and Cr for output rows [first, first + count) of the roi. Every chroma sample is replicated over
+// the luma samples it covers, sample x of a component with H columns per MCU covers luma x * Hmax / H onwards
+void InterleaveRows(JPEG *jpeg, uint32_t first, uint32_t count, uint8_t *out)
+{
+    const JPEGInfo *info     = &jpeg->img;
+    const JPEGRect *roi      = &info->roi;
+    const uint32_t  channels = info->channels;
 
-    for (uint32_t mcu_h = 0; mcu_h < hRange; mcu_h++)
+    for (uint32_t r = 0; r < count; ++r)
     {
-        for (uint32_t mcu_w = 0; mcu_w < wRange; mcu_w++)
+        for (uint32_t comp = 0; comp < channels; ++comp)
         {
-            // No padding or leftover considered for now
-            for (int h = 0; h < jpeg->img.vertical_subsampling; ++h)
+            const JPEGComponent *component  = &info->components[comp];
+            const uint32_t       H          = component->HiVi >> 4;
+            const uint32_t       V          = component->HiVi & 0x0F;
+            const uint32_t       mcu_width  = 8 * H;
+            const uint32_t       mcu_height = 8 * V;
+
+            // Component row covering this output row, relative to the decoded region
+            const uint32_t  ly  = (roi->y + first + r) * V / info->vertical_subsampling - info->region_y * mcu_height;
+            const MCUBlock *row =
+                component->mcu_blocks + (ly / mcu_height) * info->region_cols * H * V + (ly % mcu_height) / 8 * H;
+            const uint32_t  py  = (ly % 8) * 8;
+            uint8_t        *ptr = out + comp;
+
+            for (uint32_t c = 0; c < roi->width; ++c)
             {
-                for (int w = 0; w < jpeg->img.horizontal_subsampling; ++w)
-                {
-                    // write it
-                    uint8_t *ptr = data + ((mcu_h * jpeg->img.vertical_subsampling + h) * 8 * adj_width +
-                                           (mcu_w * jpeg->img.horizontal_subsampling + w) * 8) *
-                                              jpeg->img.channels;
-                    for (uint32_t row = 0; row < 8; ++row)
-                    {
-                        for (uint32_t col = 0; col < 8; ++col)
-                        {
-                            total_pixels++;
-                            *(ptr++) = luma_y_block->block[row * 8 + col];
-                            // lets fix the color sampling here
-                            // Stretch one luma to all four parts
-                            // Take one quarter and stretch it to fill all four quarters
-                            // csf -> chroma sample factor
-                            const int csfX = 8 / jpeg->img.horizontal_subsampling;
-                            const int csfY = 8 / jpeg->img.vertical_subsampling;
-
-                            *(ptr++) = chroma_cb_block->block[(h * csfY + row % csfY) * 8 + w * csfX + (col % csfX)];
-                            *(ptr++) = chroma_cr_block->block[(h * csfY + row % csfY) * 8 + w * csfX + (col % csfX)];
-                        }
-                        ptr = ptr - 8 * jpeg->img.channels;
-                        ptr = ptr + adj_width * jpeg->img.channels;
-                    }
-                    // Point to the next luma block now
-                    luma_y_block++;
-                }
+                const uint32_t  lx    = (roi->x + c) * H / info->horizontal_subsampling - info->region_x * mcu_width;
+                const MCUBlock *block = row + (lx / mcu_width) * H * V + (lx % mcu_width) / 8;
+                *ptr                  = block->block[py + lx % 8];
+                ptr                   = ptr + channels;
             }
-            chroma_cb_block++;
-            chroma_cr_block++;
         }
+        out = out + roi->width * channels;
     }
+}
 
-    uint32_t pixel_collected = 0;
-    if (adj_height != jpeg->img.height || adj_width != jpeg->img.width)
+// Output rows [first, first + count) of the roi, tightly packed with `channels` bytes per pixel
+void ConvertRows(JPEG *jpeg, uint32_t first, uint32_t count, uint32_t channels, uint8_t *out)
+{
+    const JPEGRect *roi = &jpeg->img.roi;
+
+    // Grayscale fast path, luma samples are copied straight out of the blocks, no upsampling or color conversion
+    if (DecodedComponents(jpeg) == 1)
     {
-        Log(Warning,
-            "------------------------------ Image dimension mismatch, auto correcting ------------------------------ ");
-        uint8_t *mem_ptr   = data;
-        uint32_t copybytes = 0;
-        for (uint32_t h = 0; h < jpeg->img.height; ++h)
+        CopyComponentSamples(jpeg, 0, (JPEGRect){roi->x, roi->y + first, roi->width, count}, out, channels);
+        return;
+    }
+    InterleaveRows(jpeg, first, count, out);
+    YCbCrToRGB(jpeg, out, roi->width * count);
+}
+
+// Hands the output to jpeg->sink an MCU row at a time, so jpeg->output.data only ever holds one band. Sinks that map
+// their rows get them converted in place instead
+bool StreamToSink(JPEG *jpeg)
+{
+    const JPEGRect *roi        = &jpeg->img.roi;
+    JPEGOutput     *output     = &jpeg->output;
+    JPEGRowSink    *sink       = jpeg->sink;
+    const uint32_t  mcu_height = 8 * jpeg->img.vertical_subsampling;
+
+    uint8_t *band = NULL;
+    if (!sink->map_rows && !(band = ReserveOutput(jpeg, (uint64_t)roi->width * mcu_height * output->channels)))
+        return false;
+    StageStart start = StageClock(jpeg);
+    if (!sink->begin(sink->context, output->width, output->height, output->channels))
+        return SetJPEGError(jpeg, JPEG_ERR_IO);
+    StageDone(jpeg, JPEG_STAGE_OUTPUT, start);
+
+    bool written = true;
+    for (uint32_t first = 0; written && first < roi->height;)
+    {
+        // Bands follow the MCU grid, the crop may cut the first and the last one short
+        uint32_t count = mcu_height - (roi->y + first) % mcu_height;
+        if (count > roi->height - first)
+            count = roi->height - first;
+
+        if (sink->map_rows && !(band = sink->map_rows(sink->context, first, count)))
+            written = false;
+        else
         {
-            copybytes = jpeg->img.width * jpeg->img.channels;
-            memcpy(image_data, mem_ptr, sizeof(*image_data) * copybytes);
+            start = StageClock(jpeg);
+            ConvertRows(jpeg, first, count, output->channels, band);
+            StageDone(jpeg, JPEG_STAGE_COLOR, start);
 
-            image_data = image_data + copybytes;
-            mem_ptr    = mem_ptr + adj_width * jpeg->img.channels;
+            start   = StageClock(jpeg);
+            written = !sink->write_rows || sink->write_rows(sink->context, band, first, count);
+            StageDone(jpeg, JPEG_STAGE_OUTPUT, start);
         }
+        first = first + count;
     }
-    else
-        memcpy(image_data, data, sizeof(*image_data) * len);
-
-    free(data);
-    return true;
+    start   = StageClock(jpeg);
+    written = sink->finish(sink->context) && written;
+    StageDone(jpeg, JPEG_STAGE_OUTPUT, start);
+    return written || SetJPEGError(jpeg, JPEG_ERR_IO);
 }
 
-void JPEGtoBMPChromaSubsampled(JPEG *jpeg, const char *output)
+// Native Y, Cb and Cr planes one after the other, each cropped to the part of the component covering the roi
+bool PlanesToOutput(JPEG *jpeg)
 {
-    // Lets try writing only the luminance part, not the chrominance part
-    // There are four modes of chroma subsampling
+    const JPEGInfo *info   = &jpeg->img;
+    const JPEGRect *roi    = &info->roi;
+    JPEGOutput     *output = &jpeg->output;
+    JPEGRect        rects[3];
+    uint64_t        total  = 0;
 
-    // Need to write the color pixels
-    // Form an 1D array
+    for (uint32_t comp = 0; comp < DecodedComponents(jpeg); ++comp)
+    {
+        // Chroma sample x covers luma samples x * Hmax / H up to (x + 1) * Hmax / H
+        const uint32_t H = info->components[comp].HiVi >> 4;
+        const uint32_t V = info->components[comp].HiVi & 0x0F;
+        const uint32_t x = roi->x * H / info->horizontal_subsampling;
+        const uint32_t y = roi->y * V / info->vertical_subsampling;
+        rects[comp]      = (JPEGRect){x, y,
+                                 ((roi->x + roi->width) * H + info->horizontal_subsampling - 1) /
+                                         info->horizontal_subsampling - x,
+                                 ((roi->y + roi->height) * V + info->vertical_subsampling - 1) /
+                                         info->vertical_subsampling - y};
+        total = total + (uint64_t)rects[comp].width * rects[comp].height;
+    }
+
+    uint8_t *plane = ReserveOutput(jpeg, total);
+    if (!plane)
+        return false;
+
+    for (uint32_t comp = 0; comp < DecodedComponents(jpeg); ++comp)
+    {
+        output->planes[comp]       = plane;
+        output->plane_width[comp]  = rects[comp].width;
+        output->plane_height[comp] = rects[comp].height;
+        CopyComponentSamples(jpeg, comp, rects[comp], plane, 1);
+        plane = plane + rects[comp].width * rects[comp].height;
+    }
+    return true;
+}
 
-    uint32_t totalpixels = 0;
-    uint8_t *image_data  = NULL;
-    uint32_t len         = 0;
+// Upsamples and color converts the decoded region into jpeg->output, or through jpeg->sink when there is one
+bool ConvertToOutput(JPEG *jpeg)
+{
+    const JPEGRect *roi      = &jpeg->img.roi;
+    uint32_t        channels = jpeg->img.channels;
+
+    memset(jpeg->output.planes, 0, sizeof(jpeg->output.planes));
+    if (jpeg->format == JPEG_OUTPUT_YUV_PLANAR)
+        channels = DecodedComponents(jpeg);
+    else if (DecodedComponents(jpeg) == 1)
+        channels = jpeg->format == JPEG_OUTPUT_RGB ? 3 : 1;
+
+    jpeg->output.width    = roi->width;
+    jpeg->output.height   = roi->height;
+    jpeg->output.channels = channels;
+
+    if (jpeg->sink && jpeg->format == JPEG_OUTPUT_YUV_PLANAR)
+        return SetJPEGError(jpeg, JPEG_ERR_INVALID_ARGUMENT);
+    if (jpeg->sink)
+        return StreamToSink(jpeg);
+
+    StageStart start = StageClock(jpeg);
+    if (jpeg->format == JPEG_OUTPUT_YUV_PLANAR)
+    {
+        if (!PlanesToOutput(jpeg))
+            return false;
+    }
+    else
+    {
+        uint8_t *out = ReserveOutput(jpeg, (uint64_t)roi->width * roi->height * channels);
+        if (!out)
+            return false;
+        ConvertRows(jpeg, 0, roi->height, channels, out);
+    }
+    StageDone(jpeg, JPEG_STAGE_COLOR, start);
+    return true;
+}
 
-    JPEGToRawArray(jpeg, &image_data, &len);
-    YCbCrToRGB(jpeg, image_data);
+bool JPEGtoBMPChromaSubsampled(JPEG *jpeg, const char *output, uint32_t depth)
+{
+    // Writes the decoded pixels, cropped if a region of interest was requested
+    JPEGOutput *out = &jpeg->output;
+    if (!out->data || jpeg->format == JPEG_OUTPUT_YUV_PLANAR)
+        return SetJPEGError(jpeg, JPEG_ERR_INVALID_ARGUMENT);
 
-    Log(Warning, "Total pixel counts were approximately : %u.", totalpixels);
     BMP bmp = {0};
 
+    // 32 bits per pixel only makes sense for color, gray stays 8 bit with its palette
+    const uint32_t bytes = depth == 32 && out->channels == 3 ? 4 : out->channels;
+
     // Memory for extra padding bytes are to be allocated seperately
-    InitBMP(&bmp, jpeg->img.width * jpeg->img.height * jpeg->img.channels + 10000, jpeg->img.channels, true);
+    InitBMP(&bmp, ((out->width * bytes + 3) & ~3u) * out->height + 10000, out->channels, true);
+    if (!bmp.buffer)
+        return SetJPEGError(jpeg, JPEG_ERR_OUT_OF_MEMORY);
+    bmp.depth = 8 * bytes;
     WriteBMPHeader(&bmp);
-    WriteBMPData(&bmp, image_data, jpeg->img.width, jpeg->img.height, jpeg->img.channels);
+    WriteBMPData(&bmp, out->data, out->width, out->height, out->channels);
     WriteBMPToFile(&bmp, output);
     DestroyBMP(&bmp);
-    free(image_data);
+    return true;
+}
+
+// Raw planes, Y then Cb then Cr, the layout of I420 / I422 / I444 files for 4:2:0 / 4:2:2 / 4:4:4 images
+bool JPEGtoYUV(JPEG *jpeg, const char *output)
+{
+    JPEGOutput *out = &jpeg->output;
+    if (!out->data || jpeg->format != JPEG_OUTPUT_YUV_PLANAR)
+        return SetJPEGError(jpeg, JPEG_ERR_INVALID_ARGUMENT);
+
+    FILE *fp = fopen(output, "wb");
+    if (!fp)
+    {
+        Log(Error, "Failed to open %s for writing.", output);
+        return SetJPEGError(jpeg, JPEG_ERR_IO);
+    }
+    bool written = true;
+    for (uint32_t comp = 0; comp < out->channels; ++comp)
+    {
+        size_t size = (size_t)out->plane_width[comp] * out->plane_height[comp];
+        written     = written && fwrite(out->planes[comp], 1, size, fp) == size;
+    }
+    fclose(fp);
+    return written || SetJPEGError(jpeg, JPEG_ERR_IO);
 }
@@ -4,6 +4,22 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+// Every decode path reports failures through one of these instead of exiting the process
+typedef enum JPEGError
+{
+    JPEG_OK = 0,
+    JPEG_ERR_IO,             // failed to open or read the input
+    JPEG_ERR_OUT_OF_MEMORY,
+    JPEG_ERR_INVALID_HEADER, // missing SOI or a malformed frame header
+    JPEG_ERR_BAD_SEGMENT,    // marker segment length runs past the end of the data
+    JPEG_ERR_TRUNCATED,      // entropy coded data ended before all the MCUs were decoded
+    JPEG_ERR_BAD_HUFFMAN,    // undecodable huffman code or a missing/invalid huffman table
+    JPEG_ERR_BAD_QUANTIZATION,
+    JPEG_ERR_BAD_COEFFICIENT, // coefficient magnitude or run length out of range
+    JPEG_ERR_UNSUPPORTED,
+    JPEG_ERR_INVALID_ARGUMENT // e.g. a crop rectangle that lies outside of the image
+} JPEGError;
+
 typedef enum AC_DC
 {
     AC,
@@ -41,8 +57,9 @@ typedef struct QuantizationTable
 
 typedef enum MarkerType
 {
-    SOF0 = 0xC0,
-    SOF1 = 0xC2,
+    SOF0 = 0xC0, // baseline
+    SOF1 = 0xC1, // extended sequential, decoded like baseline
+    SOF2 = 0xC2, // progressive
     DHT  = 0xC4,
     DQT  = 0xDB,
     DRI  = 0xDD,
@@ -73,11 +90,35 @@ typedef struct JPEGComponent
     uint8_t qtable_index;
 
     uint32_t  mcu_counts;
+    uint32_t  mcu_capacity; // blocks allocated, kept across images by ResetJPEGDecoder
     MCUBlock *mcu_blocks;
+
+    // Progressive only, bit k set once the first scan of zigzag coefficient k went through
+    uint64_t coef_received;
 } JPEGComponent;
 
+typedef struct JPEGRect
+{
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+} JPEGRect;
+
+// Parameters of the scan being decoded
+typedef struct JPEGScan
+{
+    uint8_t count;         // components in this scan
+    uint8_t components[4]; // their index in JPEGInfo.components
+    uint8_t Ss;            // spectral selection start and end
+    uint8_t Se;
+    uint8_t Ah;            // successive approximation bit positions, high and low
+    uint8_t Al;
+} JPEGScan;
+
 typedef struct JPEGInfo
 {
+    bool     progressive;
     bool     use_restart_interval;
     uint32_t restart_interval;
 
@@ -88,6 +129,19 @@ typedef struct JPEGInfo
     uint32_t width;
     uint32_t depth;
     uint32_t channels;
+
+    // MCU grid of the whole image
+    uint32_t mcu_cols;
+    uint32_t mcu_rows;
+
+    // MCUs whose coefficients are kept, everything outside is only entropy decoded
+    uint32_t region_x;
+    uint32_t region_y;
+    uint32_t region_cols;
+    uint32_t region_rows;
+
+    // Pixel rectangle that ends up in the output, the crop clamped to the image
+    JPEGRect roi;
     // possibly buffer here
     // It may range from 0 to 4 depending upon image type
     JPEGComponent components[4];
@@ -101,8 +155,86 @@ typedef struct HuffmanEncodedStream
     uint8_t *buffer;
 } HuffmanEncodedStream;
 
+// Pixel layout of jpeg->output, chosen before DecodeJPEG
+typedef enum JPEGOutputFormat
+{
+    JPEG_OUTPUT_NATIVE = 0, // gray for single component images, RGB otherwise
+    JPEG_OUTPUT_RGB,        // single component images get replicated to RGB
+    JPEG_OUTPUT_GRAY,       // luma only, chroma gets entropy decoded but is never stored, transformed or converted
+    JPEG_OUTPUT_YUV_PLANAR  // Y, Cb and Cr planes at their native resolution, no upsampling or color conversion
+} JPEGOutputFormat;
+
+// Decoded pixels, interleaved and tightly packed
+typedef struct JPEGOutput
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels; // interleaved channels, or the number of planes for JPEG_OUTPUT_YUV_PLANAR
+    uint8_t *data;
+    uint64_t capacity; // bytes allocated for data, reused by the next image when large enough
+
+    // JPEG_OUTPUT_YUV_PLANAR only, planes are tightly packed one after the other inside data
+    uint8_t *planes[3];
+    uint32_t plane_width[3];
+    uint32_t plane_height[3];
+} JPEGOutput;
+
+// Takes the output a band of rows at a time, top to bottom, in place of a whole image in jpeg->output. A band never
+// spans more than one MCU row, which is all jpeg->output.data then holds. See sinks.h for the file writers
+typedef struct JPEGRowSink
+{
+    void *context;
+    bool (*begin)(void *context, uint32_t width, uint32_t height, uint32_t channels);
+    // optional with map_rows
+    bool (*write_rows)(void *context, const uint8_t *rows, uint32_t first_row, uint32_t count);
+    bool (*finish)(void *context); // called whenever begin succeeded, even if writing failed
+
+    // Optional, where rows [first_row, first_row + count) should go, tightly packed. Pixels are then converted straight
+    // into it and jpeg->output isn't used at all
+    uint8_t *(*map_rows)(void *context, uint32_t first_row, uint32_t count);
+} JPEGRowSink;
+
+// Where the time of a decode goes, see jpeg->timings
+typedef enum JPEGStage
+{
+    JPEG_STAGE_MARKERS = 0, // segment parsing, everything not counted by the stages below
+    JPEG_STAGE_DESTUFF,     // copying the entropy coded data out without stuffing bytes and restart markers
+    JPEG_STAGE_HUFFMAN,     // entropy decoding into coefficient blocks
+    JPEG_STAGE_DEQUANT,
+    JPEG_STAGE_IDCT,        // inverse DCT, level shift and clamping
+    JPEG_STAGE_COLOR,       // upsampling and color conversion
+    JPEG_STAGE_OUTPUT,      // handing rows to jpeg->sink
+    JPEG_STAGE_COUNT
+} JPEGStage;
+
+// Hardware and kernel event counts, kept per stage next to the times when timings->counters is set
+typedef enum JPEGCounter
+{
+    JPEG_COUNTER_CYCLES = 0,
+    JPEG_COUNTER_INSTRUCTIONS,
+    JPEG_COUNTER_BRANCH_MISSES,
+    JPEG_COUNTER_L1D_MISSES, // L1 data cache read misses
+    JPEG_COUNTER_LLC_MISSES, // last level cache misses
+    JPEG_COUNTER_PAGE_FAULTS,
+    JPEG_COUNTER_COUNT
+} JPEGCounter;
+
+struct PerfCounters;
+
+typedef struct JPEGTimings
+{
+    uint64_t             ns[JPEG_STAGE_COUNT];
+    struct PerfCounters *counters; // optional, opened by OpenPerfCounters (perfcounters.h) on the decoding thread
+    uint64_t             events[JPEG_STAGE_COUNT][JPEG_COUNTER_COUNT];
+} JPEGTimings;
+
+struct JPEG;
+// Called after every completed progressive scan, JPEGRenderPreview can be called from inside
+typedef void (*JPEGScanCallback)(struct JPEG *jpeg, uint32_t scan, void *user_data);
+
 typedef struct JPEG
 {
+    JPEGError            error; // first error hit while decoding, JPEG_OK otherwise
     uint64_t             pos;
     uint64_t             size;
     uint8_t             *buffer;
@@ -111,21 +243,90 @@ typedef struct JPEG
         uint8_t order[64];
     } zigzag;
 
+    // Region of interest, set before DecodeJPEG, zero width or height decodes the whole image
+    JPEGRect             crop;
+    JPEGOutputFormat     format;
+    JPEGOutput           output;
+    JPEGRowSink         *sink; // when set, the output is streamed through it, previews still go to jpeg->output
+
+    // Random access into the scan, see mcuindex.h
+    const struct MCUIndex *index;       // when set, decoding starts at the entry right above the crop
+    struct MCUIndex       *build_index; // when set, entries are recorded while the whole scan is walked
+
+    // Set when the tables already loaded are known to match the DHT and DQT segments, which then get skipped
+    bool                 keep_tables;
+
+    // When set, DecodeJPEG stops once the scans are entropy decoded, the quantized coefficients are left in the
+    // component blocks (for the transcoder and dchash.h) and nothing gets dequantized, transformed or output
+    bool                 coefficients_only;
+
+    // Incremental rendering of progressive images
+    JPEGScanCallback     on_scan;
+    void                *user_data;
+    uint32_t             scans_decoded;
+
+    // When set, every DecodeJPEG fills it with the wall time spent per stage
+    JPEGTimings         *timings;
+    // When set (and built in), entropy decoding statistics are added to it, see entropystats.h
+    struct JPEGEntropyStats *entropy_stats;
+
     JPEGInfo             img;
     HuffmanTable         huffman_tables;
     QuantizationTable    quantization_tables;
     HuffmanEncodedStream hstream;
 } JPEG;
 
+// Public API, every call returns the first error encountered (also kept in jpeg->error)
+JPEGError   LoadJpegFile(JPEG *image, const char *path);
+JPEGError   DecodeJPEG(JPEG *jpeg);
+void        CleanUpDecoder(JPEG *image);
+
+// Points an initialized decoder at another image in memory, which isn't copied and has to outlive the decode. Blocks,
+// the entropy buffer, the output and the tables stay allocated, so decoding a stream of same sized images doesn't
+// allocate at all once the first one is through
+JPEGError   ResetJPEGDecoder(JPEG *jpeg, uint8_t *data, uint64_t size);
+const char *JPEGErrorString(JPEGError error);
+
+// Renders the coefficients received so far into jpeg->output without consuming them, progressive images only.
+// Components still missing high frequency bands go through a reduced KxK IDCT (K = 1, 2, 4) replicated to 8x8
+JPEGError   JPEGRenderPreview(JPEG *jpeg);
+
+const char *JPEGStageName(JPEGStage stage);
+const char *JPEGCounterName(JPEGCounter counter);
+
+// Writers for jpeg->output, cropped to the region of interest. depth 32 writes BGRA bmps for color images
+bool JPEGtoBMPChromaSubsampled(JPEG *jpeg, const char *output, uint32_t depth);
+bool JPEGtoYUV(JPEG *jpeg, const char *output); // raw planes of JPEG_OUTPUT_YUV_PLANAR
+
+// Components that make it to the output, the leading ones, 1 for single component images or JPEG_OUTPUT_GRAY
+uint32_t DecodedComponents(const JPEG *jpeg);
+
+// Records the error (first one wins) and returns false so callers can bail out with `return SetJPEGError(...)`
+bool     SetJPEGError(JPEG *jpeg, JPEGError error);
+
 uint16_t GetMarkerLength(uint8_t *buffer);
 bool     HuffmanSegment(JPEG *img);
 bool     QuantizationSegment(JPEG *img);
+bool     DefaultHuffmanTables(JPEG *jpeg); // Annex K.3 tables, for frames without any DHT
+void     ClearJPEGTables(JPEG *jpeg);
+bool     InitJPEGDecoder(JPEG *jpeg);
+void     BuildZigZagOrder(uint8_t order[64]); // natural index of every zigzag position
+
+// Fills htable->huffman_code from the code lengths, false when they don't make a valid prefix code
+bool GenerateHuffmanCodes(HTable *htable);
+// Annex K.1 (id 0, luma) or K.2 (chroma) table scaled to quality 1 - 100 the way IJG does, 50 leaves it as it is
+void ScaledQuantizationTable(QTable *table, uint8_t id, uint32_t quality);
+
+// Allocation helpers that reuse whatever the previous image left behind
+bool     ReserveBlocks(JPEG *jpeg, JPEGComponent *component, uint32_t count);
+uint8_t *ReserveOutput(JPEG *jpeg, uint64_t size);
 
 // Helper
 void PrettyPrintHuffman(HTable htable);
 
 void InverseCosineTransform(JPEG* jpeg);
 bool InverseQuantization(JPEG* jpeg);
+bool FinishDecode(JPEG* jpeg);
 void InverseSignedNormalization(JPEG* jpeg);
-void YCbCrToRGB(JPEG* jpeg, uint8_t* img_data);
+void YCbCrToRGB(JPEG* jpeg, uint8_t* img_data, uint32_t pixels);
 #endif // JPEG_H_
@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./dchash.h"
+#include "./entropystats.h"
+#include "./exif.h"
+#include "./jpeg.h"
+#include "./mcuindex.h"
+#include "./mjpeg.h"
+#include "./sinks.h"
+
+#include "../../Encoder/src/jpegsink.h"
+#include "../../Encoder/src/transcode.h"
+#include "../../utility/trace.h"
+
+// --previews, writes preview_<scan>.bmp after every progressive scan
+void WritePreview(JPEG *jpeg, uint32_t scan, void *user_data)
+{
+    const uint32_t *depth = user_data;
+    char            path[64];
+    snprintf(path, sizeof(path), "preview_%u.bmp", scan);
+    if (JPEGRenderPreview(jpeg) == JPEG_OK)
+        JPEGtoBMPChromaSubsampled(jpeg, path, *depth);
+}
+
+// --mjpeg, keeps a copy of the last good frame around for writing it out
+typedef struct MJPEGSummary
+{
+    uint64_t frames;
+    uint64_t failed;
+    JPEG     last;
+} MJPEGSummary;
+
+bool CountMJPEGFrame(const JPEG *frame, uint64_t index, void *user_data)
+{
+    MJPEGSummary *summary = user_data;
+    summary->frames++;
+    if (frame->error != JPEG_OK)
+    {
+        fprintf(stderr, "Frame %lu : %s\n", index, JPEGErrorString(frame->error));
+        summary->failed++;
+        return true;
+    }
+
+    JPEGOutput *out  = &summary->last.output;
+    uint64_t    size = frame->output.capacity;
+    if (ReserveOutput(&summary->last, size))
+    {
+        uint8_t *data  = out->data;
+        uint64_t alloc = out->capacity;
+        *out           = frame->output;
+        out->data      = data;
+        out->capacity  = alloc;
+        memcpy(out->data, frame->output.data, size);
+        memset(out->planes, 0, sizeof(out->planes));
+    }
+    return true;
+}
+
+// --mjpeg, hands the last frame to the sink --out picked, an MCU row's worth of rows at a time like the decoder does
+bool WriteMJPEGFrame(const JPEGOutput *output, JPEGRowSink *sink)
+{
+    const uint64_t stride  = (uint64_t)output->width * output->channels;
+    bool           written = true;
+    if (!sink->begin(sink->context, output->width, output->height, output->channels))
+        return false;
+    for (uint32_t first = 0; first < output->height && written; first += 16)
+    {
+        uint32_t       count = output->height - first < 16 ? output->height - first : 16;
+        const uint8_t *rows  = output->data + stride * first;
+        if (sink->map_rows)
+        {
+            uint8_t *band = sink->map_rows(sink->context, first, count);
+            written       = band != NULL;
+            if (band)
+                memcpy(band, rows, stride * count);
+        }
+        else
+            written = sink->write_rows(sink->context, rows, first, count);
+    }
+    return sink->finish(sink->context) && written;
+}
+
+// --mjpeg, decodes every frame of the stream and writes the last one, --threads decodes them frame parallel
+JPEGError DecodeMJPEGFile(const char *path, const JPEG *settings, uint32_t threads, JPEGRowSink *sink)
+{
+    MJPEGStream  stream  = {0};
+    MJPEGSummary summary = {0};
+    JPEGError    err     = OpenMJPEGFile(&stream, path);
+
+    stream.decoder.jpeg.format        = settings->format;
+    stream.decoder.jpeg.crop          = settings->crop;
+    stream.decoder.jpeg.entropy_stats = threads ? NULL : settings->entropy_stats;
+    summary.last.format        = settings->format;
+    if (err == JPEG_OK && threads)
+        err = DecodeMJPEGParallel(&stream, threads, 2 * threads, CountMJPEGFrame, &summary);
+    while (err == JPEG_OK && !threads && DecodeNextMJPEGFrame(&stream))
+        CountMJPEGFrame(&stream.decoder.jpeg, stream.frames - 1, &summary);
+
+    if (err == JPEG_OK)
+    {
+        printf("%lu frames, %lu failed\n", summary.frames, summary.failed);
+        if (!summary.frames)
+            err = JPEG_ERR_INVALID_HEADER;
+        else if (summary.last.output.data && summary.last.format != JPEG_OUTPUT_YUV_PLANAR &&
+                 !WriteMJPEGFrame(&summary.last.output, sink))
+            err = JPEG_ERR_IO;
+    }
+    CleanUpDecoder(&summary.last);
+    CloseMJPEGStream(&stream);
+    return err;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Insufficient argument provided\nUSAGE : exe ./img.jpg\n");
+        return -1;
+    }
+    JPEG     image          = {0};
+    MCUIndex index          = {0};
+    char    *build_index    = NULL;
+    char    *optimized      = NULL;
+    char    *hash           = NULL;
+    char    *thumbnail_path = NULL;
+    int64_t  thumbnail_min  = -1;
+    JPEGTranscodeSettings transcode = {0};
+    uint32_t rows_per_entry = 0;
+    bool     mjpeg          = false;
+    uint32_t threads        = 0;
+    uint32_t depth          = 24;
+    OutputFile file         = {.path = "chromasubsampled.bmp"};
+    JPEGFile   jpeg_file    = {.settings = {.quality = 90, .sampling = JPEG_SAMPLING_420}};
+    JPEGEntropyStats stats  = {0};
+    const char      *stats_path = NULL;
+    for (int arg = 2; arg < argc; ++arg)
+    {
+        // --crop x,y,width,height, lossless on MCU boundaries with --optimize
+        if (!strcmp(argv[arg], "--crop") && arg + 1 < argc)
+        {
+            JPEGRect *crop = &image.crop;
+            if (sscanf(argv[++arg], "%u,%u,%u,%u", &crop->x, &crop->y, &crop->width, &crop->height) != 4)
+            {
+                fprintf(stderr, "Crop should be given as x,y,width,height\n");
+                return -1;
+            }
+        }
+        // --build-index sidecar.idx rows_per_entry
+        else if (!strcmp(argv[arg], "--build-index") && arg + 2 < argc)
+        {
+            build_index    = argv[++arg];
+            rows_per_entry = atoi(argv[++arg]);
+        }
+        // --optimize out.jpg, lossless recompression with huffman tables fitted to the image
+        else if (!strcmp(argv[arg], "--optimize") && arg + 1 < argc)
+            optimized = argv[++arg];
+        // --transform rot90|rot180|rot270|flip-h|flip-v|transpose|transverse|exif, lossless with --optimize
+        else if (!strcmp(argv[arg], "--transform") && arg + 1 < argc)
+        {
+            if (!JPEGTransformFromString(argv[++arg], &transcode.transform))
+            {
+                fprintf(stderr,
+                        "Transform should be rot90, rot180, rot270, flip-h, flip-v, transpose, transverse or exif\n");
+                return -1;
+            }
+        }
+        // --hash dct|average, prints a 64 bit perceptual hash computed from the DC coefficients
+        else if (!strcmp(argv[arg], "--hash") && arg + 1 < argc)
+            hash = argv[++arg];
+        // --thumbnail size, decodes the embedded thumbnail in place of the image when its longer side has size pixels
+        else if (!strcmp(argv[arg], "--thumbnail") && arg + 1 < argc)
+            thumbnail_min = atoi(argv[++arg]);
+        // --extract-thumbnail thumb.jpg, writes out the embedded thumbnail's bytes as they are
+        else if (!strcmp(argv[arg], "--extract-thumbnail") && arg + 1 < argc)
+            thumbnail_path = argv[++arg];
+        else if (!strcmp(argv[arg], "--gray"))
+            image.format = JPEG_OUTPUT_GRAY;
+        else if (!strcmp(argv[arg], "--yuv"))
+            image.format = JPEG_OUTPUT_YUV_PLANAR;
+        else if (!strcmp(argv[arg], "--rgb"))
+            image.format = JPEG_OUTPUT_RGB;
+        // 32 bit BGRA bmp for color output
+        else if (!strcmp(argv[arg], "--bgra"))
+            depth = 32;
+        // --out file.{bmp,ppm,pgm,raw,jpg}, --mmap converts raw and netpbm output straight into a mapping of the file
+        else if (!strcmp(argv[arg], "--out") && arg + 1 < argc)
+        {
+            file.path      = argv[++arg];
+            jpeg_file.path = IsJPEGPath(file.path) ? file.path : NULL;
+            if (!jpeg_file.path && !OutputFileFormatFromPath(file.path, &file.format))
+            {
+                fprintf(stderr, "Output should be a .bmp, .ppm, .pgm, .pnm, .raw, .rgb, .gray or .jpg file\n");
+                return -1;
+            }
+        }
+        // --quality 1-100 and --sampling 444|422|420|440 of .jpg output, --quality requantizes with --optimize
+        else if (!strcmp(argv[arg], "--quality") && arg + 1 < argc)
+            jpeg_file.settings.quality = transcode.quality = atoi(argv[++arg]);
+        else if (!strcmp(argv[arg], "--sampling") && arg + 1 < argc)
+        {
+            if (!JPEGSamplingFromString(argv[++arg], &jpeg_file.settings.sampling))
+            {
+                fprintf(stderr, "Sampling should be 444, 422, 420 or 440\n");
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[arg], "--mmap"))
+            file.mapped = true;
+        else if (!strcmp(argv[arg], "--mjpeg"))
+            mjpeg = true;
+        // --threads n, frame parallel --mjpeg, or .jpg output encoded in parallel bands
+        else if (!strcmp(argv[arg], "--threads") && arg + 1 < argc)
+            threads = atoi(argv[++arg]);
+        else if (!strcmp(argv[arg], "--previews"))
+        {
+            image.on_scan   = WritePreview;
+            image.user_data = &depth;
+        }
+        // --index sidecar.idx
+        else if (!strcmp(argv[arg], "--index") && arg + 1 < argc)
+        {
+            if (ReadMCUIndex(&index, argv[++arg]) == JPEG_OK)
+                image.index = &index;
+            else
+                fprintf(stderr, "Failed to read the MCU index %s, decoding without it\n", argv[arg]);
+        }
+        // --entropy-stats stats.json, baseline only for the per component numbers
+        else if (!strcmp(argv[arg], "--entropy-stats") && arg + 1 < argc)
+        {
+            stats_path          = argv[++arg];
+            image.entropy_stats = &stats;
+            if (!JPEG_ENTROPY_STATS)
+                fprintf(stderr, "Entropy statistics aren't compiled in, rebuild with -DJPEG_ENTROPY_STATS=1\n");
+        }
+        // --trace level, records trace points up to level (1 scans, 2 tables, 3 blocks) and dumps them to stderr
+        else if (!strcmp(argv[arg], "--trace") && arg + 1 < argc)
+        {
+            TraceLevel level = atoi(argv[++arg]);
+            if (SetTraceLevel(level) < level)
+                fprintf(stderr, "Only trace level %d is compiled in, rebuild with -DJPEG_TRACE_LEVEL=%d\n",
+                        JPEG_TRACE_LEVEL, level);
+        }
+    }
+
+    JPEGError err          = JPEG_OK;
+    bool      no_thumbnail = false; // not a decode error, just nothing for --extract-thumbnail to write
+    if (mjpeg)
+    {
+        file.depth       = depth;
+        JPEGRowSink sink = jpeg_file.path ? JPEGFileSink(&jpeg_file) : OutputFileSink(&file);
+        err              = DecodeMJPEGFile(argv[1], &image, threads, &sink);
+    }
+    else if (build_index)
+    {
+        err = LoadJpegFile(&image, argv[1]);
+        if (err == JPEG_OK)
+            err = BuildMCUIndex(&image, rows_per_entry, &index);
+        if (err == JPEG_OK)
+            err = WriteMCUIndex(&index, build_index);
+    }
+    else if (hash)
+    {
+        uint64_t value = 0;
+        err            = LoadJpegFile(&image, argv[1]);
+        if (err == JPEG_OK)
+            err = JPEGImageHash(&image, strcmp(hash, "average") ? JPEG_HASH_DCT : JPEG_HASH_AVERAGE, &value);
+        if (err == JPEG_OK)
+            printf("%016lx\n", value);
+    }
+    else if (thumbnail_path)
+    {
+        JPEGThumbnail thumbnail;
+        err = LoadJpegFile(&image, argv[1]);
+        if (err == JPEG_OK && !FindJPEGThumbnail(image.buffer, image.size, &thumbnail))
+        {
+            fprintf(stderr, "No embedded JPEG thumbnail in %s\n", argv[1]);
+            no_thumbnail = true;
+        }
+        else if (err == JPEG_OK)
+        {
+            FILE *fp = fopen(thumbnail_path, "wb");
+            if (!fp || fwrite(thumbnail.data, 1, thumbnail.size, fp) != thumbnail.size)
+                err = JPEG_ERR_IO;
+            if (fp && fclose(fp))
+                err = JPEG_ERR_IO;
+            if (err == JPEG_OK)
+                printf("%ux%u thumbnail, %lu bytes\n", thumbnail.width, thumbnail.height, thumbnail.size);
+        }
+    }
+    else if (optimized)
+    {
+        FILE *fp = fopen(optimized, "wb");
+        err      = fp ? LoadJpegFile(&image, argv[1]) : JPEG_ERR_IO;
+        transcode.crop = image.crop;
+        if (err == JPEG_OK)
+            err = TranscodeJPEG(&image, &transcode, WriteJPEGToFile, fp);
+        if (err == JPEG_OK)
+            printf("%lu bytes -> %ld bytes\n", image.size, ftell(fp));
+        if (fp && fclose(fp) && err == JPEG_OK)
+            err = JPEG_ERR_IO;
+    }
+    else
+    {
+        // Files are written while the pixels get converted, the whole image is never held in memory
+        file.depth                 = depth;
+        jpeg_file.settings.threads = threads;
+        JPEGRowSink sink = jpeg_file.path ? JPEGFileSink(&jpeg_file) : OutputFileSink(&file);
+        if (image.format != JPEG_OUTPUT_YUV_PLANAR)
+            image.sink = &sink;
+
+        // A thumbnail big enough for what was asked saves decoding the image itself
+        JPEGThumbnail thumbnail;
+        err = LoadJpegFile(&image, argv[1]);
+        if (err == JPEG_OK && thumbnail_min >= 0 && FindJPEGThumbnail(image.buffer, image.size, &thumbnail) &&
+            (thumbnail.width > thumbnail.height ? thumbnail.width : thumbnail.height) >= thumbnail_min)
+        {
+            printf("Decoding the %ux%u thumbnail\n", thumbnail.width, thumbnail.height);
+            err = DecodeJPEGThumbnail(&image, &thumbnail);
+        }
+        else if (err == JPEG_OK)
+            err = DecodeJPEG(&image);
+        if (err == JPEG_OK && image.format == JPEG_OUTPUT_YUV_PLANAR)
+        {
+            if (!JPEGtoYUV(&image, "planar.yuv"))
+                err = image.error;
+            else
+                printf("Planes : %ux%u %ux%u %ux%u\n", image.output.plane_width[0], image.output.plane_height[0],
+                       image.output.plane_width[1], image.output.plane_height[1], image.output.plane_width[2],
+                       image.output.plane_height[2]);
+        }
+    }
+    CleanUpDecoder(&image);
+    DestroyMCUIndex(&index);
+    DumpTraces(stderr);
+
+    if (stats_path && err == JPEG_OK && JPEG_ENTROPY_STATS)
+    {
+        FILE *fp      = fopen(stats_path, "w");
+        bool  written = fp && WriteEntropyStatsJSON(fp, &stats);
+        if ((fp && fclose(fp)) || !written)
+            fprintf(stderr, "Failed to write %s\n", stats_path);
+    }
+
+    if (err != JPEG_OK)
+    {
+        fprintf(stderr, "Failed to decode %s : %s\n", argv[1], JPEGErrorString(err));
+        return err == JPEG_ERR_INVALID_HEADER ? -3 : -2;
+    }
+    return no_thumbnail ? 1 : 0;
+}
@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../utility/log.h"
+#include "./mcuindex.h"
+
+// Sidecar layout, everything little endian
+// Header : "JMIX" | version u32 | rows_per_entry u32 | mcu_cols u32 | mcu_rows u32 | file_size u64 |
+//          scan_offset u64 | count u32
+// Entry  : stream_offset u64 | bit_offset u8 | restart_count u16 | dc i16 * 4
+#define MCU_INDEX_VERSION     1
+#define MCU_INDEX_HEADER_SIZE 40
+#define MCU_INDEX_ENTRY_SIZE  19
+
+static uint8_t *PutLE(uint8_t *ptr, uint64_t val, int bytes)
+{
+    for (int i = 0; i < bytes; ++i)
+        *(ptr++) = (val >> (8 * i)) & 0xFF;
+    return ptr;
+}
+
+static uint64_t GetLE(const uint8_t **ptr, int bytes)
+{
+    uint64_t val = 0;
+    for (int i = 0; i < bytes; ++i)
+        val = val | ((uint64_t)(*ptr)[i] << (8 * i));
+    *ptr = *ptr + bytes;
+    return val;
+}
+
+JPEGError BuildMCUIndex(JPEG *jpeg, uint32_t rows_per_entry, MCUIndex *index)
+{
+    memset(index, 0, sizeof(*index));
+    index->rows_per_entry = rows_per_entry ? rows_per_entry : 1;
+
+    // The scan is walked completely anyway, keep the pixel work down to a single MCU
+    jpeg->build_index = index;
+    jpeg->crop        = (JPEGRect){0, 0, 1, 1};
+    DecodeJPEG(jpeg);
+    jpeg->build_index = NULL;
+
+    if (jpeg->error == JPEG_OK && !index->count)
+        SetJPEGError(jpeg, JPEG_ERR_UNSUPPORTED);
+    return jpeg->error;
+}
+
+bool RecordMCUIndexEntry(JPEG *jpeg, uint64_t bit_position, int32_t *dc, uint32_t restart_count)
+{
+    MCUIndex *index = jpeg->build_index;
+    if (index->count == index->capacity)
+    {
+        uint32_t       capacity = index->capacity ? index->capacity * 2 : 64;
+        MCUIndexEntry *entries  = realloc(index->entries, sizeof(*entries) * capacity);
+        if (!entries)
+            return SetJPEGError(jpeg, JPEG_ERR_OUT_OF_MEMORY);
+        index->entries  = entries;
+        index->capacity = capacity;
+    }
+
+    // Offsets are into the destuffed stream for now, FinishMCUIndex moves them back to the file
+    MCUIndexEntry *entry = index->entries + index->count;
+    entry->mcu_row       = index->count * index->rows_per_entry;
+    entry->stream_offset = bit_position / 8;
+    entry->bit_offset    = bit_position % 8;
+    entry->restart_count = restart_count;
+    for (int i = 0; i < 4; ++i)
+        entry->dc[i] = dc[i];
+    index->count++;
+    return true;
+}
+
+bool FinishMCUIndex(JPEG *jpeg, uint64_t scan_offset)
+{
+    MCUIndex *index    = jpeg->build_index;
+    index->mcu_cols    = jpeg->img.mcu_cols;
+    index->mcu_rows    = jpeg->img.mcu_rows;
+    index->file_size   = jpeg->size;
+    index->scan_offset = scan_offset;
+
+    // Same rules as ExtractHuffmanEncoded, counting destuffed bytes until every entry is placed
+    uint64_t pos       = scan_offset;
+    uint64_t destuffed = 0;
+    uint32_t entry     = 0;
+    while (entry < index->count && pos < jpeg->size)
+    {
+        if (index->entries[entry].stream_offset == destuffed)
+        {
+            index->entries[entry++].stream_offset = pos - scan_offset;
+            continue;
+        }
+
+        if (jpeg->buffer[pos] != 0xFF)
+        {
+            pos++;
+            destuffed++;
+        }
+        else if (jpeg->buffer[pos + 1] == 0x00)
+        {
+            pos += 2;
+            destuffed++;
+        }
+        else if (jpeg->buffer[pos + 1] == 0xFF)
+            pos++;
+        else
+            pos += 2; // restart marker
+    }
+
+    if (entry != index->count)
+        return SetJPEGError(jpeg, JPEG_ERR_TRUNCATED);
+    return true;
+}
+
+// Picks the entry right above the decode region and moves jpeg->pos to it, NULL means decode from the scan start
+// (or, with jpeg->error set, that the entry can't be resumed from)
+const MCUIndexEntry *SeekMCUIndex(JPEG *jpeg)
+{
+    const MCUIndex *index = jpeg->index;
+
+    // A stale index is not an error, the scan just gets decoded from its start
+    if (!index->count || index->file_size != jpeg->size || index->scan_offset != jpeg->pos ||
+        index->mcu_cols != jpeg->img.mcu_cols || index->mcu_rows != jpeg->img.mcu_rows)
+    {
+        Log(Warning, "MCU index doesn't match the image, ignoring it.");
+        return NULL;
+    }
+
+    uint32_t entry = jpeg->img.region_y / index->rows_per_entry;
+    if (entry >= index->count)
+        entry = index->count - 1;
+
+    const MCUIndexEntry *resume = index->entries + entry;
+    if (index->scan_offset + resume->stream_offset >= jpeg->size)
+        return NULL;
+    // The count since the last restart marker can't run past the interval, the sidecar doesn't know it on its own
+    if (jpeg->img.use_restart_interval && resume->restart_count > jpeg->img.restart_interval)
+    {
+        Log(Error, "MCU index entry %u is %u MCUs past a restart marker.", entry, resume->restart_count);
+        SetJPEGError(jpeg, JPEG_ERR_INVALID_HEADER);
+        return NULL;
+    }
+
+    jpeg->pos = index->scan_offset + resume->stream_offset;
+    Log(Info, "Resuming the scan at MCU row %u from byte %lu.", resume->mcu_row, jpeg->pos);
+    return resume;
+}
+
+JPEGError WriteMCUIndex(const MCUIndex *index, const char *path)
+{
+    uint64_t size   = MCU_INDEX_HEADER_SIZE + (uint64_t)MCU_INDEX_ENTRY_SIZE * index->count;
+    uint8_t *buffer = malloc(size);
+    if (!buffer)
+        return JPEG_ERR_OUT_OF_MEMORY;
+
+    uint8_t *ptr = buffer;
+    memcpy(ptr, "JMIX", 4);
+    ptr    = ptr + 4;
+    ptr    = PutLE(ptr, MCU_INDEX_VERSION, 4);
+    ptr    = PutLE(ptr, index->rows_per_entry, 4);
+    ptr    = PutLE(ptr, index->mcu_cols, 4);
+    ptr    = PutLE(ptr, index->mcu_rows, 4);
+    ptr    = PutLE(ptr, index->file_size, 8);
+    ptr    = PutLE(ptr, index->scan_offset, 8);
+    ptr    = PutLE(ptr, index->count, 4);
+
+    for (uint32_t i = 0; i < index->count; ++i)
+    {
+        const MCUIndexEntry *entry = index->entries + i;
+        ptr                        = PutLE(ptr, entry->stream_offset, 8);
+        ptr                        = PutLE(ptr, entry->bit_offset, 1);
+        ptr                        = PutLE(ptr, entry->restart_count, 2);
+        for (int c = 0; c < 4; ++c)
+            ptr = PutLE(ptr, (uint16_t)entry->dc[c], 2);
+    }
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+    {
+        Log(Error, "Failed to open %s for writing.", path);
+        free(buffer);
+        return JPEG_ERR_IO;
+    }
+    size_t written = fwrite(buffer, 1, size, fp);
+    fclose(fp);
+    free(buffer);
+    return written == size ? JPEG_OK : JPEG_ERR_IO;
+}
+
+JPEGError ReadMCUIndex(MCUIndex *index, const char *path)
+{
+    memset(index, 0, sizeof(*index));
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return JPEG_ERR_IO;
+
+    uint8_t        header[MCU_INDEX_HEADER_SIZE];
+    const uint8_t *ptr = header;
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) || memcmp(header, "JMIX", 4))
+    {
+        fclose(fp);
+        return JPEG_ERR_INVALID_HEADER;
+    }
+    ptr                   = ptr + 4;
+    uint32_t version      = GetLE(&ptr, 4);
+    index->rows_per_entry = GetLE(&ptr, 4);
+    index->mcu_cols       = GetLE(&ptr, 4);
+    index->mcu_rows       = GetLE(&ptr, 4);
+    index->file_size      = GetLE(&ptr, 8);
+    index->scan_offset    = GetLE(&ptr, 8);
+    uint32_t count        = GetLE(&ptr, 4);
+
+    if (version != MCU_INDEX_VERSION || !index->rows_per_entry || count > index->mcu_rows ||
+        index->scan_offset >= index->file_size)
+    {
+        fclose(fp);
+        return JPEG_ERR_INVALID_HEADER;
+    }
+
+    uint8_t *buffer = malloc((uint64_t)MCU_INDEX_ENTRY_SIZE * count + 1);
+    index->entries  = malloc(sizeof(*index->entries) * count + 1);
+    if (!buffer || !index->entries)
+    {
+        fclose(fp);
+        free(buffer);
+        DestroyMCUIndex(index);
+        return JPEG_ERR_OUT_OF_MEMORY;
+    }
+    size_t read = fread(buffer, MCU_INDEX_ENTRY_SIZE, count, fp);
+    fclose(fp);
+    if (read != count)
+    {
+        free(buffer);
+        DestroyMCUIndex(index);
+        return JPEG_ERR_TRUNCATED;
+    }
+
+    // A corrupt or edited sidecar would resume the scan in the middle of nowhere. Positions have to lie inside the scan
+    // and grow with every entry, narrow images can fit several MCU rows into one byte though
+    ptr            = buffer;
+    bool     valid = true;
+    uint64_t last  = 0;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        MCUIndexEntry *entry = index->entries + i;
+        entry->mcu_row       = i * index->rows_per_entry;
+        entry->stream_offset = GetLE(&ptr, 8);
+        entry->bit_offset    = GetLE(&ptr, 1);
+        entry->restart_count = GetLE(&ptr, 2);
+        for (int c = 0; c < 4; ++c)
+            entry->dc[c] = (int16_t)GetLE(&ptr, 2);
+
+        uint64_t position = entry->stream_offset * 8 + entry->bit_offset;
+        if (entry->bit_offset > 7 || entry->stream_offset >= index->file_size - index->scan_offset ||
+            (i && position <= last))
+            valid = false;
+        last = position;
+    }
+    index->count    = count;
+    index->capacity = count;
+    free(buffer);
+    if (!valid)
+    {
+        Log(Error, "MCU index %s has entries outside of the scan.", path);
+        DestroyMCUIndex(index);
+        return JPEG_ERR_INVALID_HEADER;
+    }
+    return JPEG_OK;
+}
+
+void DestroyMCUIndex(MCUIndex *index)
+{
+    free(index->entries);
+    memset(index, 0, sizeof(*index));
+}
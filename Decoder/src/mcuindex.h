@@ -0,0 +1,43 @@
+#ifndef MCUINDEX_H_
+#define MCUINDEX_H_
+
+#include "./jpeg.h"
+// Random access into the entropy coded data of a baseline scan
+// Every few MCU rows the decoder state (bit position and DC predictors) is recorded, so that a later decode of a
+// crop can start right at the row above it instead of walking the whole scan again
+
+typedef struct MCUIndexEntry
+{
+    uint32_t mcu_row;       // not serialized, it follows from the entry position
+    uint64_t stream_offset; // file offset of the byte holding the next unread bit, relative to the scan start
+    uint8_t  bit_offset;    // bits of that byte already consumed
+    uint16_t restart_count; // MCUs decoded since the last restart marker
+    int16_t  dc[4];         // DC predictors of every component
+} MCUIndexEntry;
+
+typedef struct MCUIndex
+{
+    uint32_t       rows_per_entry; // entry i resumes decoding at MCU row i * rows_per_entry
+    uint32_t       mcu_cols;
+    uint32_t       mcu_rows;
+    uint64_t       file_size;   // file size and scan offset identify the image the index was built for
+    uint64_t       scan_offset;
+    uint32_t       count;
+    uint32_t       capacity;
+    MCUIndexEntry *entries;
+} MCUIndex;
+
+// Walks the whole scan of an already loaded file once and records an entry every rows_per_entry MCU rows
+JPEGError BuildMCUIndex(JPEG *jpeg, uint32_t rows_per_entry, MCUIndex *index);
+
+// Compact little endian sidecar file
+JPEGError WriteMCUIndex(const MCUIndex *index, const char *path);
+JPEGError ReadMCUIndex(MCUIndex *index, const char *path);
+void      DestroyMCUIndex(MCUIndex *index);
+
+// Used by the decoder
+bool                 RecordMCUIndexEntry(JPEG *jpeg, uint64_t bit_position, int32_t *dc, uint32_t restart_count);
+bool                 FinishMCUIndex(JPEG *jpeg, uint64_t scan_offset);
+const MCUIndexEntry *SeekMCUIndex(JPEG *jpeg);
+
+#endif // MCUINDEX_H_
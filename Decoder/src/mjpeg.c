@@ -0,0 +1,374 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../utility/log.h"
+#include "./mjpeg.h"
+
+JPEGError InitMJPEGDecoder(MJPEGDecoder *decoder)
+{
+    // Tables hold at most 6 huffman and 6 quantization tables, 4kB fits any sane frame
+    decoder->tables_capacity = 4096;
+    decoder->tables          = malloc(decoder->tables_capacity);
+    decoder->next_tables     = malloc(decoder->tables_capacity);
+
+    // The decoder gets pointed at every frame later on, the entropy buffer grows with them
+    if (!decoder->tables || !decoder->next_tables || !InitJPEGDecoder(&decoder->jpeg))
+        SetJPEGError(&decoder->jpeg, JPEG_ERR_OUT_OF_MEMORY);
+    return decoder->jpeg.error;
+}
+
+void DestroyMJPEGDecoder(MJPEGDecoder *decoder)
+{
+    // The decoder's buffer points into the stream data, which isn't its to free
+    decoder->jpeg.buffer = NULL;
+    CleanUpDecoder(&decoder->jpeg);
+    free(decoder->tables);
+    free(decoder->next_tables);
+    memset(decoder, 0, sizeof(*decoder));
+}
+
+JPEGError OpenMJPEGMemory(MJPEGStream *stream, uint8_t *data, uint64_t size)
+{
+    memset(stream, 0, sizeof(*stream));
+    stream->data = data;
+    stream->size = size;
+    return InitMJPEGDecoder(&stream->decoder);
+}
+
+JPEGError OpenMJPEGFile(MJPEGStream *stream, const char *path)
+{
+    memset(stream, 0, sizeof(*stream));
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+    {
+        Log(Error, "Failed to open file %s.", path);
+        return JPEG_ERR_IO;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    uint64_t size = ftell(fp);
+    rewind(fp);
+
+    // One spare byte for the look ahead of the destuffer, same as LoadJpegFile
+    uint8_t *data = calloc(size + 1, 1);
+    if (!data)
+    {
+        fclose(fp);
+        return JPEG_ERR_OUT_OF_MEMORY;
+    }
+    uint64_t read = fread(data, 1, size, fp);
+    fclose(fp);
+    if (read != size)
+    {
+        free(data);
+        return JPEG_ERR_IO;
+    }
+
+    JPEGError err     = OpenMJPEGMemory(stream, data, size);
+    stream->owns_data = true;
+    return err;
+}
+
+void CloseMJPEGStream(MJPEGStream *stream)
+{
+    DestroyMJPEGDecoder(&stream->decoder);
+    if (stream->owns_data)
+        free(stream->data);
+    memset(stream, 0, sizeof(*stream));
+}
+
+// Walks the markers of the frame at start, past its entropy coded data, up to and including EOI.
+// Returns the end of the frame, 0 when it is cut short
+static uint64_t FindFrameEnd(const MJPEGStream *stream, uint64_t start, bool *tables_in_scans)
+{
+    const uint8_t *data = stream->data;
+    uint64_t       pos  = start + 2;
+    bool           scan = false;
+
+    *tables_in_scans    = false;
+    while (pos + 1 < stream->size)
+    {
+        if (data[pos] != 0xFF || data[pos + 1] == 0xFF)
+        {
+            pos++; // fill bytes, or garbage between segments
+            continue;
+        }
+
+        uint8_t marker = data[pos + 1];
+        if (marker == EOI)
+            return pos + 2;
+        if (marker == SOI || pos + 4 > stream->size)
+            return 0; // next frame began before this one ended
+
+        uint64_t len = (data[pos + 2] << 8) | data[pos + 3];
+        if (len < 2 || pos + 2 + len > stream->size)
+            return 0;
+
+        *tables_in_scans = *tables_in_scans || (scan && (marker == DHT || marker == DQT));
+        pos              = pos + 2 + len;
+
+        if (marker == SOS)
+        {
+            // Entropy coded data runs until a marker other than a stuffed zero or a restart marker
+            scan = true;
+            while (pos + 1 < stream->size && (data[pos] != 0xFF || data[pos + 1] == 0x00 ||
+                                              (data[pos + 1] >= RST0 && data[pos + 1] <= RST7)))
+                pos++;
+        }
+    }
+    return 0;
+}
+
+bool NextMJPEGFrame(MJPEGStream *stream, MJPEGFrame *frame)
+{
+    // Find the next SOI, anything in between frames (multipart boundaries and such) is skipped
+    uint64_t start = stream->pos;
+    while (start + 1 < stream->size && !(stream->data[start] == 0xFF && stream->data[start + 1] == SOI))
+        start++;
+    if (start + 1 >= stream->size)
+    {
+        stream->pos = stream->size;
+        return false;
+    }
+
+    uint64_t end    = FindFrameEnd(stream, start, &frame->tables_in_scans);
+    frame->index    = stream->frames++;
+    frame->data     = stream->data + start;
+    frame->complete = end != 0;
+    frame->size     = end ? end - start : 2;
+
+    // A frame cut short is skipped past its SOI, so that the search resumes at whatever comes next
+    stream->pos     = start + frame->size;
+    return true;
+}
+
+// DHT and DQT segments in front of the first scan, has_dht tells whether there was any huffman table
+static bool CollectTables(MJPEGDecoder *decoder, const MJPEGFrame *frame, bool *has_dht)
+{
+    uint64_t pos              = 2;
+    decoder->next_tables_size = 0;
+    *has_dht                  = false;
+
+    while (pos + 4 <= frame->size && frame->data[pos] == 0xFF && frame->data[pos + 1] != SOS)
+    {
+        uint8_t  marker = frame->data[pos + 1];
+        uint64_t len    = (frame->data[pos + 2] << 8) | frame->data[pos + 3];
+        if (marker == 0xFF)
+        {
+            pos++;
+            continue;
+        }
+        if (marker == DHT || marker == DQT)
+        {
+            *has_dht = *has_dht || marker == DHT;
+            if (decoder->next_tables_size + len + 1 > decoder->tables_capacity)
+                return false;
+            memcpy(decoder->next_tables + decoder->next_tables_size, frame->data + pos + 1, len + 1);
+            decoder->next_tables_size += len + 1;
+        }
+        pos = pos + 2 + len;
+    }
+    return true;
+}
+
+JPEGError DecodeMJPEGFrame(MJPEGDecoder *decoder, const MJPEGFrame *frame)
+{
+    JPEG *jpeg = &decoder->jpeg;
+    if (ResetJPEGDecoder(jpeg, frame->data, frame->complete ? frame->size : 0) != JPEG_OK)
+        return jpeg->error;
+    if (!frame->complete)
+    {
+        Log(Warning, "Frame %lu has no end of image.", frame->index);
+        SetJPEGError(jpeg, JPEG_ERR_TRUNCATED);
+        return jpeg->error;
+    }
+
+    // Byte identical DHT/DQT segments mean the loaded tables can be used as they are
+    bool has_dht   = false;
+    bool cacheable = CollectTables(decoder, frame, &has_dht) && !frame->tables_in_scans;
+    jpeg->keep_tables = cacheable && decoder->tables_valid && decoder->next_tables_size == decoder->tables_size &&
+                        !memcmp(decoder->next_tables, decoder->tables, decoder->tables_size);
+    if (jpeg->keep_tables)
+        decoder->tables_kept++;
+    else
+    {
+        ClearJPEGTables(jpeg);
+        decoder->tables_valid = false;
+        if (!has_dht && !DefaultHuffmanTables(jpeg))
+            return jpeg->error;
+    }
+
+    DecodeJPEG(jpeg);
+
+    // Remember what the tables came from, unless they might be half loaded
+    if (!jpeg->keep_tables)
+    {
+        uint8_t *tables       = decoder->tables;
+        decoder->tables       = decoder->next_tables;
+        decoder->next_tables  = tables;
+        decoder->tables_size  = decoder->next_tables_size;
+        decoder->tables_valid = cacheable && jpeg->error == JPEG_OK;
+    }
+    else if (jpeg->error != JPEG_OK)
+        decoder->tables_valid = false;
+    return jpeg->error;
+}
+
+bool DecodeNextMJPEGFrame(MJPEGStream *stream)
+{
+    MJPEGFrame frame;
+    if (!NextMJPEGFrame(stream, &frame))
+        return false;
+    DecodeMJPEGFrame(&stream->decoder, &frame);
+    return true;
+}
+
+// Parallel decoding
+// Frame i always goes to slot i % depth, slots cycle through empty -> pending -> decoding -> done -> empty
+
+typedef enum SlotState
+{
+    SLOT_EMPTY,
+    SLOT_PENDING,
+    SLOT_DECODING,
+    SLOT_DONE
+} SlotState;
+
+typedef struct FrameSlot
+{
+    SlotState    state;
+    MJPEGFrame   frame;
+    MJPEGDecoder decoder;
+} FrameSlot;
+
+typedef struct FrameQueue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;
+    FrameSlot      *slots;
+    uint32_t        depth;
+    uint64_t        next_pending; // oldest frame no worker picked up yet
+    uint64_t        queued;       // frames put into slots so far
+    bool            quit;
+} FrameQueue;
+
+static void *FrameWorker(void *arg)
+{
+    FrameQueue *queue = arg;
+    pthread_mutex_lock(&queue->lock);
+    while (true)
+    {
+        // Frames get picked up in order, so the oldest pending one is always next_pending
+        while (!queue->quit && queue->next_pending == queue->queued)
+            pthread_cond_wait(&queue->changed, &queue->lock);
+        if (queue->quit)
+            break;
+
+        FrameSlot *slot = &queue->slots[queue->next_pending++ % queue->depth];
+        slot->state     = SLOT_DECODING;
+        pthread_mutex_unlock(&queue->lock);
+
+        DecodeMJPEGFrame(&slot->decoder, &slot->frame);
+
+        pthread_mutex_lock(&queue->lock);
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&queue->changed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+JPEGError DecodeMJPEGParallel(MJPEGStream *stream, uint32_t threads, uint32_t depth, MJPEGFrameCallback on_frame,
+                              void *user_data)
+{
+    threads = threads ? threads : 1;
+    depth   = depth < threads ? threads : depth;
+
+    FrameQueue queue = {0};
+    queue.depth      = depth;
+    queue.slots      = calloc(depth, sizeof(*queue.slots));
+    pthread_t *tids  = calloc(threads, sizeof(*tids));
+    JPEGError  err   = queue.slots && tids ? JPEG_OK : JPEG_ERR_OUT_OF_MEMORY;
+
+    for (uint32_t i = 0; i < depth && err == JPEG_OK; ++i)
+    {
+        JPEG *jpeg   = &queue.slots[i].decoder.jpeg;
+        err          = InitMJPEGDecoder(&queue.slots[i].decoder);
+        jpeg->format = stream->decoder.jpeg.format;
+        jpeg->crop   = stream->decoder.jpeg.crop;
+    }
+    if (err != JPEG_OK)
+    {
+        for (uint32_t i = 0; queue.slots && i < depth; ++i)
+            DestroyMJPEGDecoder(&queue.slots[i].decoder);
+        free(queue.slots);
+        free(tids);
+        return err;
+    }
+
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.changed, NULL);
+    uint32_t started = 0;
+    for (; started < threads; ++started)
+        if (pthread_create(&tids[started], NULL, FrameWorker, &queue))
+            break;
+    if (!started)
+        err = JPEG_ERR_OUT_OF_MEMORY;
+
+    // This thread feeds the slots and hands the finished frames out in order
+    uint64_t   delivered = 0;
+    bool       more      = started > 0;
+    bool       stop      = false;
+    MJPEGFrame frame;
+
+    pthread_mutex_lock(&queue.lock);
+    while (!stop && (more || delivered < queue.queued))
+    {
+        // Fill the slot of the next frame as soon as its previous frame went out
+        if (more && queue.queued - delivered < depth)
+        {
+            pthread_mutex_unlock(&queue.lock);
+            more = NextMJPEGFrame(stream, &frame);
+            pthread_mutex_lock(&queue.lock);
+            if (more)
+            {
+                FrameSlot *slot = &queue.slots[queue.queued++ % depth];
+                slot->frame     = frame;
+                slot->state     = SLOT_PENDING;
+                pthread_cond_broadcast(&queue.changed);
+            }
+            continue;
+        }
+
+        FrameSlot *slot = &queue.slots[delivered % depth];
+        if (slot->state != SLOT_DONE)
+        {
+            pthread_cond_wait(&queue.changed, &queue.lock);
+            continue;
+        }
+
+        // Nobody else touches a done slot, the consumer gets it without the lock held
+        pthread_mutex_unlock(&queue.lock);
+        stop = on_frame && !on_frame(&slot->decoder.jpeg, slot->frame.index, user_data);
+        pthread_mutex_lock(&queue.lock);
+        slot->state = SLOT_EMPTY;
+        delivered++;
+    }
+
+    // Workers still decoding frames nobody will see finish them before quitting
+    queue.quit = true;
+    pthread_cond_broadcast(&queue.changed);
+    pthread_mutex_unlock(&queue.lock);
+    for (uint32_t i = 0; i < started; ++i)
+        pthread_join(tids[i], NULL);
+
+    for (uint32_t i = 0; i < depth; ++i)
+        DestroyMJPEGDecoder(&queue.slots[i].decoder);
+    pthread_mutex_destroy(&queue.lock);
+    pthread_cond_destroy(&queue.changed);
+    free(queue.slots);
+    free(tids);
+    return err;
+}
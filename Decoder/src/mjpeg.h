@@ -0,0 +1,67 @@
+#ifndef MJPEG_H_
+#define MJPEG_H_
+
+#include "./jpeg.h"
+// Motion JPEG, a plain concatenation of JPEG frames as sent by most IP cameras
+// A decoder is reused from frame to frame, its blocks, entropy buffer and output stay allocated. Tables are only parsed
+// again when a frame's DHT and DQT segments differ from the ones its loaded tables came from, and frames without any
+// DHT get the standard tables of Annex K.3
+
+// A decoder along with the table segments (marker byte included) its loaded tables were parsed from
+typedef struct MJPEGDecoder
+{
+    JPEG     jpeg;
+    uint8_t *tables;
+    uint8_t *next_tables; // segments of the frame being decoded
+    uint64_t tables_size;
+    uint64_t next_tables_size;
+    uint64_t tables_capacity;
+    bool     tables_valid;
+    uint64_t tables_kept; // frames that reused the loaded tables
+} MJPEGDecoder;
+
+// One frame inside the stream data
+typedef struct MJPEGFrame
+{
+    uint64_t index;
+    uint8_t *data;
+    uint64_t size;
+    bool     complete;        // ends with EOI
+    bool     tables_in_scans; // DHT/DQT between scans, these never reuse tables
+} MJPEGFrame;
+
+typedef struct MJPEGStream
+{
+    MJPEGDecoder decoder; // set decoder.jpeg format or crop once, the last frame's pixels end up in its output
+    uint8_t     *data;
+    uint64_t     size;
+    uint64_t     pos; // where the search for the next frame starts
+    bool         owns_data;
+    uint64_t     frames; // frames handed out so far, failed ones included
+} MJPEGStream;
+
+// The file is read completely, memory streams are used in place and have to outlive the stream
+JPEGError OpenMJPEGFile(MJPEGStream *stream, const char *path);
+JPEGError OpenMJPEGMemory(MJPEGStream *stream, uint8_t *data, uint64_t size);
+
+// Decodes the next frame into stream->decoder.jpeg.output, false once no frame is left. A frame that fails still
+// returns true with its error in stream->decoder.jpeg.error, the next call just moves on to the following frame
+bool      DecodeNextMJPEGFrame(MJPEGStream *stream);
+void      CloseMJPEGStream(MJPEGStream *stream);
+
+// Frame parallel decoding of the rest of the stream
+// Frames are decoded by `threads` workers into a reorder queue of `depth` slots (at least threads), each with its own
+// decoder, and handed to on_frame strictly in stream order on the calling thread. A slot only takes a new frame once
+// its previous one went through on_frame, so a slow consumer holds the workers back instead of piling frames up.
+// on_frame returning false stops the decode. format and crop are taken from stream->decoder.jpeg
+typedef bool (*MJPEGFrameCallback)(const JPEG *frame, uint64_t index, void *user_data);
+JPEGError DecodeMJPEGParallel(MJPEGStream *stream, uint32_t threads, uint32_t depth, MJPEGFrameCallback on_frame,
+                              void *user_data);
+
+// Building blocks of both, exposed for callers with their own threading
+bool      NextMJPEGFrame(MJPEGStream *stream, MJPEGFrame *frame);
+JPEGError InitMJPEGDecoder(MJPEGDecoder *decoder);
+JPEGError DecodeMJPEGFrame(MJPEGDecoder *decoder, const MJPEGFrame *frame);
+void      DestroyMJPEGDecoder(MJPEGDecoder *decoder);
+
+#endif // MJPEG_H_
@@ -0,0 +1,86 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "./perfcounters.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+static int OpenCounter(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr = {0};
+    attr.size                   = sizeof(attr);
+    attr.type                   = type;
+    attr.config                 = config;
+    attr.exclude_kernel         = 1; // also what perf_event_paranoid 2 still allows
+    attr.exclude_hv             = 1;
+    attr.read_format            = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+bool OpenPerfCounters(PerfCounters *counters)
+{
+    static const uint32_t types[JPEG_COUNTER_COUNT] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+        PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_SOFTWARE};
+    static const uint64_t configs[JPEG_COUNTER_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_SW_PAGE_FAULTS};
+
+    bool opened = false;
+    for (int i = 0; i < JPEG_COUNTER_COUNT; ++i)
+    {
+        counters->fds[i] = OpenCounter(types[i], configs[i]);
+        opened           = opened || counters->fds[i] >= 0;
+    }
+    return opened;
+}
+
+void ReadPerfCounters(const PerfCounters *counters, uint64_t values[JPEG_COUNTER_COUNT])
+{
+    for (int i = 0; i < JPEG_COUNTER_COUNT; ++i)
+    {
+        // value, time enabled, time running
+        uint64_t read_values[3] = {0};
+        values[i]               = 0;
+        if (counters->fds[i] < 0 || read(counters->fds[i], read_values, sizeof(read_values)) != sizeof(read_values))
+            continue;
+        values[i] = read_values[2] && read_values[2] < read_values[1]
+                        ? (uint64_t)((double)read_values[0] * read_values[1] / read_values[2])
+                        : read_values[0];
+    }
+}
+#else
+bool OpenPerfCounters(PerfCounters *counters)
+{
+    for (int i = 0; i < JPEG_COUNTER_COUNT; ++i)
+        counters->fds[i] = -1;
+    return false;
+}
+
+void ReadPerfCounters(const PerfCounters *counters, uint64_t values[JPEG_COUNTER_COUNT])
+{
+    (void)counters;
+    memset(values, 0, sizeof(uint64_t) * JPEG_COUNTER_COUNT);
+}
+#endif
+
+bool PerfCounterAvailable(const PerfCounters *counters, JPEGCounter counter)
+{
+    return counter < JPEG_COUNTER_COUNT && counters->fds[counter] >= 0;
+}
+
+void ClosePerfCounters(PerfCounters *counters)
+{
+    for (int i = 0; i < JPEG_COUNTER_COUNT; ++i)
+    {
+        if (counters->fds[i] >= 0)
+            close(counters->fds[i]);
+        counters->fds[i] = -1;
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef PERFCOUNTERS_H_
+#define PERFCOUNTERS_H_
+
+#include "./jpeg.h"
+// Linux perf_event_open counters behind jpeg->timings->counters. They count the opening thread in user space only, so
+// the decode has to run on that thread. Counters the kernel or the CPU doesn't offer (no PMU inside most VMs,
+// perf_event_paranoid above 2, other systems than Linux) are left out and read as 0
+
+typedef struct PerfCounters
+{
+    int fds[JPEG_COUNTER_COUNT]; // -1 when not available
+} PerfCounters;
+
+// True when at least one counter could be opened, they count from then on
+bool OpenPerfCounters(PerfCounters *counters);
+bool PerfCounterAvailable(const PerfCounters *counters, JPEGCounter counter);
+// Current value of every counter, scaled up when the kernel had to multiplex them
+void ReadPerfCounters(const PerfCounters *counters, uint64_t values[JPEG_COUNTER_COUNT]);
+void ClosePerfCounters(PerfCounters *counters);
+
+#endif // PERFCOUNTERS_H_
@@ -0,0 +1,145 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "../../utility/log.h"
+#include "./sinks.h"
+
+// write() may stop short on large buffers, keep going until everything is out
+static bool WriteAll(int fd, const uint8_t *data, uint64_t size)
+{
+    while (size)
+    {
+        ssize_t written = write(fd, data, size);
+        if (written <= 0)
+            return false;
+        data = data + written;
+        size = size - written;
+    }
+    return true;
+}
+
+static bool BMPSinkBegin(void *context, uint32_t width, uint32_t height, uint32_t channels)
+{
+    OutputFile *file = context;
+    return OpenBMPStream(&file->bmp, file->path, width, height, channels, file->depth, true);
+}
+
+static bool BMPSinkRows(void *context, const uint8_t *rows, uint32_t first_row, uint32_t count)
+{
+    OutputFile *file = context;
+    return WriteBMPRows(&file->bmp, rows, first_row, count);
+}
+
+static bool BMPSinkFinish(void *context)
+{
+    OutputFile *file = context;
+    return CloseBMPStream(&file->bmp);
+}
+
+// RAW and PNM files are the decoded rows as they are, behind a netpbm header for PNM
+static bool PixelSinkBegin(void *context, uint32_t width, uint32_t height, uint32_t channels)
+{
+    OutputFile *file = context;
+    char        header[64];
+
+    file->data_offset = 0;
+    if (file->format == OUTPUT_FILE_PNM)
+        file->data_offset = snprintf(header, sizeof(header), "P%c\n%u %u\n255\n", channels == 1 ? '5' : '6', width,
+                                     height);
+    file->stride = (uint64_t)width * channels;
+    file->size   = file->data_offset + file->stride * height;
+    file->map    = NULL;
+
+    file->fd     = open(file->path, (file->mapped ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC, 0644);
+    if (file->fd < 0)
+    {
+        Log(Error, "Failed to open %s for writing.", file->path);
+        return false;
+    }
+
+    if (!file->mapped)
+    {
+        if (WriteAll(file->fd, (uint8_t *)header, file->data_offset))
+            return true;
+    }
+    else if (!ftruncate(file->fd, file->size))
+    {
+        // Rows are converted right into the page cache, the kernel writes them back on its own
+        file->map = mmap(NULL, file->size, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+        if (file->map != MAP_FAILED)
+        {
+            memcpy(file->map, header, file->data_offset);
+            return true;
+        }
+        file->map = NULL;
+    }
+
+    Log(Error, "Failed to set up %s for writing.", file->path);
+    close(file->fd);
+    file->fd = -1;
+    return false;
+}
+
+static bool PixelSinkRows(void *context, const uint8_t *rows, uint32_t first_row, uint32_t count)
+{
+    // Bands come top to bottom one after the other, which is the file order already
+    OutputFile *file = context;
+    (void)first_row;
+    return WriteAll(file->fd, rows, file->stride * count);
+}
+
+static uint8_t *MappedSinkRows(void *context, uint32_t first_row, uint32_t count)
+{
+    OutputFile *file = context;
+    (void)count;
+    return file->map + file->data_offset + file->stride * first_row;
+}
+
+static bool PixelSinkFinish(void *context)
+{
+    OutputFile *file   = context;
+    bool        closed = !file->map || !munmap(file->map, file->size);
+    closed             = !close(file->fd) && closed;
+    file->map          = NULL;
+    file->fd           = -1;
+    return closed;
+}
+
+JPEGRowSink OutputFileSink(OutputFile *file)
+{
+    if (file->format == OUTPUT_FILE_BMP)
+        return (JPEGRowSink){
+            .context = file, .begin = BMPSinkBegin, .write_rows = BMPSinkRows, .finish = BMPSinkFinish};
+    if (file->mapped)
+        return (JPEGRowSink){
+            .context = file, .begin = PixelSinkBegin, .finish = PixelSinkFinish, .map_rows = MappedSinkRows};
+    return (JPEGRowSink){
+        .context = file, .begin = PixelSinkBegin, .write_rows = PixelSinkRows, .finish = PixelSinkFinish};
+}
+
+bool OutputFileFormatFromPath(const char *path, OutputFileFormat *format)
+{
+    const char *ext = strrchr(path, '.');
+    if (!ext)
+        return false;
+
+    if (!strcasecmp(ext, ".bmp"))
+        *format = OUTPUT_FILE_BMP;
+    else if (!strcasecmp(ext, ".ppm") || !strcasecmp(ext, ".pgm") || !strcasecmp(ext, ".pnm"))
+        *format = OUTPUT_FILE_PNM;
+    else if (!strcasecmp(ext, ".raw") || !strcasecmp(ext, ".rgb") || !strcasecmp(ext, ".gray"))
+        *format = OUTPUT_FILE_RAW;
+    else
+        return false;
+    return true;
+}
+
+bool IsJPEGPath(const char *path)
+{
+    const char *ext = strrchr(path, '.');
+    return ext && (!strcasecmp(ext, ".jpg") || !strcasecmp(ext, ".jpeg"));
+}
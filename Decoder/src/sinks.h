@@ -0,0 +1,41 @@
+#ifndef SINKS_H_
+#define SINKS_H_
+
+#include "./jpeg.h"
+#include "../../utility/bmp.h"
+// File writers behind JPEGRowSink. None of them ever holds more than one MCU row of pixels, the mapped ones not even
+// that, the decoder converts straight into the file mapping
+
+typedef enum OutputFileFormat
+{
+    OUTPUT_FILE_BMP = 0, // 8 bit gray, 24 bit BGR or 32 bit BGRA
+    OUTPUT_FILE_RAW,     // interleaved pixels exactly as decoded, no header
+    OUTPUT_FILE_PNM      // binary PGM (P5) for gray, PPM (P6) for color
+} OutputFileFormat;
+
+typedef struct OutputFile
+{
+    const char      *path;
+    OutputFileFormat format;
+    uint32_t         depth;  // BMP only, 32 writes BGRA
+    bool             mapped; // RAW and PNM only, the file is sized up front and pixels get converted into an mmap of it
+
+    // Set up by begin
+    int       fd;
+    BMPStream bmp;
+    uint8_t  *map;
+    uint64_t  size;        // of the whole file
+    uint64_t  data_offset; // header bytes before the first row
+    uint64_t  stride;
+} OutputFile;
+
+// Sink writing to file->path, the file has to outlive the decode
+JPEGRowSink OutputFileSink(OutputFile *file);
+
+// .bmp, .ppm / .pgm / .pnm or .raw / .rgb / .gray, false for anything else
+bool OutputFileFormatFromPath(const char *path, OutputFileFormat *format);
+
+// .jpg or .jpeg
+bool IsJPEGPath(const char *path);
+
+#endif // SINKS_H_
@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "./bitwriter.h"
+
+bool ReserveBytes(JPEGBitWriter *writer, uint64_t count)
+{
+    if (writer->size + count <= writer->capacity)
+        return true;
+
+    uint64_t capacity = writer->capacity * 2 > writer->size + count ? writer->capacity * 2 : writer->size + count;
+    uint8_t *data     = realloc(writer->data, capacity);
+    if (!data)
+        return !(writer->failed = true);
+    writer->data     = data;
+    writer->capacity = capacity;
+    return true;
+}
+
+void FlushBits(JPEGBitWriter *writer)
+{
+    if (writer->count & 7)
+        PutBits(writer, (1u << (8 - (writer->count & 7))) - 1, 8 - (writer->count & 7));
+    while (writer->count)
+    {
+        uint8_t byte  = writer->bits >> (writer->count - 8);
+        writer->count = writer->count - 8;
+        PutByte(writer, byte);
+        if (byte == 0xFF)
+            PutByte(writer, 0x00);
+    }
+}
+
+void EncodeBlock(JPEGBitWriter *writer, const int16_t *ordered, uint64_t nonzero, const HuffmanLookup *dc,
+                 const HuffmanLookup *ac, int32_t *predictor)
+{
+    EncodeValue(writer, dc, 0, ordered[0] - *predictor);
+    *predictor = ordered[0];
+
+    int last   = 0;
+    for (nonzero = nonzero & ~1ull; nonzero; nonzero = nonzero & (nonzero - 1))
+    {
+        int k   = __builtin_ctzll(nonzero);
+        int run = k - last - 1;
+        for (; run > 15; run -= 16)
+            PutBits(writer, ac->code[0xF0], ac->size[0xF0]);
+        EncodeValue(writer, ac, run, ordered[k]);
+        last = k;
+    }
+    if (last != 63)
+        PutBits(writer, ac->code[0x00], ac->size[0x00]);
+}
+
+void BuildHuffmanLookup(const HTable *table, HuffmanLookup *lookup)
+{
+    memset(lookup, 0, sizeof(*lookup));
+    int index = 0;
+    for (int length = 1; length <= 16; ++length)
+    {
+        for (int i = 0; i < table->code_length[length - 1] && index < table->total_codes; ++i, ++index)
+        {
+            lookup->code[table->huffman_val[index]] = table->huffman_code[index];
+            lookup->size[table->huffman_val[index]] = length;
+        }
+    }
+}
+
+void WriteHuffmanTable(JPEGBitWriter *writer, const HTable *table)
+{
+    PutByte(writer, (table->type == AC ? 0x10 : 0x00) | table->id);
+    for (int i = 0; i < 16; ++i)
+        PutByte(writer, table->code_length[i]);
+    for (int i = 0; i < table->total_codes; ++i)
+        PutByte(writer, table->huffman_val[i]);
+}
+
+void OptimalHuffmanTable(const uint32_t frequencies[256], HTable *table)
+{
+    // Figure K.1: the two least frequent entries get merged until one is left, every symbol in a merged chain
+    // growing one bit longer. Entry 256 is a reserved symbol seen once, it takes the all ones code so that no real
+    // code is all ones
+    uint64_t freq[257];
+    uint32_t code_size[257] = {0};
+    int      others[257];
+    for (int i = 0; i < 256; ++i)
+        freq[i] = frequencies[i];
+    freq[256] = 1;
+    for (int i = 0; i < 257; ++i)
+        others[i] = -1;
+
+    while (true)
+    {
+        // Ties go to the higher symbol, like IJG, so the output matches its tables
+        int c1 = -1, c2 = -1;
+        for (int i = 0; i < 257; ++i)
+            if (freq[i] && (c1 < 0 || freq[i] <= freq[c1]))
+                c1 = i;
+        for (int i = 0; i < 257; ++i)
+            if (freq[i] && i != c1 && (c2 < 0 || freq[i] <= freq[c2]))
+                c2 = i;
+        if (c2 < 0)
+            break;
+
+        freq[c1] = freq[c1] + freq[c2];
+        freq[c2] = 0;
+        for (code_size[c1]++; others[c1] >= 0; code_size[c1]++)
+            c1 = others[c1];
+        others[c1] = c2;
+        for (code_size[c2]++; others[c2] >= 0; code_size[c2]++)
+            c2 = others[c2];
+    }
+
+    // Figure K.2 counts the codes per length, K.3 then moves codes past 16 bits up: two of the longest become one
+    // code a bit shorter and one shorter code splits into two a bit longer
+    uint32_t bits[258] = {0};
+    for (int i = 0; i < 257; ++i)
+        bits[code_size[i]]++;
+    bits[0] = 0;
+    for (int i = 257; i > 16; --i)
+    {
+        while (bits[i] > 0)
+        {
+            int j = i - 2;
+            while (bits[j] == 0)
+                j--;
+            bits[i]     = bits[i] - 2;
+            bits[i - 1] = bits[i - 1] + 1;
+            bits[j + 1] = bits[j + 1] + 2;
+            bits[j]     = bits[j] - 1;
+        }
+    }
+    // Drops the reserved symbol, the longest code there is
+    for (int i = 16; i > 0; --i)
+    {
+        if (bits[i])
+        {
+            bits[i]--;
+            break;
+        }
+    }
+
+    // Figure K.4, symbols sorted by code size. The sizes past 16 got shortened in the same order
+    table->total_codes = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        table->code_length[i] = bits[i + 1];
+        table->total_codes    = table->total_codes + bits[i + 1];
+    }
+    int index = 0;
+    for (uint32_t size = 1; size <= 257; ++size)
+        for (int symbol = 0; symbol < 256; ++symbol)
+            if (code_size[symbol] == size)
+                table->huffman_val[index++] = symbol;
+}
@@ -0,0 +1,119 @@
+#ifndef BITWRITER_H_
+#define BITWRITER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../../Decoder/src/jpeg.h"
+// Entropy coded output shared by the encoder and the transcoder: marker segments, huffman coded blocks with their
+// stuffing, and the tables behind them. The per bit helpers are inline here, they run for every coefficient
+
+// Worst case of one block: DC with 11 bits, 63 AC codes of 16 + 10 bits, every byte of it stuffed
+#define MAX_BLOCK_BYTES 512
+// Restart marker and the bits padded in front of it
+#define MAX_MARKER_BYTES 8
+// Handed to the write callback once this much piled up
+#define FLUSH_BYTES (1 << 16)
+
+// Entropy coded bytes, stuffing included. Bits collect in a 64 bit word and go out 32 at a time, straight when none of
+// the 4 bytes is 0xFF, byte by byte with the stuffed zeros otherwise
+typedef struct JPEGBitWriter
+{
+    uint8_t *data;
+    uint64_t size;
+    uint64_t capacity;
+    uint64_t bits;  // pending bits in the low `count` bits
+    uint32_t count;
+    bool     failed; // out of memory
+} JPEGBitWriter;
+
+// Encoder side of a huffman table, indexed by symbol
+typedef struct HuffmanLookup
+{
+    uint16_t code[256];
+    uint8_t  size[256]; // 0 for symbols without a code
+} HuffmanLookup;
+
+// Grows the buffer so count more bytes fit, false (and writer->failed) when out of memory
+bool ReserveBytes(JPEGBitWriter *writer, uint64_t count);
+
+// Marker segments, no stuffing, room has to be reserved already
+static inline void PutByte(JPEGBitWriter *writer, uint8_t byte)
+{
+    writer->data[writer->size++] = byte;
+}
+
+static inline void PutWord(JPEGBitWriter *writer, uint16_t word)
+{
+    PutByte(writer, word >> 8);
+    PutByte(writer, word & 0xFF);
+}
+
+static inline void PutMarker(JPEGBitWriter *writer, uint8_t marker)
+{
+    PutByte(writer, 0xFF);
+    PutByte(writer, marker);
+}
+
+static inline void PutWordStuffed(JPEGBitWriter *writer, uint32_t word)
+{
+    uint8_t *out = writer->data + writer->size;
+    // Zero byte test on the complement, nonzero when one of the 4 bytes is 0xFF
+    if (!((~word - 0x01010101u) & word & 0x80808080u))
+    {
+        out[0]       = word >> 24;
+        out[1]       = word >> 16;
+        out[2]       = word >> 8;
+        out[3]       = word;
+        writer->size = writer->size + 4;
+        return;
+    }
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        uint8_t byte                 = word >> shift;
+        writer->data[writer->size++] = byte;
+        if (byte == 0xFF)
+            writer->data[writer->size++] = 0x00;
+    }
+}
+
+// count up to 27 bits of value, already masked
+static inline void PutBits(JPEGBitWriter *writer, uint32_t value, uint32_t count)
+{
+    writer->bits  = (writer->bits << count) | value;
+    writer->count = writer->count + count;
+    if (writer->count >= 32)
+    {
+        writer->count = writer->count - 32;
+        PutWordStuffed(writer, writer->bits >> writer->count);
+    }
+}
+
+// Huffman code of (run, size of value) followed by the value bits, ones' complement for negative values
+static inline void EncodeValue(JPEGBitWriter *writer, const HuffmanLookup *codes, uint32_t run, int32_t value)
+{
+    uint32_t magnitude = value < 0 ? -value : value;
+    uint32_t size      = magnitude ? 32 - __builtin_clz(magnitude) : 0;
+    uint32_t symbol    = run << 4 | size;
+    uint32_t bits      = (uint32_t)(value < 0 ? value - 1 : value) & ((1u << size) - 1);
+    PutBits(writer, (uint32_t)codes->code[symbol] << size | bits, codes->size[symbol] + size);
+}
+
+// Pads the last byte with ones and writes out whatever is pending, before restart markers and EOI
+void FlushBits(JPEGBitWriter *writer);
+
+// Quantized coefficients in zigzag order, only the nonzero ones get visited, through their mask (bit k for zigzag
+// position k). MAX_BLOCK_BYTES have to be reserved
+void EncodeBlock(JPEGBitWriter *writer, const int16_t *ordered, uint64_t nonzero, const HuffmanLookup *dc,
+                 const HuffmanLookup *ac, int32_t *predictor);
+
+// Code and size of every symbol of a table with its huffman_code filled, see GenerateHuffmanCodes
+void BuildHuffmanLookup(const HTable *table, HuffmanLookup *lookup);
+// One table of a DHT segment, 17 + total_codes bytes
+void WriteHuffmanTable(JPEGBitWriter *writer, const HTable *table);
+
+// Optimal code lengths of at most 16 bits for the symbol counts in frequencies (Annex K.2), into the code lengths and
+// symbols of table, whose huffman_val has to hold 256 symbols. Symbols that never occur get no code
+void OptimalHuffmanTable(const uint32_t frequencies[256], HTable *table);
+
+#endif // BITWRITER_H_
@@ -0,0 +1,724 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./encoder.h"
+
+// MCU rows per band when encoding on several threads
+#define BAND_MCU_ROWS 4
+
+static bool SetEncoderError(JPEGEncoder *encoder, JPEGError error)
+{
+    if (encoder->error == JPEG_OK)
+        encoder->error = error;
+    return false;
+}
+
+// The decoder's Annex K.3 tables, parsed into a scratch decoder that has nothing but its table array set up. The
+// encoder takes over the symbol and code arrays
+static bool LoadHuffmanTables(JPEGEncoder *encoder)
+{
+    HTable tables[6];
+    JPEG   scratch                = {0};
+    scratch.huffman_tables.tables = tables;
+    bool loaded                   = DefaultHuffmanTables(&scratch);
+
+    for (int i = 0; i < scratch.huffman_tables.count; ++i)
+    {
+        HTable *slot = tables[i].type == AC ? encoder->ac_tables : encoder->dc_tables;
+        slot[tables[i].id & 1] = tables[i];
+    }
+    for (int t = 0; t < 2 && loaded; ++t)
+    {
+        loaded = GenerateHuffmanCodes(encoder->dc_tables + t) && GenerateHuffmanCodes(encoder->ac_tables + t);
+        BuildHuffmanLookup(encoder->dc_tables + t, encoder->dc_codes + t);
+        BuildHuffmanLookup(encoder->ac_tables + t, encoder->ac_codes + t);
+    }
+    return loaded;
+}
+
+static bool WriteHeaders(JPEGEncoder *encoder, JPEGBitWriter *writer)
+{
+    static const uint8_t jfif[] = {'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0};
+    const uint32_t       tables = encoder->channels == 1 ? 1 : 2;
+
+    uint32_t dht_length = 2;
+    for (uint32_t t = 0; t < tables; ++t)
+        dht_length = dht_length + 34 + encoder->dc_tables[t].total_codes + encoder->ac_tables[t].total_codes;
+    if (!ReserveBytes(writer, 256 + dht_length))
+        return SetEncoderError(encoder, JPEG_ERR_OUT_OF_MEMORY);
+
+    PutMarker(writer, SOI);
+    PutMarker(writer, 0xE0);
+    PutWord(writer, 2 + sizeof(jfif));
+    for (uint32_t i = 0; i < sizeof(jfif); ++i)
+        PutByte(writer, jfif[i]);
+
+    // Tables go out in zigzag order, QuantizationSegment puts them back in natural order
+    PutMarker(writer, DQT);
+    PutWord(writer, 2 + 65 * tables);
+    for (uint32_t t = 0; t < tables; ++t)
+    {
+        PutByte(writer, t);
+        for (int k = 0; k < 64; ++k)
+            PutByte(writer, encoder->qtables[t].data[encoder->zigzag[k]]);
+    }
+
+    PutMarker(writer, SOF0);
+    PutWord(writer, 8 + 3 * encoder->channels);
+    PutByte(writer, 8);
+    PutWord(writer, encoder->height);
+    PutWord(writer, encoder->width);
+    PutByte(writer, encoder->channels);
+    for (uint32_t c = 0; c < encoder->channels; ++c)
+    {
+        PutByte(writer, c + 1);
+        PutByte(writer, encoder->components[c].HiVi);
+        PutByte(writer, encoder->components[c].table);
+    }
+
+    PutMarker(writer, DHT);
+    PutWord(writer, dht_length);
+    for (uint32_t t = 0; t < tables; ++t)
+    {
+        WriteHuffmanTable(writer, encoder->dc_tables + t);
+        WriteHuffmanTable(writer, encoder->ac_tables + t);
+    }
+
+    if (encoder->settings.restart_interval)
+    {
+        PutMarker(writer, DRI);
+        PutWord(writer, 4);
+        PutWord(writer, encoder->settings.restart_interval);
+    }
+
+    PutMarker(writer, SOS);
+    PutWord(writer, 6 + 2 * encoder->channels);
+    PutByte(writer, encoder->channels);
+    for (uint32_t c = 0; c < encoder->channels; ++c)
+    {
+        PutByte(writer, c + 1);
+        PutByte(writer, encoder->components[c].table << 4 | encoder->components[c].table);
+    }
+    PutByte(writer, 0);  // Ss
+    PutByte(writer, 63); // Se
+    PutByte(writer, 0);  // Ah and Al
+    return true;
+}
+
+static void ConvertLineRGBScalar(const uint8_t *in, float *y, float *u, float *v, uint32_t first, uint32_t width)
+{
+    for (uint32_t x = first; x < width; ++x)
+    {
+        float red = in[3 * x], green = in[3 * x + 1], blue = in[3 * x + 2];
+        y[x] = 0.299f * red + 0.587f * green + 0.114f * blue - 128.0f;
+        u[x] = -0.168736f * red - 0.331264f * green + 0.5f * blue;
+        v[x] = 0.5f * red - 0.418688f * green - 0.081312f * blue;
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define ENCODER_X86_KERNELS
+
+// 8 pixels, 4 per lane: the lanes get loaded 12 bytes apart so that both start on a pixel, and each channel is picked
+// out into 32 bit integers by its own pshufb. Same operations in the same order as the scalar code, so the same floats
+__attribute__((target("avx2"))) static void ConvertLineRGBAVX2(const uint8_t *in, float *y, float *u, float *v,
+                                                               uint32_t width)
+{
+    const __m256i red_order   = _mm256_setr_epi8(0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1,
+                                                 0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1);
+    const __m256i green_order = _mm256_setr_epi8(1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1,
+                                                 1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1);
+    const __m256i blue_order  = _mm256_setr_epi8(2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1,
+                                                 2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1);
+
+    // The second lane reads 28 bytes in, 4 past the 8th pixel
+    uint32_t x = 0;
+    for (; x + 10 <= width; x += 8)
+    {
+        __m256i pixels = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(in + 3 * x))),
+                                                 _mm_loadu_si128((const __m128i *)(in + 3 * x + 12)), 1);
+        __m256 red     = _mm256_cvtepi32_ps(_mm256_shuffle_epi8(pixels, red_order));
+        __m256 green   = _mm256_cvtepi32_ps(_mm256_shuffle_epi8(pixels, green_order));
+        __m256 blue    = _mm256_cvtepi32_ps(_mm256_shuffle_epi8(pixels, blue_order));
+
+        __m256 luma    = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(0.299f), red),
+                                                     _mm256_mul_ps(_mm256_set1_ps(0.587f), green)),
+                                       _mm256_mul_ps(_mm256_set1_ps(0.114f), blue));
+        __m256 cb      = _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(-0.168736f), red),
+                                                     _mm256_mul_ps(_mm256_set1_ps(0.331264f), green)),
+                                       _mm256_mul_ps(_mm256_set1_ps(0.5f), blue));
+        __m256 cr      = _mm256_sub_ps(_mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), red),
+                                                     _mm256_mul_ps(_mm256_set1_ps(0.418688f), green)),
+                                       _mm256_mul_ps(_mm256_set1_ps(0.081312f), blue));
+        _mm256_storeu_ps(y + x, _mm256_sub_ps(luma, _mm256_set1_ps(128.0f)));
+        _mm256_storeu_ps(u + x, cb);
+        _mm256_storeu_ps(v + x, cr);
+    }
+    ConvertLineRGBScalar(in, y, u, v, x, width);
+}
+#endif
+
+static void ConvertLineRGB(const uint8_t *in, float *y, float *u, float *v, uint32_t width)
+{
+#ifdef ENCODER_X86_KERNELS
+    if (__builtin_cpu_supports("avx2"))
+        return ConvertLineRGBAVX2(in, y, u, v, width);
+#endif
+    ConvertLineRGBScalar(in, y, u, v, 0, width);
+}
+
+// Adds a line of full resolution chroma to its subsampled line, averaged over H columns here and V lines in total
+static void SubsampleLine(float *out, const float *in, uint32_t width, uint32_t H, bool first, float scale)
+{
+    if (H == 1)
+    {
+        for (uint32_t x = 0; x < width; ++x)
+            out[x] = (first ? 0.0f : out[x]) + in[x] * scale;
+        return;
+    }
+    for (uint32_t x = 0; x < width; ++x)
+        out[x] = (first ? 0.0f : out[x]) + (in[2 * x] + in[2 * x + 1]) * scale;
+}
+
+// Level shifted Y, Cb and Cr of lines rows[0 .. 8V), the columns past the image repeat its last one. Subsampled
+// chroma is converted a line at a time into the scratch lines and box filtered from there
+static void ConvertRows(const JPEGEncoder *encoder, MCURowCoder *coder, const uint8_t *const *rows)
+{
+    const uint32_t stride     = encoder->components[0].width;
+    const uint32_t width      = encoder->width;
+    const bool     subsampled = encoder->H * encoder->V > 1;
+    const float    scale      = 1.0f / (encoder->H * encoder->V);
+
+    for (uint32_t r = 0; r < 8u * encoder->V; ++r)
+    {
+        const uint8_t *in = rows[r];
+        float         *y  = coder->planes[0] + r * stride;
+        if (encoder->channels == 1)
+        {
+            for (uint32_t x = 0; x < width; ++x)
+                y[x] = in[x] - 128.0f;
+            for (uint32_t x = width; x < stride; ++x)
+                y[x] = y[width - 1];
+            continue;
+        }
+
+        float *u = subsampled ? coder->scratch : coder->planes[1] + r * stride;
+        float *v = subsampled ? coder->scratch + stride : coder->planes[2] + r * stride;
+        ConvertLineRGB(in, y, u, v, width);
+        for (uint32_t x = width; x < stride; ++x)
+        {
+            y[x] = y[width - 1];
+            u[x] = u[width - 1];
+            v[x] = v[width - 1];
+        }
+
+        if (subsampled)
+        {
+            const uint32_t chroma = encoder->components[1].width;
+            const uint32_t line   = r / encoder->V * chroma;
+            SubsampleLine(coder->planes[1] + line, u, chroma, encoder->H, r % encoder->V == 0, scale);
+            SubsampleLine(coder->planes[2] + line, v, chroma, encoder->H, r % encoder->V == 0, scale);
+        }
+    }
+}
+
+static void EncodePlaneBlock(const JPEGEncoder *encoder, MCURowCoder *coder, uint32_t comp, uint32_t x, uint32_t y)
+{
+    _Alignas(32) float samples[64];
+    int16_t            coefficients[64];
+    const uint32_t     width = encoder->components[comp].width;
+    const uint32_t     table = encoder->components[comp].table;
+    const float       *in    = coder->planes[comp] + y * width + x;
+    for (int r = 0; r < 8; ++r)
+        memcpy(samples + 8 * r, in + r * width, 8 * sizeof(float));
+
+    uint64_t nonzero = encoder->fdct(samples, encoder->divisors[table], encoder->zigzag, coefficients);
+    EncodeBlock(&coder->writer, coefficients, nonzero, encoder->dc_codes + table, encoder->ac_codes + table,
+                coder->predictors + comp);
+}
+
+// One MCU row from lines rows[0 .. 8V) into coder->writer
+static bool EncodeMCURow(const JPEGEncoder *encoder, MCURowCoder *coder, const uint8_t *const *rows)
+{
+    const uint32_t blocks   = encoder->H * encoder->V + (encoder->channels == 1 ? 0 : 2);
+    const uint32_t interval = encoder->settings.restart_interval;
+    if (!ReserveBytes(&coder->writer, (uint64_t)encoder->mcu_cols * (blocks * MAX_BLOCK_BYTES + MAX_MARKER_BYTES)))
+        return false;
+
+    ConvertRows(encoder, coder, rows);
+    for (uint32_t col = 0; col < encoder->mcu_cols; ++col, ++coder->mcus)
+    {
+        if (interval && coder->mcus && coder->mcus % interval == 0)
+        {
+            FlushBits(&coder->writer);
+            PutMarker(&coder->writer, RST0 + ((coder->mcus / interval - 1) & 7));
+            memset(coder->predictors, 0, sizeof(coder->predictors));
+        }
+
+        for (uint32_t v = 0; v < encoder->V; ++v)
+            for (uint32_t h = 0; h < encoder->H; ++h)
+                EncodePlaneBlock(encoder, coder, 0, (col * encoder->H + h) * 8, v * 8);
+        for (uint32_t comp = 1; comp < encoder->channels; ++comp)
+            EncodePlaneBlock(encoder, coder, comp, col * 8, 0);
+    }
+    return true;
+}
+
+// MCU rows out of count lines, the lines missing at the bottom of the image repeat its last one
+static bool EncodeMCURows(const JPEGEncoder *encoder, MCURowCoder *coder, const uint8_t *rows, uint64_t stride,
+                          uint32_t count)
+{
+    const uint32_t lines = 8 * encoder->V;
+    for (uint32_t first = 0; first < count; first += lines)
+    {
+        const uint8_t *line[16];
+        for (uint32_t r = 0; r < lines; ++r)
+            line[r] = rows + (first + r < count ? first + r : count - 1) * stride;
+        if (!EncodeMCURow(encoder, coder, line))
+            return false;
+    }
+    return true;
+}
+
+static bool InitMCURowCoder(const JPEGEncoder *encoder, MCURowCoder *coder)
+{
+    bool allocated = true;
+    for (uint32_t c = 0; c < encoder->channels; ++c)
+    {
+        coder->planes[c] = malloc(sizeof(float) * encoder->components[c].width * 8 * (c ? 1 : encoder->V));
+        allocated        = allocated && coder->planes[c];
+    }
+    if (encoder->channels == 3 && encoder->H * encoder->V > 1)
+        allocated = allocated && (coder->scratch = malloc(sizeof(float) * 2 * encoder->components[0].width));
+    return allocated && ReserveBytes(&coder->writer, FLUSH_BYTES);
+}
+
+static void FreeMCURowCoder(MCURowCoder *coder)
+{
+    for (int c = 0; c < 3; ++c)
+        free(coder->planes[c]);
+    free(coder->scratch);
+    free(coder->writer.data);
+    memset(coder, 0, sizeof(*coder));
+}
+
+static bool WriteOut(JPEGEncoder *encoder, JPEGBitWriter *writer)
+{
+    if (writer->failed)
+        return SetEncoderError(encoder, JPEG_ERR_OUT_OF_MEMORY);
+    if (writer->size && !encoder->write(encoder->context, writer->data, writer->size))
+        return SetEncoderError(encoder, JPEG_ERR_IO);
+    writer->size = 0;
+    return true;
+}
+
+static bool EncodeNextMCURow(JPEGEncoder *encoder, const uint8_t *rows, uint64_t stride, uint32_t count)
+{
+    encoder->mcu_row++;
+    if (!EncodeMCURows(encoder, &encoder->coder, rows, stride, count))
+        return SetEncoderError(encoder, JPEG_ERR_OUT_OF_MEMORY);
+    return encoder->coder.writer.size < FLUSH_BYTES || WriteOut(encoder, &encoder->coder.writer);
+}
+
+// Parallel encoding: the image is cut into bands of whole MCU rows that each start on a restart interval, so a band
+// needs nothing from the ones before it. Workers code the bands into their own writers, each one ending padded to a
+// byte and the next one starting with its RST marker, and the bytes just get written out one band after the other
+typedef enum BandState
+{
+    BAND_EMPTY,
+    BAND_PENDING,
+    BAND_ENCODING,
+    BAND_DONE
+} BandState;
+
+typedef struct EncodeBand
+{
+    BandState   state;
+    uint8_t    *pixels;
+    uint32_t    rows;          // pixel rows in it, fewer than a full band only at the bottom of the image
+    uint32_t    first_mcu_row;
+    MCURowCoder coder;
+} EncodeBand;
+
+typedef struct EncodeQueue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;
+    EncodeBand     *bands;
+    uint32_t        depth;
+    uint32_t        band_mcu_rows;
+    uint64_t        next_pending; // oldest band no worker picked up yet
+    uint64_t        queued;       // bands handed to the workers so far
+    uint64_t        written;      // bands written out so far
+    pthread_t      *tids;
+    uint32_t        started;
+    bool            quit;
+} EncodeQueue;
+
+static void EncodeBandRows(const JPEGEncoder *encoder, EncodeBand *band)
+{
+    MCURowCoder *coder = &band->coder;
+    coder->mcus        = (uint64_t)band->first_mcu_row * encoder->mcu_cols;
+    memset(coder->predictors, 0, sizeof(coder->predictors));
+
+    const uint64_t stride = (uint64_t)encoder->width * encoder->channels;
+    if (!EncodeMCURows(encoder, coder, band->pixels, stride, band->rows) || !ReserveBytes(&coder->writer, 16))
+        coder->writer.failed = true;
+    else
+        FlushBits(&coder->writer);
+}
+
+static void *BandWorker(void *arg)
+{
+    const JPEGEncoder *encoder = arg;
+    EncodeQueue       *queue   = encoder->queue;
+    pthread_mutex_lock(&queue->lock);
+    while (true)
+    {
+        while (!queue->quit && queue->next_pending == queue->queued)
+            pthread_cond_wait(&queue->changed, &queue->lock);
+        if (queue->quit)
+            break;
+
+        EncodeBand *band = &queue->bands[queue->next_pending++ % queue->depth];
+        band->state      = BAND_ENCODING;
+        pthread_mutex_unlock(&queue->lock);
+
+        EncodeBandRows(encoder, band);
+
+        pthread_mutex_lock(&queue->lock);
+        band->state = BAND_DONE;
+        pthread_cond_broadcast(&queue->changed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+// Writes the coded bands out in order until `until` of them are, waiting for the workers where needed
+static bool WriteOutBands(JPEGEncoder *encoder, uint64_t until)
+{
+    EncodeQueue *queue = encoder->queue;
+    pthread_mutex_lock(&queue->lock);
+    while (queue->written < until)
+    {
+        EncodeBand *band = &queue->bands[queue->written % queue->depth];
+        if (band->state != BAND_DONE)
+        {
+            pthread_cond_wait(&queue->changed, &queue->lock);
+            continue;
+        }
+
+        // Done bands belong to this thread until they're marked empty again
+        pthread_mutex_unlock(&queue->lock);
+        bool written = WriteOut(encoder, &band->coder.writer);
+        pthread_mutex_lock(&queue->lock);
+        band->state = BAND_EMPTY;
+        queue->written++;
+        if (!written)
+            break;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return encoder->error == JPEG_OK;
+}
+
+static void SubmitBand(JPEGEncoder *encoder)
+{
+    EncodeQueue *queue   = encoder->queue;
+    EncodeBand  *band    = &queue->bands[queue->queued % queue->depth];
+    band->rows           = encoder->band_rows;
+    band->first_mcu_row  = encoder->mcu_row;
+    encoder->mcu_row     = encoder->mcu_row + queue->band_mcu_rows;
+    encoder->band_rows   = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    band->state = BAND_PENDING;
+    queue->queued++;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Rows go into the band being filled, which has to be written out from its last use first
+static bool QueueRows(JPEGEncoder *encoder, const uint8_t *rows, uint64_t stride, uint32_t count)
+{
+    EncodeQueue   *queue    = encoder->queue;
+    const uint64_t row_size = (uint64_t)encoder->width * encoder->channels;
+    const uint32_t lines    = queue->band_mcu_rows * 8 * encoder->V;
+    while (count)
+    {
+        const bool reused = !encoder->band_rows && queue->queued >= queue->depth;
+        if (reused && !WriteOutBands(encoder, queue->queued - queue->depth + 1))
+            return false;
+
+        EncodeBand *band = &queue->bands[queue->queued % queue->depth];
+        uint32_t    copy = lines - encoder->band_rows < count ? lines - encoder->band_rows : count;
+        for (uint32_t r = 0; r < copy; ++r)
+            memcpy(band->pixels + (encoder->band_rows + r) * row_size, rows + r * stride, row_size);
+        rows                   = rows + copy * stride;
+        count                  = count - copy;
+        encoder->band_rows     = encoder->band_rows + copy;
+        encoder->rows_received = encoder->rows_received + copy;
+        if (encoder->band_rows == lines)
+            SubmitBand(encoder);
+    }
+    return true;
+}
+
+static void DestroyEncodeQueue(JPEGEncoder *encoder)
+{
+    EncodeQueue *queue = encoder->queue;
+    if (!queue)
+        return;
+
+    pthread_mutex_lock(&queue->lock);
+    queue->quit = true;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    for (uint32_t i = 0; i < queue->started; ++i)
+        pthread_join(queue->tids[i], NULL);
+
+    for (uint32_t i = 0; queue->bands && i < queue->depth; ++i)
+    {
+        free(queue->bands[i].pixels);
+        FreeMCURowCoder(&queue->bands[i].coder);
+    }
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->changed);
+    free(queue->bands);
+    free(queue->tids);
+    free(queue);
+    encoder->queue = NULL;
+}
+
+static uint32_t GreatestCommonDivisor(uint32_t a, uint32_t b)
+{
+    while (b)
+    {
+        uint32_t r = a % b;
+        a          = b;
+        b          = r;
+    }
+    return a;
+}
+
+// Bands of a few MCU rows, with the restart interval set to one band unless one was asked for. Then bands are made
+// of as many MCU rows as it takes to end on a restart, intervals that don't line up with MCU rows can mean few bands
+static JPEGError InitEncodeQueue(JPEGEncoder *encoder, uint32_t threads)
+{
+    const uint32_t most_rows     = 0xFFFF / encoder->mcu_cols; // a restart interval is 16 bits
+    const uint32_t interval      = encoder->settings.restart_interval;
+    uint32_t       band_mcu_rows = BAND_MCU_ROWS < most_rows ? BAND_MCU_ROWS : most_rows;
+    if (!interval)
+        encoder->settings.restart_interval = band_mcu_rows * encoder->mcu_cols;
+    else
+        band_mcu_rows = interval / GreatestCommonDivisor(interval, encoder->mcu_cols);
+
+    EncodeQueue *queue = calloc(1, sizeof(*queue));
+    if (!(encoder->queue = queue))
+        return JPEG_ERR_OUT_OF_MEMORY;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->changed, NULL);
+    queue->band_mcu_rows = band_mcu_rows;
+    queue->depth         = 2 * threads;
+    queue->bands         = calloc(queue->depth, sizeof(*queue->bands));
+    queue->tids          = calloc(threads, sizeof(*queue->tids));
+    if (!queue->bands || !queue->tids)
+        return JPEG_ERR_OUT_OF_MEMORY;
+
+    const uint64_t band_size = (uint64_t)encoder->width * encoder->channels * band_mcu_rows * 8 * encoder->V;
+    for (uint32_t i = 0; i < queue->depth; ++i)
+        if (!(queue->bands[i].pixels = malloc(band_size)) || !InitMCURowCoder(encoder, &queue->bands[i].coder))
+            return JPEG_ERR_OUT_OF_MEMORY;
+
+    for (; queue->started < threads; ++queue->started)
+        if (pthread_create(&queue->tids[queue->started], NULL, BandWorker, encoder))
+            break;
+    return queue->started ? JPEG_OK : JPEG_ERR_OUT_OF_MEMORY;
+}
+
+JPEGError InitJPEGEncoder(JPEGEncoder *encoder, uint32_t width, uint32_t height, uint32_t channels,
+                          const JPEGEncodeSettings *settings, JPEGWriteFunction write, void *context)
+{
+    memset(encoder, 0, sizeof(*encoder));
+    const uint8_t sampling = channels == 1 ? JPEG_SAMPLING_444 : settings->sampling;
+    if (!width || !height || width > 0xFFFF || height > 0xFFFF || (channels != 1 && channels != 3) || !write ||
+        settings->quality < 1 || settings->quality > 100 || settings->restart_interval > 0xFFFF ||
+        (sampling != JPEG_SAMPLING_444 && sampling != JPEG_SAMPLING_422 && sampling != JPEG_SAMPLING_420 &&
+         sampling != JPEG_SAMPLING_440))
+        return encoder->error = JPEG_ERR_INVALID_ARGUMENT;
+
+    encoder->width    = width;
+    encoder->height   = height;
+    encoder->channels = channels;
+    encoder->settings = *settings;
+    encoder->write    = write;
+    encoder->context  = context;
+    encoder->H        = sampling >> 4;
+    encoder->V        = sampling & 0x0F;
+    encoder->mcu_cols = (width + 8 * encoder->H - 1) / (8 * encoder->H);
+    encoder->mcu_rows = (height + 8 * encoder->V - 1) / (8 * encoder->V);
+    for (uint32_t c = 0; c < channels; ++c)
+    {
+        encoder->components[c].HiVi  = c ? 0x11 : sampling;
+        encoder->components[c].table = c ? 1 : 0;
+        encoder->components[c].width = encoder->mcu_cols * 8 * (c ? 1 : encoder->H);
+    }
+
+    BuildZigZagOrder(encoder->zigzag);
+    for (int t = 0; t < 2; ++t)
+    {
+        ScaledQuantizationTable(encoder->qtables + t, t, settings->quality);
+        QuantizationDivisors(encoder->qtables[t].data, encoder->divisors[t]);
+    }
+    encoder->fdct = PickForwardDCT();
+    if (!LoadHuffmanTables(encoder))
+        return encoder->error = JPEG_ERR_BAD_HUFFMAN;
+
+    if (settings->threads > 1)
+        return encoder->error = InitEncodeQueue(encoder, settings->threads);
+
+    encoder->band = malloc((uint64_t)width * channels * 8 * encoder->V);
+    if (!encoder->band || !InitMCURowCoder(encoder, &encoder->coder))
+        return encoder->error = JPEG_ERR_OUT_OF_MEMORY;
+    return JPEG_OK;
+}
+
+JPEGError EncodeJPEGRows(JPEGEncoder *encoder, const uint8_t *rows, uint64_t stride, uint32_t count)
+{
+    const uint64_t row_size = (uint64_t)encoder->width * encoder->channels;
+    const uint32_t lines    = 8 * encoder->V;
+    stride                  = stride ? stride : row_size;
+    if (encoder->error != JPEG_OK)
+        return encoder->error;
+    if (count > encoder->height - encoder->rows_received)
+        return encoder->error = JPEG_ERR_INVALID_ARGUMENT;
+
+    if (!encoder->headers_written)
+    {
+        encoder->headers_written = true;
+        if (!WriteHeaders(encoder, &encoder->coder.writer) ||
+            (encoder->queue && !WriteOut(encoder, &encoder->coder.writer)))
+            return encoder->error;
+    }
+    if (encoder->queue)
+        return QueueRows(encoder, rows, stride, count) ? JPEG_OK : encoder->error;
+
+    while (count)
+    {
+        // Whole MCU rows get encoded straight from the caller's rows, the rest goes through the band
+        if (!encoder->band_rows && count >= lines)
+        {
+            if (!EncodeNextMCURow(encoder, rows, stride, lines))
+                return encoder->error;
+            rows                   = rows + lines * stride;
+            count                  = count - lines;
+            encoder->rows_received = encoder->rows_received + lines;
+            continue;
+        }
+
+        uint32_t copy = lines - encoder->band_rows < count ? lines - encoder->band_rows : count;
+        for (uint32_t r = 0; r < copy; ++r)
+            memcpy(encoder->band + (encoder->band_rows + r) * row_size, rows + r * stride, row_size);
+        rows                   = rows + copy * stride;
+        count                  = count - copy;
+        encoder->band_rows     = encoder->band_rows + copy;
+        encoder->rows_received = encoder->rows_received + copy;
+        if (encoder->band_rows == lines)
+        {
+            encoder->band_rows = 0;
+            if (!EncodeNextMCURow(encoder, encoder->band, row_size, lines))
+                return encoder->error;
+        }
+    }
+    return JPEG_OK;
+}
+
+JPEGError FinishJPEGEncode(JPEGEncoder *encoder)
+{
+    if (encoder->error != JPEG_OK)
+        return encoder->error;
+    if (encoder->rows_received != encoder->height)
+        return encoder->error = JPEG_ERR_INVALID_ARGUMENT;
+    const uint64_t row_size = (uint64_t)encoder->width * encoder->channels;
+
+    // The bottom MCU row (or band) of images that don't end on a whole one
+    if (encoder->queue)
+    {
+        if (encoder->band_rows)
+            SubmitBand(encoder);
+        if (!WriteOutBands(encoder, encoder->queue->queued))
+            return encoder->error;
+    }
+    else if (encoder->band_rows && !EncodeNextMCURow(encoder, encoder->band, row_size, encoder->band_rows))
+        return encoder->error;
+    encoder->band_rows = 0;
+
+    JPEGBitWriter *writer = &encoder->coder.writer;
+    if (!ReserveBytes(writer, MAX_MARKER_BYTES))
+        return encoder->error = JPEG_ERR_OUT_OF_MEMORY;
+    FlushBits(writer);
+    PutMarker(writer, EOI);
+    WriteOut(encoder, writer);
+    return encoder->error;
+}
+
+void CleanUpEncoder(JPEGEncoder *encoder)
+{
+    for (int t = 0; t < 2; ++t)
+    {
+        free(encoder->dc_tables[t].huffman_code);
+        free(encoder->dc_tables[t].huffman_val);
+        free(encoder->ac_tables[t].huffman_code);
+        free(encoder->ac_tables[t].huffman_val);
+    }
+    DestroyEncodeQueue(encoder);
+    FreeMCURowCoder(&encoder->coder);
+    free(encoder->band);
+    memset(encoder, 0, sizeof(*encoder));
+}
+
+JPEGError EncodeJPEG(const uint8_t *pixels, uint32_t width, uint32_t height, uint32_t channels,
+                     const JPEGEncodeSettings *settings, JPEGWriteFunction write, void *context)
+{
+    JPEGEncoder encoder;
+    JPEGError   err = InitJPEGEncoder(&encoder, width, height, channels, settings, write, context);
+    if (err == JPEG_OK)
+        err = EncodeJPEGRows(&encoder, pixels, 0, height);
+    if (err == JPEG_OK)
+        err = FinishJPEGEncode(&encoder);
+    CleanUpEncoder(&encoder);
+    return err;
+}
+
+bool WriteJPEGToFile(void *context, const uint8_t *data, uint64_t size)
+{
+    return fwrite(data, 1, size, context) == size;
+}
+
+bool JPEGSamplingFromString(const char *name, JPEGSampling *sampling)
+{
+    static const char        *names[]   = {"444", "422", "420", "440"};
+    static const JPEGSampling factors[] = {JPEG_SAMPLING_444, JPEG_SAMPLING_422, JPEG_SAMPLING_420, JPEG_SAMPLING_440};
+    for (int i = 0; i < 4; ++i)
+        if (!strcmp(name, names[i]))
+            return (*sampling = factors[i]), true;
+    return false;
+}
+
+const char *JPEGSamplingName(JPEGSampling sampling)
+{
+    switch (sampling)
+    {
+    case JPEG_SAMPLING_444:
+        return "444";
+    case JPEG_SAMPLING_422:
+        return "422";
+    case JPEG_SAMPLING_420:
+        return "420";
+    case JPEG_SAMPLING_440:
+        return "440";
+    }
+    return "unknown";
+}
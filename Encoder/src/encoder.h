@@ -0,0 +1,115 @@
+#ifndef ENCODER_H_
+#define ENCODER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../../Decoder/src/jpeg.h"
+#include "./bitwriter.h"
+#include "./fdct.h"
+// Baseline JPEG encoder, the decoder run backwards: the same QTable / HTable structures and zigzag order, the Annex K
+// tables, 8 bit gray or RGB in, one scan with every component interleaved out
+// Pixels are taken a few rows at a time and encoded an MCU row at a time, the encoder never holds more than one MCU row
+// of them, and the entropy coded data goes out through a write callback as it fills up
+// With several threads the image gets coded in bands of MCU rows that each start on a restart marker, so the bands
+// don't depend on each other. Up to 2 bands per thread are held then, and the restart interval becomes one band unless
+// settings ask for one
+
+// Luma sampling factors as H << 4 | V, chroma is always 1x1
+typedef enum JPEGSampling
+{
+    JPEG_SAMPLING_444 = 0x11,
+    JPEG_SAMPLING_422 = 0x21, // half the chroma columns
+    JPEG_SAMPLING_420 = 0x22, // half the chroma columns and rows
+    JPEG_SAMPLING_440 = 0x12  // half the chroma rows
+} JPEGSampling;
+
+typedef struct JPEGEncodeSettings
+{
+    uint32_t     quality;          // 1 - 100, scales the Annex K quantization tables like IJG does
+    JPEGSampling sampling;         // ignored for gray images
+    uint32_t     restart_interval; // MCUs between restart markers, 0 for none
+    uint32_t     threads;          // above 1, bands of MCU rows between restart markers get coded in parallel
+} JPEGEncodeSettings;
+
+// Gets the file a chunk at a time, false stops the encode with JPEG_ERR_IO
+typedef bool (*JPEGWriteFunction)(void *context, const uint8_t *data, uint64_t size);
+
+typedef struct JPEGEncoderComponent
+{
+    uint8_t  HiVi;
+    uint8_t  table; // quantization and huffman tables, 0 for luma and 1 for chroma
+    uint32_t width; // samples per MCU row line, the image padded to whole MCUs
+} JPEGEncoderComponent;
+
+// Entropy coder state of a run of MCU rows, with the samples of the one in flight
+typedef struct MCURowCoder
+{
+    JPEGBitWriter writer;
+    int32_t       predictors[3];
+    uint64_t      mcus;      // MCUs coded so far in the whole image, restart markers go by it
+    float        *planes[3]; // Y, Cb and Cr of one MCU row, level shifted, chroma subsampled
+    float        *scratch;   // a line of full resolution Cb and Cr before subsampling
+} MCURowCoder;
+
+typedef struct JPEGEncoder
+{
+    JPEGError            error; // first error hit while encoding, JPEG_OK otherwise
+    uint32_t             width;
+    uint32_t             height;
+    uint32_t             channels; // 1 for gray, 3 for RGB
+    JPEGEncodeSettings   settings;
+    JPEGEncoderComponent components[3];
+
+    uint8_t              H; // luma sampling factors, 1 for gray
+    uint8_t              V;
+    uint32_t             mcu_cols;
+    uint32_t             mcu_rows;
+
+    QTable               qtables[2];
+    float                divisors[2][64]; // see QuantizationDivisors
+    HTable               dc_tables[2];
+    HTable               ac_tables[2];
+    HuffmanLookup        dc_codes[2];
+    HuffmanLookup        ac_codes[2];
+    uint8_t              zigzag[64];
+    ForwardDCTFunction   fdct; // PickForwardDCT, can be swapped for ScalarForwardDCT after InitJPEGEncoder
+
+    JPEGWriteFunction    write;
+    void                *context;
+    bool                 headers_written;
+
+    // Rows given so far that don't make up a whole MCU row yet
+    uint8_t             *band;
+    uint32_t             band_rows;
+    uint32_t             rows_received;
+    uint32_t             mcu_row; // next MCU row to encode
+
+    MCURowCoder          coder;
+
+    // Bands being coded on worker threads, settings.threads > 1 only. The workers hold on to the encoder, which
+    // can't be moved until CleanUpEncoder
+    struct EncodeQueue  *queue;
+} JPEGEncoder;
+
+// Public API, every call returns the first error encountered (also kept in encoder->error)
+JPEGError InitJPEGEncoder(JPEGEncoder *encoder, uint32_t width, uint32_t height, uint32_t channels,
+                          const JPEGEncodeSettings *settings, JPEGWriteFunction write, void *context);
+// count rows of tightly packed (stride 0) or stride spaced pixels, top to bottom
+JPEGError EncodeJPEGRows(JPEGEncoder *encoder, const uint8_t *rows, uint64_t stride, uint32_t count);
+// Encodes what's left and writes EOI, every row has to be in
+JPEGError FinishJPEGEncode(JPEGEncoder *encoder);
+void      CleanUpEncoder(JPEGEncoder *encoder);
+
+// Whole image in one go
+JPEGError EncodeJPEG(const uint8_t *pixels, uint32_t width, uint32_t height, uint32_t channels,
+                     const JPEGEncodeSettings *settings, JPEGWriteFunction write, void *context);
+
+// Write callback for a FILE *
+bool WriteJPEGToFile(void *context, const uint8_t *data, uint64_t size);
+
+// "444", "422", "420" or "440"
+bool        JPEGSamplingFromString(const char *name, JPEGSampling *sampling);
+const char *JPEGSamplingName(JPEGSampling sampling);
+
+#endif // ENCODER_H_
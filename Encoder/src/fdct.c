@@ -0,0 +1,149 @@
+#include <math.h>
+
+#include "./fdct.h"
+
+// One 8 point AAN DCT over d0..d7, in place. Plain arithmetic only, so the same steps run on floats and on GCC vector
+// types (8 columns at once). Outputs are scaled, see QuantizationDivisors
+#define FDCT_AAN_1D(T, d0, d1, d2, d3, d4, d5, d6, d7)                                                                \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        T tmp0 = d0 + d7, tmp7 = d0 - d7;                                                                              \
+        T tmp1 = d1 + d6, tmp6 = d1 - d6;                                                                              \
+        T tmp2 = d2 + d5, tmp5 = d2 - d5;                                                                              \
+        T tmp3 = d3 + d4, tmp4 = d3 - d4;                                                                              \
+        /* Even part */                                                                                                \
+        T tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;                                                                    \
+        T tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;                                                                    \
+        d0      = tmp10 + tmp11;                                                                                       \
+        d4      = tmp10 - tmp11;                                                                                       \
+        T z1    = (tmp12 + tmp13) * 0.707106781f;                                                                      \
+        d2      = tmp13 + z1;                                                                                          \
+        d6      = tmp13 - z1;                                                                                          \
+        /* Odd part */                                                                                                 \
+        tmp10   = tmp4 + tmp5;                                                                                         \
+        tmp11   = tmp5 + tmp6;                                                                                         \
+        tmp12   = tmp6 + tmp7;                                                                                         \
+        T z5    = (tmp10 - tmp12) * 0.382683433f;                                                                      \
+        T z2    = tmp10 * 0.541196100f + z5;                                                                           \
+        T z4    = tmp12 * 1.306562965f + z5;                                                                           \
+        T z3    = tmp11 * 0.707106781f;                                                                                \
+        T z11   = tmp7 + z3, z13 = tmp7 - z3;                                                                          \
+        d5      = z13 + z2;                                                                                            \
+        d3      = z13 - z2;                                                                                            \
+        d1      = z11 + z4;                                                                                            \
+        d7      = z11 - z4;                                                                                            \
+    } while (0)
+
+void QuantizationDivisors(const uint16_t table[64], float divisors[64])
+{
+    static const double aan_scale[8] = {1.0,          1.387039845, 1.306562965, 1.175875602,
+                                        1.0,          0.785694958, 0.541196100, 0.275899379};
+    for (int v = 0; v < 8; ++v)
+        for (int u = 0; u < 8; ++u)
+            divisors[v * 8 + u] = 1.0 / (table[v * 8 + u] * aan_scale[v] * aan_scale[u] * 8.0);
+}
+
+static uint64_t ForwardDCTScalar(float *samples, const float *divisors, const uint8_t *zigzag, int16_t *out)
+{
+    for (int row = 0; row < 8; ++row)
+    {
+        float *d = samples + row * 8;
+        FDCT_AAN_1D(float, d[0], d[1], d[2], d[3], d[4], d[5], d[6], d[7]);
+    }
+    for (int col = 0; col < 8; ++col)
+    {
+        float *d = samples + col;
+        FDCT_AAN_1D(float, d[0], d[8], d[16], d[24], d[32], d[40], d[48], d[56]);
+    }
+    // Round to nearest even, the same as the vector conversion
+    uint64_t nonzero = 0;
+    for (int k = 0; k < 64; ++k)
+    {
+        out[k]  = lrintf(samples[zigzag[k]] * divisors[zigzag[k]]);
+        nonzero = nonzero | (uint64_t)(out[k] != 0) << k;
+    }
+    return nonzero;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define FDCT_X86_KERNELS
+
+__attribute__((target("avx2"))) static inline void Transpose8x8(__m256 *r)
+{
+    __m256 t0 = _mm256_unpacklo_ps(r[0], r[1]), t1 = _mm256_unpackhi_ps(r[0], r[1]);
+    __m256 t2 = _mm256_unpacklo_ps(r[2], r[3]), t3 = _mm256_unpackhi_ps(r[2], r[3]);
+    __m256 t4 = _mm256_unpacklo_ps(r[4], r[5]), t5 = _mm256_unpackhi_ps(r[4], r[5]);
+    __m256 t6 = _mm256_unpacklo_ps(r[6], r[7]), t7 = _mm256_unpackhi_ps(r[6], r[7]);
+    __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+    r[0]      = _mm256_permute2f128_ps(s0, s4, 0x20);
+    r[1]      = _mm256_permute2f128_ps(s1, s5, 0x20);
+    r[2]      = _mm256_permute2f128_ps(s2, s6, 0x20);
+    r[3]      = _mm256_permute2f128_ps(s3, s7, 0x20);
+    r[4]      = _mm256_permute2f128_ps(s0, s4, 0x31);
+    r[5]      = _mm256_permute2f128_ps(s1, s5, 0x31);
+    r[6]      = _mm256_permute2f128_ps(s2, s6, 0x31);
+    r[7]      = _mm256_permute2f128_ps(s3, s7, 0x31);
+}
+
+// Each register holds a row, so a 1D pass over the registers transforms all 8 columns at once. Transposing first makes
+// that the row pass, transposing again between the passes leaves the result in natural order
+__attribute__((target("avx2"))) static uint64_t ForwardDCTAVX2(float *samples, const float *divisors,
+                                                               const uint8_t *zigzag, int16_t *out)
+{
+    __m256 r[8];
+    for (int i = 0; i < 8; ++i)
+        r[i] = _mm256_load_ps(samples + 8 * i);
+
+    Transpose8x8(r);
+    FDCT_AAN_1D(__m256, r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7]);
+    Transpose8x8(r);
+    FDCT_AAN_1D(__m256, r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7]);
+
+    _Alignas(32) int16_t natural[64];
+    for (int i = 0; i < 8; i += 2)
+    {
+        __m256i a = _mm256_cvtps_epi32(_mm256_mul_ps(r[i], _mm256_loadu_ps(divisors + 8 * i)));
+        __m256i b = _mm256_cvtps_epi32(_mm256_mul_ps(r[i + 1], _mm256_loadu_ps(divisors + 8 * i + 8)));
+        // packs works per 128 bit lane, the permute puts the quarters back in row order
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_store_si256((__m256i *)(natural + 8 * i), packed);
+    }
+    for (int k = 0; k < 64; ++k)
+        out[k] = natural[zigzag[k]];
+
+    // Zero compares packed down to bytes, 32 coefficients per movemask. packs interleaves the lanes again, which the
+    // permute undoes
+    const __m256i zero = _mm256_setzero_si256();
+    uint64_t      mask = 0;
+    for (int half = 0; half < 2; ++half)
+    {
+        __m256i low  = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)(out + 32 * half)), zero);
+        __m256i high = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)(out + 32 * half + 16)), zero);
+        __m256i bytes = _mm256_permute4x64_epi64(_mm256_packs_epi16(low, high), _MM_SHUFFLE(3, 1, 2, 0));
+        mask = mask | (uint64_t)(uint32_t)_mm256_movemask_epi8(bytes) << (32 * half);
+    }
+    return ~mask;
+}
+#endif
+
+ForwardDCTFunction ScalarForwardDCT(void)
+{
+    return ForwardDCTScalar;
+}
+
+ForwardDCTFunction PickForwardDCT(void)
+{
+#ifdef FDCT_X86_KERNELS
+    if (__builtin_cpu_supports("avx2"))
+        return ForwardDCTAVX2;
+#endif
+    return ForwardDCTScalar;
+}
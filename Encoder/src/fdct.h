@@ -0,0 +1,23 @@
+#ifndef FDCT_H_
+#define FDCT_H_
+
+#include <stdint.h>
+// Forward DCT with the quantization folded in, for the encoder
+// The transform is the AAN float one (as in IJG's jfdctflt.c): its outputs come out scaled per coefficient, and that
+// scale is divided out together with the quantizer in a single multiply
+
+// samples : 64 level shifted (-128) samples, row major, 32 byte aligned, overwritten
+// divisors : from QuantizationDivisors
+// zigzag : natural index of every zigzag position, see BuildZigZagOrder
+// out : quantized coefficients in zigzag order
+// Returns the nonzero coefficients as a mask, bit k for zigzag position k
+typedef uint64_t (*ForwardDCTFunction)(float *samples, const float *divisors, const uint8_t *zigzag, int16_t *out);
+
+// AVX2 when the CPU has it, scalar otherwise. Both give the same coefficients
+ForwardDCTFunction PickForwardDCT(void);
+ForwardDCTFunction ScalarForwardDCT(void);
+
+// 1 / (quantizer * AAN scale) for every coefficient of a natural order table
+void QuantizationDivisors(const uint16_t table[64], float divisors[64]);
+
+#endif // FDCT_H_
@@ -0,0 +1,42 @@
+#include "../../utility/log.h"
+#include "./jpegsink.h"
+
+static bool JPEGSinkBegin(void *context, uint32_t width, uint32_t height, uint32_t channels)
+{
+    JPEGFile *file = context;
+    file->fp       = fopen(file->path, "wb");
+    if (!file->fp)
+    {
+        Log(Error, "Failed to open %s for writing.", file->path);
+        return false;
+    }
+    if (InitJPEGEncoder(&file->encoder, width, height, channels, &file->settings, WriteJPEGToFile, file->fp) == JPEG_OK)
+        return true;
+
+    CleanUpEncoder(&file->encoder);
+    fclose(file->fp);
+    file->fp = NULL;
+    return false;
+}
+
+static bool JPEGSinkRows(void *context, const uint8_t *rows, uint32_t first_row, uint32_t count)
+{
+    JPEGFile *file = context;
+    (void)first_row;
+    return EncodeJPEGRows(&file->encoder, rows, 0, count) == JPEG_OK;
+}
+
+static bool JPEGSinkFinish(void *context)
+{
+    JPEGFile *file    = context;
+    bool      written = FinishJPEGEncode(&file->encoder) == JPEG_OK;
+    CleanUpEncoder(&file->encoder);
+    written  = !fclose(file->fp) && written;
+    file->fp = NULL;
+    return written;
+}
+
+JPEGRowSink JPEGFileSink(JPEGFile *file)
+{
+    return (JPEGRowSink){.context = file, .begin = JPEGSinkBegin, .write_rows = JPEGSinkRows, .finish = JPEGSinkFinish};
+}
@@ -0,0 +1,24 @@
+#ifndef JPEGSINK_H_
+#define JPEGSINK_H_
+
+#include <stdio.h>
+
+#include "../../Decoder/src/jpeg.h"
+#include "./encoder.h"
+// JPEGRowSink that re-encodes the decoded rows as they come, a transcode that never holds more than an MCU row of
+// pixels on either side
+
+typedef struct JPEGFile
+{
+    const char        *path;
+    JPEGEncodeSettings settings;
+
+    // Set up by begin
+    FILE       *fp;
+    JPEGEncoder encoder;
+} JPEGFile;
+
+// Sink encoding to file->path, the file has to outlive the decode
+JPEGRowSink JPEGFileSink(JPEGFile *file);
+
+#endif // JPEGSINK_H_
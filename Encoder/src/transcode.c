@@ -0,0 +1,598 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "./transcode.h"
+
+#include "../../Decoder/src/exif.h"
+#include "../../utility/log.h"
+
+// Huffman tables of the new scan, one DC and one AC table for luma and another pair shared by the chroma components
+typedef struct Transcoder
+{
+    JPEG             *jpeg;
+    uint32_t          tables; // pairs of tables, 1 for gray images
+    uint8_t           zigzag[64];
+
+    uint32_t          dc_counts[2][256];
+    uint32_t          ac_counts[2][256];
+    HTable            dc_tables[2];
+    HTable            ac_tables[2];
+    uint16_t          symbols[4][256]; // huffman_val and huffman_code of the tables above
+    uint16_t          codes[4][256];
+    HuffmanLookup     dc_codes[2];
+    HuffmanLookup     ac_codes[2];
+
+    // EXIF orientation value to overwrite with 1 while copying the segments, a file offset, 0 for none
+    uint64_t          orientation;
+    bool              big_endian;
+
+    JPEGWriteFunction write;
+    void             *context;
+    JPEGBitWriter     writer;
+} Transcoder;
+
+static uint32_t ComponentTable(uint32_t comp)
+{
+    return comp ? 1 : 0;
+}
+
+// Zigzag ordered copy of a block and its nonzero mask, what EncodeBlock takes
+static uint64_t OrderBlock(const MCUBlock *block, const uint8_t *zigzag, int16_t *ordered)
+{
+    uint64_t nonzero = 0;
+    for (int k = 0; k < 64; ++k)
+    {
+        ordered[k] = block->block[zigzag[k]];
+        nonzero    = nonzero | (uint64_t)(ordered[k] != 0) << k;
+    }
+    return nonzero;
+}
+
+static uint32_t ValueSize(int32_t value)
+{
+    uint32_t magnitude = value < 0 ? -value : value;
+    return magnitude ? 32 - __builtin_clz(magnitude) : 0;
+}
+
+// The symbols EncodeBlock would code for the block, false for values baseline can't code (11 bit DC differences,
+// 10 bit AC values)
+static bool CountBlock(const int16_t *ordered, uint64_t nonzero, uint32_t *dc, uint32_t *ac, int32_t *predictor)
+{
+    uint32_t size = ValueSize(ordered[0] - *predictor);
+    *predictor    = ordered[0];
+    if (size > 11)
+        return false;
+    dc[size]++;
+
+    int last = 0;
+    for (nonzero = nonzero & ~1ull; nonzero; nonzero = nonzero & (nonzero - 1))
+    {
+        int k   = __builtin_ctzll(nonzero);
+        int run = k - last - 1;
+        for (; run > 15; run -= 16)
+            ac[0xF0]++;
+        size = ValueSize(ordered[k]);
+        if (size > 10)
+            return false;
+        ac[run << 4 | size]++;
+        last = k;
+    }
+    if (last != 63)
+        ac[0x00]++;
+    return true;
+}
+
+static bool Flush(Transcoder *transcoder)
+{
+    JPEGBitWriter *writer = &transcoder->writer;
+    if (writer->failed)
+        return SetJPEGError(transcoder->jpeg, JPEG_ERR_OUT_OF_MEMORY);
+    if (writer->size && !transcoder->write(transcoder->context, writer->data, writer->size))
+        return SetJPEGError(transcoder->jpeg, JPEG_ERR_IO);
+    writer->size = 0;
+    return true;
+}
+
+// Every block in coding order, MCUs in raster order with HiVi blocks of each component in them, the same walk
+// DecodeHuffmanStream does. With encode set the blocks get coded into the writer, otherwise their symbols get counted
+static bool WalkScan(Transcoder *transcoder, bool encode)
+{
+    JPEG          *jpeg     = transcoder->jpeg;
+    JPEGInfo      *info     = &jpeg->img;
+    JPEGBitWriter *writer   = &transcoder->writer;
+    const uint32_t interval = info->use_restart_interval ? info->restart_interval : 0;
+
+    uint32_t blocks         = 0;
+    for (uint32_t comp = 0; comp < info->channels; ++comp)
+        blocks = blocks + (info->components[comp].HiVi >> 4) * (info->components[comp].HiVi & 0x0F);
+
+    int32_t  predictors[4] = {0};
+    int16_t  ordered[64];
+    uint64_t mcu           = 0;
+    for (uint32_t row = 0; row < info->mcu_rows; ++row)
+    {
+        if (encode && !ReserveBytes(writer, (uint64_t)info->mcu_cols * (blocks * MAX_BLOCK_BYTES + MAX_MARKER_BYTES)))
+            return SetJPEGError(jpeg, JPEG_ERR_OUT_OF_MEMORY);
+
+        for (uint32_t col = 0; col < info->mcu_cols; ++col, ++mcu)
+        {
+            if (interval && mcu && mcu % interval == 0)
+            {
+                if (encode)
+                {
+                    FlushBits(writer);
+                    PutMarker(writer, RST0 + ((mcu / interval - 1) & 7));
+                }
+                memset(predictors, 0, sizeof(predictors));
+            }
+
+            for (uint32_t comp = 0; comp < info->channels; ++comp)
+            {
+                const JPEGComponent *component = &info->components[comp];
+                const uint32_t       count     = (component->HiVi >> 4) * (component->HiVi & 0x0F);
+                const uint32_t       table     = ComponentTable(comp);
+                const MCUBlock      *block     = component->mcu_blocks + mcu * count;
+                for (uint32_t b = 0; b < count; ++b)
+                {
+                    uint64_t nonzero = OrderBlock(block + b, transcoder->zigzag, ordered);
+                    if (encode)
+                        EncodeBlock(writer, ordered, nonzero, transcoder->dc_codes + table,
+                                    transcoder->ac_codes + table, predictors + comp);
+                    else if (!CountBlock(ordered, nonzero, transcoder->dc_counts[table],
+                                         transcoder->ac_counts[table], predictors + comp))
+                    {
+                        Log(Error, "Coefficient of component %u doesn't fit a baseline scan.", comp);
+                        return SetJPEGError(jpeg, JPEG_ERR_BAD_COEFFICIENT);
+                    }
+                }
+            }
+        }
+        if (encode && writer->size >= FLUSH_BYTES && !Flush(transcoder))
+            return false;
+    }
+    return true;
+}
+
+static bool BuildTables(Transcoder *transcoder)
+{
+    for (uint32_t t = 0; t < transcoder->tables; ++t)
+    {
+        HTable *dc       = transcoder->dc_tables + t;
+        HTable *ac       = transcoder->ac_tables + t;
+        dc->type         = DC;
+        dc->id           = t;
+        dc->huffman_val  = transcoder->symbols[2 * t];
+        dc->huffman_code = transcoder->codes[2 * t];
+        ac->type         = AC;
+        ac->id           = t;
+        ac->huffman_val  = transcoder->symbols[2 * t + 1];
+        ac->huffman_code = transcoder->codes[2 * t + 1];
+
+        OptimalHuffmanTable(transcoder->dc_counts[t], dc);
+        OptimalHuffmanTable(transcoder->ac_counts[t], ac);
+        if (!GenerateHuffmanCodes(dc) || !GenerateHuffmanCodes(ac))
+            return SetJPEGError(transcoder->jpeg, JPEG_ERR_BAD_HUFFMAN);
+        BuildHuffmanLookup(dc, transcoder->dc_codes + t);
+        BuildHuffmanLookup(ac, transcoder->ac_codes + t);
+    }
+    return true;
+}
+
+// Cuts the blocks down to the crop, jpeg->img then describes the cropped image. The decoder already did most of it:
+// the region it worked out starts on the MCU holding the crop origin, and baseline scans only stored its MCUs.
+// Progressive ones keep the coefficients of the whole image, their MCU rows get cut here
+static void CropBlocks(JPEG *jpeg)
+{
+    JPEGInfo      *info       = &jpeg->img;
+    const uint32_t mcu_width  = 8 * info->horizontal_subsampling;
+    const uint32_t mcu_height = 8 * info->vertical_subsampling;
+    const uint32_t x          = info->roi.x / mcu_width;
+    const uint32_t y          = info->roi.y / mcu_height;
+    const uint32_t cols       = (info->roi.x + info->roi.width + mcu_width - 1) / mcu_width - x;
+    const uint32_t rows       = (info->roi.y + info->roi.height + mcu_height - 1) / mcu_height - y;
+
+    for (uint32_t comp = 0; info->progressive && comp < info->channels; ++comp)
+    {
+        JPEGComponent *component = &info->components[comp];
+        const uint32_t blocks    = (component->HiVi >> 4) * (component->HiVi & 0x0F);
+        for (uint32_t row = 0; row < rows; ++row)
+            memmove(component->mcu_blocks + row * cols * blocks,
+                    component->mcu_blocks + ((y + row) * info->mcu_cols + x) * blocks,
+                    sizeof(*component->mcu_blocks) * cols * blocks);
+        component->mcu_counts = cols * rows * blocks;
+    }
+
+    info->width       = info->roi.x + info->roi.width - x * mcu_width;
+    info->height      = info->roi.y + info->roi.height - y * mcu_height;
+    info->mcu_cols    = cols;
+    info->mcu_rows    = rows;
+    info->region_x    = 0;
+    info->region_y    = 0;
+    info->region_cols = cols;
+    info->region_rows = rows;
+    info->roi         = (JPEGRect){0, 0, info->width, info->height};
+}
+
+// What a transform does in the input image: mirror the columns, mirror the rows, then maybe swap rows and columns
+typedef struct TransformSteps
+{
+    bool mirror_x;
+    bool mirror_y;
+    bool transpose;
+} TransformSteps;
+
+static TransformSteps StepsOf(JPEGTransform transform)
+{
+    switch (transform)
+    {
+    case JPEG_TRANSFORM_FLIP_H:
+        return (TransformSteps){true, false, false};
+    case JPEG_TRANSFORM_FLIP_V:
+        return (TransformSteps){false, true, false};
+    case JPEG_TRANSFORM_TRANSPOSE:
+        return (TransformSteps){false, false, true};
+    case JPEG_TRANSFORM_TRANSVERSE:
+        return (TransformSteps){true, true, true};
+    case JPEG_TRANSFORM_ROT_90:
+        return (TransformSteps){false, true, true};
+    case JPEG_TRANSFORM_ROT_180:
+        return (TransformSteps){true, true, false};
+    case JPEG_TRANSFORM_ROT_270:
+        return (TransformSteps){true, false, true};
+    default:
+        return (TransformSteps){false, false, false};
+    }
+}
+
+// EXIF orientations 1 - 8 name how the stored image has to be turned to display upright
+static JPEGTransform OrientationTransform(uint16_t orientation)
+{
+    static const JPEGTransform transforms[9] = {JPEG_TRANSFORM_NONE,      JPEG_TRANSFORM_NONE,
+                                                JPEG_TRANSFORM_FLIP_H,    JPEG_TRANSFORM_ROT_180,
+                                                JPEG_TRANSFORM_FLIP_V,    JPEG_TRANSFORM_TRANSPOSE,
+                                                JPEG_TRANSFORM_ROT_90,    JPEG_TRANSFORM_TRANSVERSE,
+                                                JPEG_TRANSFORM_ROT_270};
+    return orientation < 9 ? transforms[orientation] : JPEG_TRANSFORM_NONE;
+}
+
+// Block (bx, by) of a component, blocks laid out MCU by MCU with mcu_cols MCUs to a row
+static MCUBlock *BlockAt(MCUBlock *blocks, uint8_t HiVi, uint32_t mcu_cols, uint32_t bx, uint32_t by)
+{
+    const uint32_t H   = HiVi >> 4;
+    const uint32_t V   = HiVi & 0x0F;
+    const uint32_t mcu = (by / V) * mcu_cols + bx / H;
+    return blocks + mcu * H * V + (by % V) * H + bx % H;
+}
+
+// Moves every block to where the transform puts it and rewrites its coefficients, jpeg->img and the quantization
+// tables then describe the transformed image. Coefficient (v, u) of the output comes from (u, v) when transposing,
+// and a mirrored axis flips the sign of its odd frequencies
+static bool TransformBlocks(JPEG *jpeg, JPEGTransform transform)
+{
+    const TransformSteps steps = StepsOf(transform);
+    JPEGInfo            *info  = &jpeg->img;
+    if (!steps.mirror_x && !steps.mirror_y && !steps.transpose)
+        return true;
+
+    // Partial MCUs on a mirrored axis get trimmed
+    const uint32_t mcu_width  = 8 * info->horizontal_subsampling;
+    const uint32_t mcu_height = 8 * info->vertical_subsampling;
+    const uint32_t cols       = steps.mirror_x ? info->width / mcu_width : info->mcu_cols;
+    const uint32_t rows       = steps.mirror_y ? info->height / mcu_height : info->mcu_rows;
+    if (!cols || !rows)
+    {
+        Log(Error, "A %ux%u image is too small to be mirrored on whole MCUs.", info->width, info->height);
+        return SetJPEGError(jpeg, JPEG_ERR_UNSUPPORTED);
+    }
+    const uint32_t width  = steps.mirror_x ? cols * mcu_width : info->width;
+    const uint32_t height = steps.mirror_y ? rows * mcu_height : info->height;
+
+    uint8_t source[64];
+    bool    negate[64];
+    for (int v = 0; v < 8; ++v)
+    {
+        for (int u = 0; u < 8; ++u)
+        {
+            // Input coefficient (a, b), row and column frequency
+            int a             = steps.transpose ? u : v;
+            int b             = steps.transpose ? v : u;
+            source[v * 8 + u] = a * 8 + b;
+            negate[v * 8 + u] = (steps.mirror_x && (b & 1)) != (steps.mirror_y && (a & 1));
+        }
+    }
+
+    const uint32_t out_cols = steps.transpose ? rows : cols;
+    const uint32_t out_rows = steps.transpose ? cols : rows;
+    for (uint32_t comp = 0; comp < info->channels; ++comp)
+    {
+        JPEGComponent *component = &info->components[comp];
+        const uint32_t H         = component->HiVi >> 4;
+        const uint32_t V         = component->HiVi & 0x0F;
+        const uint8_t  HiVi      = steps.transpose ? V << 4 | H : component->HiVi;
+        const uint32_t count     = out_cols * out_rows * H * V;
+        MCUBlock      *blocks    = malloc(sizeof(*blocks) * count);
+        if (!blocks)
+            return SetJPEGError(jpeg, JPEG_ERR_OUT_OF_MEMORY);
+
+        for (uint32_t oy = 0; oy < out_rows * (HiVi & 0x0F); ++oy)
+        {
+            for (uint32_t ox = 0; ox < out_cols * (HiVi >> 4); ++ox)
+            {
+                uint32_t        ix  = steps.transpose ? oy : ox;
+                uint32_t        iy  = steps.transpose ? ox : oy;
+                ix                  = steps.mirror_x ? cols * H - 1 - ix : ix;
+                iy                  = steps.mirror_y ? rows * V - 1 - iy : iy;
+                const MCUBlock *in  = BlockAt(component->mcu_blocks, component->HiVi, info->mcu_cols, ix, iy);
+                MCUBlock       *out = BlockAt(blocks, HiVi, out_cols, ox, oy);
+                for (int k = 0; k < 64; ++k)
+                    out->block[k] = negate[k] ? -in->block[source[k]] : in->block[source[k]];
+            }
+        }
+        free(component->mcu_blocks);
+        component->mcu_blocks   = blocks;
+        component->mcu_capacity = count;
+        component->mcu_counts   = count;
+        component->HiVi         = HiVi;
+    }
+
+    // Coefficients keep their quantizers, which move along when transposing
+    for (uint8_t t = 0; t < jpeg->quantization_tables.count && steps.transpose; ++t)
+    {
+        uint16_t *data = jpeg->quantization_tables.qtables[t].data;
+        for (int v = 0; v < 8; ++v)
+        {
+            for (int u = v + 1; u < 8; ++u)
+            {
+                uint16_t swap   = data[v * 8 + u];
+                data[v * 8 + u] = data[u * 8 + v];
+                data[u * 8 + v] = swap;
+            }
+        }
+    }
+
+    info->width    = steps.transpose ? height : width;
+    info->height   = steps.transpose ? width : height;
+    info->mcu_cols = out_cols;
+    info->mcu_rows = out_rows;
+    if (steps.transpose)
+    {
+        uint8_t H                    = info->horizontal_subsampling;
+        info->horizontal_subsampling = info->vertical_subsampling;
+        info->vertical_subsampling   = H;
+    }
+    return true;
+}
+
+// Coefficients go through InverseQuantization and get divided again by the quality scaled Annex K tables, K.1 for
+// the table luma uses and K.2 for the others, each quantizer at least as coarse as the one it replaces
+static bool Requantize(JPEG *jpeg, uint32_t quality)
+{
+    JPEGInfo *info = &jpeg->img;
+    if (!quality || !InverseQuantization(jpeg))
+        return jpeg->error == JPEG_OK;
+
+    for (uint8_t t = 0; t < jpeg->quantization_tables.count; ++t)
+    {
+        QTable *table = &jpeg->quantization_tables.qtables[t];
+        QTable  scaled;
+        ScaledQuantizationTable(&scaled, table->id == info->components[0].qtableptr ? 0 : 1, quality);
+        for (int k = 0; k < 64; ++k)
+            table->data[k] = scaled.data[k] > table->data[k] ? scaled.data[k] : table->data[k];
+    }
+
+    for (uint32_t comp = 0; comp < info->channels; ++comp)
+    {
+        JPEGComponent *component = &info->components[comp];
+        const QTable  *table     = NULL;
+        for (uint8_t t = 0; t < jpeg->quantization_tables.count; ++t)
+            if (jpeg->quantization_tables.qtables[t].id == component->qtableptr)
+                table = &jpeg->quantization_tables.qtables[t];
+
+        // Rounded to nearest, halves away from zero
+        for (uint32_t b = 0; b < component->mcu_counts; ++b)
+        {
+            int16_t *block = component->mcu_blocks[b].block;
+            for (int k = 0; k < 64; ++k)
+            {
+                int32_t q = table->data[k];
+                block[k]  = block[k] < 0 ? -((q / 2 - block[k]) / q) : (block[k] + q / 2) / q;
+            }
+        }
+    }
+    return true;
+}
+
+// APPn and COM segments in front of the first scan, as they are
+static bool CopyMetadata(Transcoder *transcoder)
+{
+    JPEG          *jpeg   = transcoder->jpeg;
+    JPEGBitWriter *writer = &transcoder->writer;
+    uint64_t       pos    = 2;
+    while (pos + 4 <= jpeg->size && jpeg->buffer[pos] == 0xFF)
+    {
+        uint8_t marker = jpeg->buffer[pos + 1];
+        if (marker == 0xFF) // fill byte
+        {
+            pos++;
+            continue;
+        }
+        if (marker == SOS || marker == EOI)
+            break;
+
+        uint64_t length = GetMarkerLength(jpeg->buffer + pos + 2);
+        if (pos + 2 + length > jpeg->size)
+            break;
+        if ((marker & 0xF0) == 0xE0 || marker == COM)
+        {
+            if (!ReserveBytes(writer, 2 + length))
+                return SetJPEGError(jpeg, JPEG_ERR_OUT_OF_MEMORY);
+            memcpy(writer->data + writer->size, jpeg->buffer + pos, 2 + length);
+            if (transcoder->orientation > pos && transcoder->orientation < pos + 2 + length)
+            {
+                uint8_t *value = writer->data + writer->size + (transcoder->orientation - pos);
+                value[0]       = transcoder->big_endian ? 0 : 1;
+                value[1]       = transcoder->big_endian ? 1 : 0;
+            }
+            writer->size = writer->size + 2 + length;
+        }
+        pos = pos + 2 + length;
+    }
+    return true;
+}
+
+// The quantization tables the components use, under their own ids
+static uint32_t UsedQuantizationTables(const JPEG *jpeg, const QTable **used)
+{
+    uint32_t count = 0;
+    for (uint8_t k = 0; k < jpeg->quantization_tables.count; ++k)
+    {
+        bool referenced = false;
+        for (uint32_t comp = 0; comp < jpeg->img.channels; ++comp)
+            referenced = referenced || jpeg->img.components[comp].qtableptr == jpeg->quantization_tables.qtables[k].id;
+        if (referenced)
+            used[count++] = &jpeg->quantization_tables.qtables[k];
+    }
+    return count;
+}
+
+static bool WriteHeaders(Transcoder *transcoder)
+{
+    JPEG          *jpeg   = transcoder->jpeg;
+    JPEGInfo      *info   = &jpeg->img;
+    JPEGBitWriter *writer = &transcoder->writer;
+
+    const QTable  *qtables[6];
+    const uint32_t qcount     = UsedQuantizationTables(jpeg, qtables);
+    uint32_t       dht_length = 2;
+    for (uint32_t t = 0; t < transcoder->tables; ++t)
+        dht_length = dht_length + 34 + transcoder->dc_tables[t].total_codes + transcoder->ac_tables[t].total_codes;
+
+    if (!ReserveBytes(writer, 2))
+        return SetJPEGError(jpeg, JPEG_ERR_OUT_OF_MEMORY);
+    PutMarker(writer, SOI);
+    if (!CopyMetadata(transcoder))
+        return false;
+    if (!ReserveBytes(writer, 64 + 65 * qcount + dht_length))
+        return SetJPEGError(jpeg, JPEG_ERR_OUT_OF_MEMORY);
+
+    // Natural order tables go out in zigzag order, like the encoder writes them
+    PutMarker(writer, DQT);
+    PutWord(writer, 2 + 65 * qcount);
+    for (uint32_t t = 0; t < qcount; ++t)
+    {
+        PutByte(writer, qtables[t]->id);
+        for (int k = 0; k < 64; ++k)
+            PutByte(writer, qtables[t]->data[transcoder->zigzag[k]]);
+    }
+
+    PutMarker(writer, SOF0);
+    PutWord(writer, 8 + 3 * info->channels);
+    PutByte(writer, 8);
+    PutWord(writer, info->height);
+    PutWord(writer, info->width);
+    PutByte(writer, info->channels);
+    for (uint32_t comp = 0; comp < info->channels; ++comp)
+    {
+        PutByte(writer, info->components[comp].identifier);
+        PutByte(writer, info->components[comp].HiVi);
+        PutByte(writer, info->components[comp].qtableptr);
+    }
+
+    PutMarker(writer, DHT);
+    PutWord(writer, dht_length);
+    for (uint32_t t = 0; t < transcoder->tables; ++t)
+    {
+        WriteHuffmanTable(writer, transcoder->dc_tables + t);
+        WriteHuffmanTable(writer, transcoder->ac_tables + t);
+    }
+
+    if (info->use_restart_interval && info->restart_interval)
+    {
+        PutMarker(writer, DRI);
+        PutWord(writer, 4);
+        PutWord(writer, info->restart_interval);
+    }
+
+    PutMarker(writer, SOS);
+    PutWord(writer, 6 + 2 * info->channels);
+    PutByte(writer, info->channels);
+    for (uint32_t comp = 0; comp < info->channels; ++comp)
+    {
+        PutByte(writer, info->components[comp].identifier);
+        PutByte(writer, ComponentTable(comp) << 4 | ComponentTable(comp));
+    }
+    PutByte(writer, 0);  // Ss
+    PutByte(writer, 63); // Se
+    PutByte(writer, 0);  // Ah and Al
+    return true;
+}
+
+JPEGError TranscodeJPEG(JPEG *jpeg, const JPEGTranscodeSettings *settings, JPEGWriteFunction write, void *context)
+{
+    const JPEGTranscodeSettings defaults = {0};
+    settings                             = settings ? settings : &defaults;
+    jpeg->crop              = settings->crop;
+    jpeg->format            = JPEG_OUTPUT_NATIVE;
+    jpeg->sink              = NULL;
+    jpeg->coefficients_only = true;
+    if (DecodeJPEG(jpeg) != JPEG_OK)
+        return jpeg->error;
+    CropBlocks(jpeg);
+
+    Transcoder *transcoder = calloc(1, sizeof(*transcoder));
+    if (!transcoder)
+    {
+        SetJPEGError(jpeg, JPEG_ERR_OUT_OF_MEMORY);
+        return jpeg->error;
+    }
+    transcoder->jpeg    = jpeg;
+    transcoder->tables  = jpeg->img.channels == 1 ? 1 : 2;
+    transcoder->write   = write;
+    transcoder->context = context;
+    BuildZigZagOrder(transcoder->zigzag);
+
+    JPEGTransform transform = settings->transform;
+    EXIFInfo      exif;
+    if (transform == JPEG_TRANSFORM_EXIF)
+    {
+        transform = JPEG_TRANSFORM_NONE;
+        if (ReadEXIF(jpeg->buffer, jpeg->size, &exif) && exif.orientation_offset)
+        {
+            transform               = OrientationTransform(exif.orientation);
+            transcoder->orientation = exif.tiff + exif.orientation_offset;
+            transcoder->big_endian  = exif.big_endian;
+        }
+    }
+
+    // One pass to count the symbols, another one to code them with the tables built from the counts
+    if (TransformBlocks(jpeg, transform) &&
+        Requantize(jpeg, settings->quality) &&
+        WalkScan(transcoder, false) &&
+        BuildTables(transcoder) &&
+        WriteHeaders(transcoder) &&
+        WalkScan(transcoder, true))
+    {
+        JPEGBitWriter *writer = &transcoder->writer;
+        if (!ReserveBytes(writer, MAX_MARKER_BYTES))
+            SetJPEGError(jpeg, JPEG_ERR_OUT_OF_MEMORY);
+        else
+        {
+            FlushBits(writer);
+            PutMarker(writer, EOI);
+            Flush(transcoder);
+        }
+    }
+    free(transcoder->writer.data);
+    free(transcoder);
+    return jpeg->error;
+}
+
+bool JPEGTransformFromString(const char *name, JPEGTransform *transform)
+{
+    static const char *names[] = {"none",   "flip-h", "flip-v", "transpose", "transverse",
+                                  "rot90",  "rot180", "rot270", "exif"};
+    for (int i = 0; i < 9; ++i)
+        if (!strcmp(name, names[i]))
+            return (*transform = (JPEGTransform)i), true;
+    return false;
+}
@@ -0,0 +1,48 @@
+#ifndef TRANSCODE_H_
+#define TRANSCODE_H_
+
+#include "../../Decoder/src/jpeg.h"
+#include "./encoder.h"
+// Recompression in the DCT domain: the scans get entropy decoded into their quantized coefficients and coded again as
+// one baseline scan, with huffman tables built from the image's own symbol counts (Annex K.2) in place of whatever it
+// had. Unless they get requantized the coefficients don't change, so neither do the decoded pixels
+// Quantization tables, sampling factors, component ids, the restart interval and every APPn and COM segment (EXIF,
+// ICC profiles, ...) are kept. Progressive images come out sequential, which can make them bigger
+
+// Lossless rotations and flips, done on the coefficients: blocks get moved around, transposed inside and the odd
+// frequencies along a mirrored axis change sign. A mirrored axis has to end on a whole MCU, so a partial MCU at the
+// right (or bottom) edge that would end up on the other side gets trimmed off, like jpegtran -trim does
+typedef enum JPEGTransform
+{
+    JPEG_TRANSFORM_NONE = 0,
+    JPEG_TRANSFORM_FLIP_H,     // left and right swapped
+    JPEG_TRANSFORM_FLIP_V,     // top and bottom swapped
+    JPEG_TRANSFORM_TRANSPOSE,  // mirrored across the top left to bottom right diagonal
+    JPEG_TRANSFORM_TRANSVERSE, // mirrored across the other diagonal
+    JPEG_TRANSFORM_ROT_90,     // clockwise
+    JPEG_TRANSFORM_ROT_180,
+    JPEG_TRANSFORM_ROT_270,
+    JPEG_TRANSFORM_EXIF        // whatever undoes the EXIF orientation tag, which then gets set to 1
+} JPEGTransform;
+
+typedef struct JPEGTranscodeSettings
+{
+    // Pixels of the source image to keep, zero width or height keeps all of them. The origin moves up and left onto
+    // an MCU boundary since blocks can't be split, the right and bottom edge stay where they are asked for
+    JPEGRect      crop;
+    JPEGTransform transform; // applied after the crop
+    // 1 - 100 requantizes the coefficients to the Annex K tables scaled like the encoder does (lossy, but without
+    // ever going back to pixels), 0 keeps the quantization. A quantizer never gets finer than the image's own one
+    uint32_t      quality;
+} JPEGTranscodeSettings;
+
+// jpeg has to be loaded (LoadJpegFile or ResetJPEGDecoder) but not decoded yet. Its crop, output format and sink get
+// replaced, the image is decoded to coefficients only, and just down to the bottom of the crop for baseline scans
+// (an MCU index in jpeg->index skips the rows above it too). The new file goes out through write, jpeg->img describes
+// it afterwards. settings can be NULL for a plain recompression
+JPEGError TranscodeJPEG(JPEG *jpeg, const JPEGTranscodeSettings *settings, JPEGWriteFunction write, void *context);
+
+// "none", "flip-h", "flip-v", "transpose", "transverse", "rot90", "rot180", "rot270" or "exif"
+bool JPEGTransformFromString(const char *name, JPEGTransform *transform);
+
+#endif // TRANSCODE_H_
@@ -1,5 +1,7 @@
+#include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "bmp.h"
 #include "../utility/log.h"
@@ -38,11 +40,160 @@
 /*     return 0; */
 /* } */
 
+// The header sits at odd offsets, so no direct uint32_t stores into it
+static void PutLE32(uint8_t *ptr, uint32_t val)
+{
+    for (int i = 0; i < 4; ++i)
+        ptr[i] = (val >> (8 * i)) & 0xFF;
+}
+
+// Width, height and the sizes that follow from them, once they are known
+static void FillBMPSizes(uint8_t *header, uint32_t data_offset, uint32_t width, uint32_t height, uint32_t stride,
+                         bool topdown)
+{
+    PutLE32(header + 0x02, stride * height + data_offset);
+    PutLE32(header + 0x12, width);
+    PutLE32(header + 0x16, topdown ? -(int32_t)height : height);
+    PutLE32(header + 0x22, stride * height);
+}
+
+static void RGBToBGRScalar(uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+    for (uint32_t w = 0; w < width; ++w)
+    {
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = src[0];
+        dst    = dst + 3;
+        src    = src + 3;
+    }
+}
+
+static void RGBToBGRAScalar(uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+    for (uint32_t w = 0; w < width; ++w)
+    {
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = src[0];
+        dst[3] = 0xFF;
+        dst    = dst + 4;
+        src    = src + 3;
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BMP_X86_KERNELS
+
+// pshufb swizzles, picked at runtime so the build doesn't need -mssse3 / -mavx2. Loads are 16 bytes wide, so every
+// loop stops while enough pixels are left for its last load to stay inside the row, the scalar code finishes it off
+__attribute__((target("ssse3"))) static void RGBToBGRSSSE3(uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+    // 5 pixels per load, the 16th byte stored belongs to the next pixel which overwrites it right after
+    const __m128i order = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+    uint32_t      w     = 0;
+    for (; w + 6 <= width; w += 5)
+    {
+        __m128i rgb = _mm_loadu_si128((const __m128i *)(src + 3 * w));
+        _mm_storeu_si128((__m128i *)(dst + 3 * w), _mm_shuffle_epi8(rgb, order));
+    }
+    RGBToBGRScalar(dst + 3 * w, src + 3 * w, width - w);
+}
+
+__attribute__((target("ssse3"))) static void RGBToBGRASSSE3(uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+    // 4 pixels per load, alpha lanes are zeroed by the shuffle and set afterwards
+    const __m128i order = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+    uint32_t      w     = 0;
+    for (; w + 6 <= width; w += 4)
+    {
+        __m128i rgb = _mm_loadu_si128((const __m128i *)(src + 3 * w));
+        _mm_storeu_si128((__m128i *)(dst + 4 * w), _mm_or_si128(_mm_shuffle_epi8(rgb, order), alpha));
+    }
+    RGBToBGRAScalar(dst + 4 * w, src + 3 * w, width - w);
+}
+
+// vpshufb only shuffles inside 128 bit lanes, so each lane gets its own load
+__attribute__((target("avx2"))) static void RGBToBGRAVX2(uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+    // 10 pixels, 5 per lane, the two lanes are stored separately as they are 15 bytes apart
+    const __m256i order = _mm256_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15,
+                                           2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+    uint32_t      w     = 0;
+    for (; w + 11 <= width; w += 10)
+    {
+        __m256i rgb = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(src + 3 * w))),
+            _mm_loadu_si128((const __m128i *)(src + 3 * w + 15)), 1);
+        __m256i bgr = _mm256_shuffle_epi8(rgb, order);
+        _mm_storeu_si128((__m128i *)(dst + 3 * w), _mm256_castsi256_si128(bgr));
+        _mm_storeu_si128((__m128i *)(dst + 3 * w + 15), _mm256_extracti128_si256(bgr, 1));
+    }
+    RGBToBGRScalar(dst + 3 * w, src + 3 * w, width - w);
+}
+
+__attribute__((target("avx2"))) static void RGBToBGRAAVX2(uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+    // 8 pixels, 4 per lane, which lines up with a single 32 byte store
+    const __m256i order = _mm256_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+                                           2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    const __m256i alpha = _mm256_set1_epi32((int)0xFF000000);
+    uint32_t      w     = 0;
+    for (; w + 10 <= width; w += 8)
+    {
+        __m256i rgb = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(src + 3 * w))),
+            _mm_loadu_si128((const __m128i *)(src + 3 * w + 12)), 1);
+        _mm256_storeu_si256((__m256i *)(dst + 4 * w), _mm256_or_si256(_mm256_shuffle_epi8(rgb, order), alpha));
+    }
+    RGBToBGRAScalar(dst + 4 * w, src + 3 * w, width - w);
+}
+#endif
+
+static void RGBToBGR(uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+#ifdef BMP_X86_KERNELS
+    if (__builtin_cpu_supports("avx2"))
+        return RGBToBGRAVX2(dst, src, width);
+    if (__builtin_cpu_supports("ssse3"))
+        return RGBToBGRSSSE3(dst, src, width);
+#endif
+    RGBToBGRScalar(dst, src, width);
+}
+
+static void RGBToBGRA(uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+#ifdef BMP_X86_KERNELS
+    if (__builtin_cpu_supports("avx2"))
+        return RGBToBGRAAVX2(dst, src, width);
+    if (__builtin_cpu_supports("ssse3"))
+        return RGBToBGRASSSE3(dst, src, width);
+#endif
+    RGBToBGRAScalar(dst, src, width);
+}
+
+// One row RGB -> BGR or BGRA (gray is copied as is), bytes is the size of a pixel in the file. The padding up to
+// stride gets zeroed
+static void FillBMPRow(uint8_t *dst, const uint8_t *src, uint32_t width, uint32_t channels, uint32_t bytes,
+                       uint32_t stride)
+{
+    if (channels == 1)
+        memcpy(dst, src, width);
+    else if (bytes == 4)
+        RGBToBGRA(dst, src, width);
+    else
+        RGBToBGR(dst, src, width);
+    memset(dst + width * bytes, 0, stride - width * bytes);
+}
+
 void InitBMP(BMP *bmp, uint64_t capacity, uint32_t channels, bool topdown)
 {
     memset(bmp, 0, sizeof(*bmp));
     bmp->capacity = capacity;
     bmp->channels = channels;
+    bmp->depth    = 8 * channels;
     bmp->buffer   = malloc(sizeof(*bmp->buffer) * bmp->capacity);
     if (!bmp->buffer)
     {
@@ -62,8 +213,9 @@ void WriteBMPHeader(BMP *bmp)
     // Size of the bmp file (54 bytes + actual data) at 0x02
     // Size to be filled later
     // TODO :: Fill it later
-    // Offset of actual bitmap data which is 54
-    bmp->buffer[0x0A] = 0x36;
+    // Offset of actual bitmap data which is 54, plus the palette for 8 bit images
+    bmp->data_offset  = bmp->channels == 1 ? 0x36 + 256 * 4 : 0x36;
+    PutLE32(bmp->buffer + 0x0A, bmp->data_offset);
 
     // DIB Header
     bmp->buffer[0x0E] = 0x28; // Number of bytes in the DIB Header section
@@ -72,8 +224,7 @@ void WriteBMPHeader(BMP *bmp)
     // Number of color planes
     bmp->buffer[0x1A] = 0x01;
     // Number of bits per pixel
-    bmp->buffer[0x1C] =
-        0x18; // 24 bits per pixel -- Only channels == 3 supported for now due to jpeg not supporting alpha either way
+    bmp->buffer[0x1C] = bmp->depth; // 24 or 32 bits per pixel for BGR(A), 8 for gray
 
     // TODO :: Fill the size of raw bitmap data at offset 0x22h including padding bytes
 
@@ -83,57 +234,50 @@ void WriteBMPHeader(BMP *bmp)
     bmp->buffer[0x2A] = 0x13;
     bmp->buffer[0x2B] = 0x0B;
 
+    // Gray ramp palette, each entry is B G R 0
+    if (bmp->channels == 1)
+    {
+        PutLE32(bmp->buffer + 0x2E, 256);
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            bmp->buffer[0x36 + 4 * i]     = i;
+            bmp->buffer[0x36 + 4 * i + 1] = i;
+            bmp->buffer[0x36 + 4 * i + 2] = i;
+            bmp->buffer[0x36 + 4 * i + 3] = 0;
+        }
+    }
+
     // Header written with 4 places to be filled
-    bmp->pos = 0x36;
+    bmp->pos = bmp->data_offset;
 }
 
 void WriteBMPData(BMP *bmp, uint8_t *image_data, uint32_t width, uint32_t height, uint32_t channels)
 {
-    // TODO :: Maybe change it?
-    *(uint32_t *)(bmp->buffer + 0x12) = width;
-    *(uint32_t *)(bmp->buffer + 0x16) = height;
-
-    if (bmp->topdown)
-        *(uint32_t*)(bmp->buffer + 0x16) = -(int32_t)height;
-
     // So we have width pixels wide * channels = no.of bytes required
     // Make it to align at 4
     // Use some bit twiddling here and there
-    uint32_t hbytes                   = width * channels;
-    hbytes                            = (hbytes + 3) & ~(4 - 1); // I guess it shoudl align it to the nearest power of 4
-    uint32_t header_size              = hbytes * height + 54;
-    *(uint32_t *)(bmp->buffer + 0x02) = header_size;
-    *(uint32_t *)(bmp->buffer + 0x22) = hbytes * height;
+    uint32_t bytes  = bmp->depth / 8;
+    uint32_t hbytes = width * bytes;
+    hbytes          = (hbytes + 3) & ~(4 - 1); // I guess it shoudl align it to the nearest power of 4
+    FillBMPSizes(bmp->buffer, bmp->data_offset, width, height, hbytes, bmp->topdown);
 
-    // Now write the actual data
-    // OOF Extra work for BGR Space -> RGB Space conversion
-    uint8_t rgbspace[4];
-
-    if (hbytes * height >= bmp->capacity)
+    if (hbytes * height + bmp->data_offset >= bmp->capacity)
     {
         // Could have written to the memory directly but, its good to have modular approach
         Log(Error, "Not enough memory allocated for bmp creation");
         return;
     }
 
-    uint8_t swap;
+    // Now write the actual data
+    // OOF Extra work for BGR Space -> RGB Space conversion
     for (uint32_t h = 0; h < height; ++h)
     {
-        for (uint32_t w = 0; w < width; ++w)
-        {
-            memcpy(rgbspace, image_data, channels);
-            swap        = rgbspace[2];
-            rgbspace[2] = rgbspace[0];
-            rgbspace[0] = swap;
-            image_data  = image_data + channels;
-            // write this buffer to the output of the bitmap data
-            memcpy(bmp->buffer + bmp->pos + w * channels, rgbspace, channels);
-        }
-        bmp->pos = bmp->pos + hbytes;
+        FillBMPRow(bmp->buffer + bmp->pos, image_data, width, channels, bytes, hbytes);
+        image_data = image_data + width * channels;
+        bmp->pos   = bmp->pos + hbytes;
     }
 }
 
-
 void WriteBMPToFile(BMP* bmp, const char* file_path)
 {
     FILE* fp = fopen(file_path,"wb");
@@ -153,3 +297,72 @@ void DestroyBMP(BMP *bmp)
 {
     free(bmp->buffer);
 }
+
+bool OpenBMPStream(BMPStream *bmp, const char *file_path, uint32_t width, uint32_t height, uint32_t channels,
+                   uint32_t depth, bool topdown)
+{
+    memset(bmp, 0, sizeof(*bmp));
+    bmp->fd       = -1;
+    bmp->topdown  = topdown;
+    bmp->width    = width;
+    bmp->height   = height;
+    bmp->channels = channels;
+    bmp->depth    = depth == 32 && channels == 3 ? 32 : 8 * channels;
+    bmp->stride   = (width * (bmp->depth / 8) + 3) & ~3u;
+    bmp->row      = malloc(bmp->stride);
+
+    // Same header as the in memory writer, only with the sizes filled in right away
+    uint8_t header[0x36 + 256 * 4];
+    BMP     prefix = {.buffer = header, .channels = channels, .depth = bmp->depth};
+    WriteBMPHeader(&prefix);
+    bmp->data_offset = prefix.data_offset;
+    FillBMPSizes(header, bmp->data_offset, width, height, bmp->stride, topdown);
+
+    if (bmp->row)
+        bmp->fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (bmp->fd < 0)
+    {
+        Log(Error, "Failed to open %s for writing.", file_path);
+        free(bmp->row);
+        bmp->row = NULL;
+        return false;
+    }
+
+    // Size the file up front, bottom up rows land anywhere in it
+    if (pwrite(bmp->fd, header, bmp->data_offset, 0) != (ssize_t)bmp->data_offset ||
+        ftruncate(bmp->fd, (off_t)bmp->stride * height + bmp->data_offset))
+    {
+        CloseBMPStream(bmp);
+        return false;
+    }
+    return true;
+}
+
+bool WriteBMPRows(BMPStream *bmp, const uint8_t *rows, uint32_t first_row, uint32_t count)
+{
+    if (bmp->fd < 0 || first_row + count > bmp->height)
+        return false;
+
+    for (uint32_t r = 0; r < count; ++r)
+    {
+        uint32_t row    = first_row + r;
+        off_t    offset = bmp->data_offset + (off_t)bmp->stride * (bmp->topdown ? row : bmp->height - 1 - row);
+        FillBMPRow(bmp->row, rows, bmp->width, bmp->channels, bmp->depth / 8, bmp->stride);
+        if (pwrite(bmp->fd, bmp->row, bmp->stride, offset) != (ssize_t)bmp->stride)
+        {
+            Log(Error, "Failed to write row %u of the bmp.", row);
+            return false;
+        }
+        rows = rows + bmp->width * bmp->channels;
+    }
+    return true;
+}
+
+bool CloseBMPStream(BMPStream *bmp)
+{
+    bool closed = bmp->fd < 0 || !close(bmp->fd);
+    free(bmp->row);
+    bmp->fd  = -1;
+    bmp->row = NULL;
+    return closed;
+}
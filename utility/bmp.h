@@ -8,10 +8,11 @@ typedef struct BMP
 {
     // Storage format is BGR
     bool     topdown; // false means bottomup
-    uint8_t  depth;
+    uint8_t  depth;   // bits per pixel in the file, 8 * channels by default, set it to 32 for BGRA from RGB input
     uint32_t width;
     uint32_t height;
-    uint32_t channels; // will usually be 3 in the BGR format
+    uint32_t channels; // will usually be 3 in the BGR format, 1 is written as 8 bit with a gray palette
+    uint32_t data_offset;
     uint8_t *buffer;
     uint64_t pos;
     uint64_t capacity;
@@ -23,4 +24,26 @@ void DestroyBMP(BMP *bmp);
 void WriteBMPData(BMP *bmp, uint8_t *image_data, uint32_t width, uint32_t height, uint32_t channels);
 void WriteBMPToFile(BMP* bmp, const char* file_path);
 
+// Streaming writer, the header goes out first with every size already known and rows follow as they are produced.
+// Only a single padded row is ever buffered, rows are placed with pwrite so they can come in any order
+typedef struct BMPStream
+{
+    int      fd;
+    bool     topdown;
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels; // of the rows handed in, 3 for RGB, 1 for gray
+    uint32_t depth;    // bits per pixel in the file, 8, 24 or 32
+    uint32_t stride;   // bytes per row including the padding to 4
+    uint32_t data_offset;
+    uint8_t *row;
+} BMPStream;
+
+// depth 32 writes BGRA rows (alpha 0xFF) for 3 channel input, anything else 8 * channels
+bool OpenBMPStream(BMPStream *bmp, const char *file_path, uint32_t width, uint32_t height, uint32_t channels,
+                   uint32_t depth, bool topdown);
+// Tightly packed RGB (or gray) rows, first_row counts from the top of the image whatever the storage order
+bool WriteBMPRows(BMPStream *bmp, const uint8_t *rows, uint32_t first_row, uint32_t count);
+bool CloseBMPStream(BMPStream *bmp);
+
 #endif // BMP_H_
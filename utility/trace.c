@@ -0,0 +1,100 @@
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./trace.h"
+
+atomic_int trace_level = TRACE_OFF;
+
+typedef struct TraceRing
+{
+    struct TraceRing *next;
+    uint32_t          thread; // order of the first trace, to tell the dumps apart
+    atomic_uint_least64_t head; // bytes ever written, the next one goes to data[head % TRACE_RING_SIZE]
+    char              data[TRACE_RING_SIZE];
+} TraceRing;
+
+// Rings are only ever pushed, a thread's ring lives on after it exits so its lines can still be dumped
+static _Atomic(TraceRing *) rings;
+static _Thread_local TraceRing *thread_ring;
+
+TraceLevel SetTraceLevel(TraceLevel level)
+{
+    if (level > JPEG_TRACE_LEVEL)
+        level = JPEG_TRACE_LEVEL;
+    atomic_store_explicit(&trace_level, level, memory_order_relaxed);
+    return level;
+}
+
+static TraceRing *ThreadRing(void)
+{
+    if (thread_ring)
+        return thread_ring;
+
+    TraceRing *ring = calloc(1, sizeof(*ring));
+    if (!ring)
+        return NULL;
+    ring->next = atomic_load(&rings);
+    do
+        ring->thread = ring->next ? ring->next->thread + 1 : 0;
+    while (!atomic_compare_exchange_weak(&rings, &ring->next, ring));
+    return thread_ring = ring;
+}
+
+void TraceLine(const char *fmt, ...)
+{
+    TraceRing *ring = ThreadRing();
+    if (!ring)
+        return;
+
+    char    line[512];
+    va_list args;
+    va_start(args, fmt);
+    int length = vsnprintf(line, sizeof(line) - 1, fmt, args);
+    va_end(args);
+    if (length < 0)
+        return;
+    if (length > (int)sizeof(line) - 2)
+        length = sizeof(line) - 2;
+    line[length++] = '\n';
+
+    // Only this thread ever writes the ring, the atomic head is for DumpTraces
+    uint64_t head  = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t start = head % TRACE_RING_SIZE;
+    uint32_t first = length < TRACE_RING_SIZE - start ? length : TRACE_RING_SIZE - start;
+    memcpy(ring->data + start, line, first);
+    memcpy(ring->data, line + first, length - first);
+    atomic_store_explicit(&ring->head, head + length, memory_order_release);
+}
+
+void DumpTraces(FILE *fp)
+{
+    for (TraceRing *ring = atomic_load(&rings); ring; ring = ring->next)
+    {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (!head)
+            continue;
+
+        fprintf(fp, "---- trace of thread %u ----\n", ring->thread);
+        if (head <= TRACE_RING_SIZE)
+        {
+            fwrite(ring->data, 1, head, fp);
+            continue;
+        }
+
+        // Wrapped, the oldest line is cut at the front, start at the one after it
+        uint32_t start = head % TRACE_RING_SIZE;
+        uint32_t skip  = 0;
+        while (skip < TRACE_RING_SIZE && ring->data[(start + skip) % TRACE_RING_SIZE] != '\n')
+            skip++;
+        for (uint32_t i = skip + 1; i < TRACE_RING_SIZE; ++i)
+            fputc(ring->data[(start + i) % TRACE_RING_SIZE], fp);
+    }
+}
+
+void ClearTraces(void)
+{
+    for (TraceRing *ring = atomic_load(&rings); ring; ring = ring->next)
+        atomic_store_explicit(&ring->head, 0, memory_order_relaxed);
+}
@@ -0,0 +1,55 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// Trace points for decoder internals: scan headers, tables and decoded blocks
+// JPEG_TRACE_LEVEL is the most detailed level compiled in, anything above it is constant false and never built. It is
+// TRACE_OFF unless set (cmake -DJPEG_TRACE_LEVEL=n), or TRACE_BLOCKS in -DDEBUG builds. What gets recorded is then
+// picked at runtime with SetTraceLevel. Lines go into a ring buffer of the calling thread without any lock or I/O,
+// nothing is written out until DumpTraces
+
+typedef enum TraceLevel
+{
+    TRACE_OFF = 0,
+    TRACE_SCANS,  // segment level, a few lines per image
+    TRACE_TABLES, // quantization, huffman and zigzag tables
+    TRACE_BLOCKS  // decoded coefficients
+} TraceLevel;
+
+#ifndef JPEG_TRACE_LEVEL
+#ifdef DEBUG
+#define JPEG_TRACE_LEVEL TRACE_BLOCKS
+#else
+#define JPEG_TRACE_LEVEL TRACE_OFF
+#endif
+#endif
+
+#define TRACE_RING_SIZE (64 * 1024) // bytes per thread, the oldest lines get overwritten
+
+extern atomic_int trace_level;
+
+static inline bool TraceEnabled(TraceLevel level)
+{
+    return level <= JPEG_TRACE_LEVEL && (int)level <= atomic_load_explicit(&trace_level, memory_order_relaxed);
+}
+
+#define TRACE(level, ...)                                                                                              \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if (TraceEnabled(level))                                                                                       \
+            TraceLine(__VA_ARGS__);                                                                                    \
+    } while (0)
+
+// Returns the level actually in effect, capped at JPEG_TRACE_LEVEL
+TraceLevel SetTraceLevel(TraceLevel level);
+void       TraceLine(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+// Lines of every thread that traced so far, oldest first. Meant for when the decoders are idle, a thread still tracing
+// meanwhile can tear its last lines
+void DumpTraces(FILE *fp);
+void ClearTraces(void);
+
+#endif // TRACE_H_